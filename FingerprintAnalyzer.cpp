@@ -0,0 +1,604 @@
+/**
+ * Offline analyzer for captured fingerprint module serial traffic.
+ *
+ * Notes:
+ *	-	Traffic can be fed in three ways: a recording made by FingerprintRecorder (e.g. read
+ *		back from an SD card), lines of a logic-analyzer CSV export, or raw chunks of bytes
+ *		with their direction and time. The analyzer only needs the library itself, so it
+ *		can run on the board or be built on a desktop against the same sources.
+ *	-	CSV lines are expected as "<time in seconds>,<TX|RX>,<byte>", where the byte may
+ *		be decimal or hexadecimal with a 0x prefix. This is what an asynchronous serial
+ *		analyzer export looks like once the channel is mapped to a direction. Header and
+ *		other lines which don't parse are ignored.
+ *	-	Command (0x55AA) and response packets are decoded as 12-byte packets. Data packets
+ *		(0x5AA5) carry no length, so their size is inferred from the command they follow,
+ *		as the sensor and driver do.
+ *	-	A command's latency runs from the first byte of the command to the last byte of its
+ *		response; a data packet the sensor sends after the ACK is not part of it. A data
+ *		packet sent to the sensor after the first ACK (e.g. by SetTemplate) gets a response
+ *		of its own, which counts as a second exchange of the same command, timed from the
+ *		first byte of the data packet.
+ *	-	report() prints, per command, the number of responses, ACKs and NACKs, the average
+ *		and maximum latency and a latency histogram; then the NACK codes seen, the gaps
+ *		between packets, checksum failures, bytes discarded while resynchronising, and the
+ *		throughput of each direction.
+ */
+
+// Includes
+#include "FingerprintAnalyzer.h"
+
+// Command codes tracked, in the order their statistics are stored
+static const byte ANA_CMDS[ANA_CMD_COUNT] = {
+	CMD_OPEN, CMD_CLOSE, CMD_USB_INTERNAL_CHECK, CMD_CHANGE_BAUDRATE, CMD_SET_IAP_MODE, CMD_CMOS_LED,
+	CMD_GET_ENROLL_COUNT, CMD_CHECK_ENROLLED, CMD_ENROLL_START, CMD_ENROLL1, CMD_ENROLL2, CMD_ENROLL3,
+	CMD_IS_PRESS_FINGER, CMD_DELETE_ID, CMD_DELETE_ALL, CMD_VERIFY, CMD_IDENTIFY, CMD_VERIFY_TEMPLATE,
+	CMD_IDENTIFY_TEMPLATE, CMD_CAPTURE_FINGER, CMD_MAKE_TEMPLATE, CMD_GET_IMAGE, CMD_GET_RAW_IMAGE, CMD_GET_TEMPLATE,
+	CMD_SET_TEMPLATE
+};
+
+// Upper bounds in milliseconds of the latency histogram buckets, the last bucket is unbounded
+static const dword ANA_HIST_BOUNDS[ANA_HIST_BUCKETS - 1] = { 10, 50, 100, 250, 500, 1000, 2500, 5000 };
+
+// BEGIN PUBLIC
+
+/**
+ * Creates an analyzer with no traffic fed yet.
+ */
+FingerprintAnalyzer::FingerprintAnalyzer() {
+	reset();
+}
+
+/**
+ * Forgets all traffic fed so far.
+ */
+void FingerprintAnalyzer::reset() {
+	memset(mCmd, 0, sizeof(mCmd));
+	memset(mErrCode, 0, sizeof(mErrCode));
+	memset(mErrCount, 0, sizeof(mErrCount));
+	memset(mParser, 0, sizeof(mParser));
+	mPending = false;
+	mPendingCmd = 0;
+	mPendingParam = 0;
+	mPendingStart = 0;
+	mOrphans = 0;
+	mUnanswered = 0;
+	mGapCount = 0;
+	mGapTotal = 0;
+	mGapMax = 0;
+	mLastPktEnd = 0;
+	mAnyPkt = false;
+}
+
+/**
+ * Feeds a chunk of bytes which all went the same way at the same time.
+ *
+ * @param dir The direction of the bytes
+ * @param time The time of the chunk in microseconds
+ * @param buf The bytes
+ * @param size The number of bytes
+ */
+void FingerprintAnalyzer::feed(REC_DIRECTION dir, unsigned long time, const byte* buf, uint32_t size) {
+	for (uint32_t i = 0; i < size; ++i) {
+		feedByte(dir, time, buf[i]);
+	}
+}
+
+/**
+ * Feeds a whole recording made by FingerprintRecorder.
+ *
+ * @param rec The recording, positioned at its start
+ *
+ * @return True if the recording was valid and read to its end, false otherwise
+ */
+bool FingerprintAnalyzer::feedRecording(Stream& rec) {
+	unsigned long time = 0;	// Recorded time of the current chunk
+	int dir;				// Direction byte of the current chunk
+	dword delta;			// Time since the previous chunk
+	dword size;				// Size of the current chunk
+
+	if (rec.read() != REC_MAGIC_1 || rec.read() != REC_MAGIC_2 || rec.read() != REC_MAGIC_3 || rec.read() != REC_VERSION) {
+		return false;
+	}
+
+	while ((dir = rec.read()) >= 0) {
+		if (!readVarint(rec, delta) || !readVarint(rec, size)) {
+			return false;
+		}
+
+		time += delta;
+		for (dword i = 0; i < size; ++i) {
+			int c = rec.read();
+
+			if (c < 0) {
+				return false;
+			}
+
+			feedByte(dir == REC_RX ? REC_RX : REC_TX, time, (byte) c);
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Feeds one line of a logic-analyzer CSV export, formatted as
+ * "<time in seconds>,<TX|RX>,<byte>".
+ *
+ * @param line The line, without its line ending
+ *
+ * @return True if the line held a byte, false if it was ignored
+ */
+bool FingerprintAnalyzer::feedCsvLine(const char* line) {
+	char* end;			// Where parsing of the last field stopped
+	double seconds;		// The time field
+	REC_DIRECTION dir;	// The direction field
+	long value;			// The byte field
+
+	seconds = strtod(line, &end);
+	if (end == line || *end != ',') {
+		return false;
+	}
+
+	line = end + 1;
+	while (*line == ' ') {
+		++line;
+	}
+
+	if (*line == 'T' || *line == 't') {
+		dir = REC_TX;
+	} else if (*line == 'R' || *line == 'r') {
+		dir = REC_RX;
+	} else {
+		return false;
+	}
+
+	while (*line != ',' && *line != '\0') {
+		++line;
+	}
+	if (*line != ',') {
+		return false;
+	}
+
+	value = strtol(line + 1, &end, 0);
+	if (end == line + 1 || value < 0 || value > 0xFF) {
+		return false;
+	}
+
+	feedByte(dir, (unsigned long) (seconds * 1000000.0), (byte) value);
+
+	return true;
+}
+
+/**
+ * Prints the analysis of all traffic fed so far.
+ *
+ * @param out Where to print the report
+ */
+void FingerprintAnalyzer::report(Print& out) {
+	out.println(F("command\tcount\tnack\tavg_ms\tmax_ms\t<10ms\t<50ms\t<100ms\t<250ms\t<500ms\t<1s\t<2.5s\t<5s\t>=5s"));
+
+	for (uint8_t i = 0; i < ANA_CMD_COUNT; ++i) {
+		CmdStats& st = mCmd[i];
+
+		if (st.count == 0) {
+			continue;
+		}
+
+		out.print(cmdName(ANA_CMDS[i]));
+		out.print(F("\t"));
+		out.print(st.count);
+		out.print(F("\t"));
+		out.print(st.nacks);
+		out.print(F("\t"));
+		out.print((double) st.totalLatency / st.count / 1000.0, 1);
+		out.print(F("\t"));
+		out.print(st.maxLatency / 1000.0, 1);
+		for (uint8_t b = 0; b < ANA_HIST_BUCKETS; ++b) {
+			out.print(F("\t"));
+			out.print(st.hist[b]);
+		}
+		out.println();
+	}
+
+	out.println(F("nack codes:"));
+	for (uint8_t i = 0; i < ANA_ERR_SLOTS && mErrCount[i] > 0; ++i) {
+		out.print(F("  "));
+		out.print(errName(mErrCode[i]));
+		out.print(F(" (0x"));
+		out.print(mErrCode[i], HEX);
+		out.print(F("): "));
+		out.println(mErrCount[i]);
+	}
+
+	out.print(F("inter-packet gap: avg "));
+	out.print(mGapCount == 0 ? 0.0 : (double) mGapTotal / mGapCount / 1000.0, 2);
+	out.print(F(" ms, max "));
+	out.print(mGapMax / 1000.0, 2);
+	out.println(F(" ms"));
+
+	out.print(F("unanswered commands: "));
+	out.print(mUnanswered);
+	out.print(F(", orphan responses: "));
+	out.println(mOrphans);
+
+	for (uint8_t d = 0; d < 2; ++d) {
+		Parser& p = mParser[d];
+		unsigned long span = p.lastTime - p.firstTime;
+
+		out.print(d == REC_TX ? F("tx: ") : F("rx: "));
+		out.print(p.bytes);
+		out.print(F(" bytes, "));
+		out.print(p.packets);
+		out.print(F(" packets, "));
+		out.print(p.badChkSums);
+		out.print(F(" checksum failures, "));
+		out.print(p.resyncBytes);
+		out.print(F(" resync bytes, "));
+		out.print(span == 0 ? 0.0 : p.bytes * 1000000.0 / span, 1);
+		out.println(F(" bytes/s"));
+	}
+}
+
+// END PUBLIC
+
+// BEGIN PRIVATE
+
+/**
+ * Runs one byte through the decoder of its direction.
+ *
+ * @param dir The direction of the byte
+ * @param time The time of the byte in microseconds
+ * @param b The byte
+ */
+void FingerprintAnalyzer::feedByte(REC_DIRECTION dir, unsigned long time, byte b) {
+	Parser& p = mParser[dir];
+
+	if (p.bytes == 0) {
+		p.firstTime = time;
+	}
+	++p.bytes;
+	p.lastTime = time;
+
+	// Hunt for the first start code of a packet
+	if (p.pos == 0) {
+		if (b == CMD_START_CODE_1) {
+			p.isData = false;
+			p.pkt[0] = b;
+			p.pos = 1;
+			packetStarted(p, time);
+		} else if (b == DATA_START_CODE_1 && p.dataSize > 0) {
+			p.isData = true;
+			p.sum = b;
+			p.pos = 1;
+			packetStarted(p, time);
+		} else {
+			++p.resyncBytes;
+		}
+		return;
+	}
+
+	// Check the second start code, going back to hunting if it's wrong
+	if (p.pos == 1) {
+		if (b != (p.isData ? DATA_START_CODE_2 : CMD_START_CODE_2)) {
+			++p.resyncBytes;
+			p.pos = 0;
+			--p.bytes;
+			feedByte(dir, time, b);
+			return;
+		}
+	}
+
+	if (!p.isData) {
+		p.pkt[p.pos++] = b;
+
+		if (p.pos == CMD_PKT_SIZE) {
+			packetDone(dir, time);
+			p.pos = 0;
+		}
+	} else {
+		p.sum += b;
+		p.tail[0] = p.tail[1];
+		p.tail[1] = b;
+		++p.pos;
+
+		if (p.pos == p.dataSize + DATA_PKT_ADD) {
+			dataDone(dir, time);
+			p.pos = 0;
+		}
+	}
+}
+
+/**
+ * Notes the start of a packet and measures the gap since the previous one.
+ *
+ * @param p The decoder of the packet's direction
+ * @param time The time of the packet's first byte
+ */
+void FingerprintAnalyzer::packetStarted(Parser& p, unsigned long time) {
+	p.start = time;
+
+	if (mAnyPkt && (long) (time - mLastPktEnd) >= 0) {
+		dword gap = time - mLastPktEnd;
+
+		++mGapCount;
+		mGapTotal += gap;
+		if (gap > mGapMax) {
+			mGapMax = gap;
+		}
+	}
+}
+
+/**
+ * Handles a complete command or response packet.
+ *
+ * @param dir The direction of the packet
+ * @param time The time of the packet's last byte
+ */
+void FingerprintAnalyzer::packetDone(REC_DIRECTION dir, unsigned long time) {
+	Parser& p = mParser[dir];
+	word sum = 0;
+	word code = p.pkt[8] | (p.pkt[9] << 8);
+	dword param = ((dword) p.pkt[7] << 24) | ((dword) p.pkt[6] << 16) | (p.pkt[5] << 8) | p.pkt[4];
+
+	for (uint8_t i = 0; i < 10; ++i) {
+		sum += p.pkt[i];
+	}
+
+	++p.packets;
+	mLastPktEnd = time;
+	mAnyPkt = true;
+
+	if (sum != (word) (p.pkt[10] | (p.pkt[11] << 8))) {
+		++p.badChkSums;
+		return;
+	}
+
+	if (dir == REC_TX) {
+		if (mPending) {
+			++mUnanswered;
+		}
+
+		mPending = true;
+		mPendingCmd = code;
+		mPendingParam = param;
+		mPendingStart = p.start;
+	} else {
+		word cmd = mPendingCmd;
+		dword cmdParam = mPendingParam;
+		bool pending = mPending;
+		bool ack = (code == ACK);
+
+		recordResponse(time, ack, param);
+
+		// Some commands are followed by a data packet once acknowledged
+		if (pending && ack) {
+			mParser[REC_RX].dataSize = dataSizeFor(cmd, cmdParam, REC_RX);
+			mParser[REC_TX].dataSize = dataSizeFor(cmd, cmdParam, REC_TX);
+		}
+	}
+}
+
+/**
+ * Handles a complete data packet.
+ *
+ * @param dir The direction of the packet
+ * @param time The time of the packet's last byte
+ */
+void FingerprintAnalyzer::dataDone(REC_DIRECTION dir, unsigned long time) {
+	Parser& p = mParser[dir];
+	word given = p.tail[0] | (p.tail[1] << 8);
+	word computed = p.sum - p.tail[0] - p.tail[1];
+
+	++p.packets;
+	p.dataSize = 0;
+	mLastPktEnd = time;
+	mAnyPkt = true;
+
+	if (computed != given) {
+		++p.badChkSums;
+	}
+
+	// A data packet sent to the sensor gets its own response, timed from the packet's start
+	if (dir == REC_TX) {
+		mPending = true;
+		mPendingStart = p.start;
+	}
+}
+
+/**
+ * Records the response to the pending command.
+ *
+ * @param time The time of the response's last byte
+ * @param ack True for an ACK, false for a NACK
+ * @param param The response parameter, i.e. the error code of a NACK
+ */
+void FingerprintAnalyzer::recordResponse(unsigned long time, bool ack, dword param) {
+	int8_t idx;		// Index of the command's statistics
+
+	if (!mPending) {
+		++mOrphans;
+		return;
+	}
+	mPending = false;
+
+	idx = cmdIndex(mPendingCmd);
+	if (idx >= 0) {
+		CmdStats& st = mCmd[idx];
+		dword latency = time - mPendingStart;
+		uint8_t b;
+
+		++st.count;
+		st.totalLatency += latency;
+		if (latency > st.maxLatency) {
+			st.maxLatency = latency;
+		}
+
+		for (b = 0; b < ANA_HIST_BUCKETS - 1 && latency >= ANA_HIST_BOUNDS[b] * 1000; ++b);
+		++st.hist[b];
+
+		if (!ack) {
+			++st.nacks;
+		}
+	}
+
+	// Tally the error code, in the first free slot if it wasn't seen yet
+	if (!ack) {
+		for (uint8_t i = 0; i < ANA_ERR_SLOTS; ++i) {
+			if (mErrCount[i] == 0 || mErrCode[i] == (word) param) {
+				mErrCode[i] = param;
+				++mErrCount[i];
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Finds where the statistics of a command are stored.
+ *
+ * @param cmd The command code
+ *
+ * @return The index of the command's statistics, or -1 for an unknown command
+ */
+int8_t FingerprintAnalyzer::cmdIndex(word cmd) {
+	for (uint8_t i = 0; i < ANA_CMD_COUNT; ++i) {
+		if (ANA_CMDS[i] == cmd) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Works out the payload size of the data packet which follows the ACK
+ * of a command in the given direction.
+ *
+ * @param cmd The command code
+ * @param param The command's parameter
+ * @param dir The direction of the data packet
+ *
+ * @return The payload size, or 0 if no data packet follows
+ */
+dword FingerprintAnalyzer::dataSizeFor(word cmd, dword param, REC_DIRECTION dir) {
+	if (dir == REC_RX) {
+		switch (cmd) {
+			case CMD_OPEN:
+				return param != 0 ? DEVICE_INFO_SIZE : 0;
+
+			case CMD_GET_TEMPLATE:
+			case CMD_MAKE_TEMPLATE:
+				return TEMPLATE_SIZE;
+
+			case CMD_GET_IMAGE:
+				return IMAGE_SIZE;
+
+			case CMD_GET_RAW_IMAGE:
+				return RAW_IMAGE_SIZE;
+
+			default:
+				return 0;
+		}
+	}
+
+	switch (cmd) {
+		case CMD_SET_TEMPLATE:
+		case CMD_VERIFY_TEMPLATE:
+		case CMD_IDENTIFY_TEMPLATE:
+			return TEMPLATE_SIZE;
+
+		default:
+			return 0;
+	}
+}
+
+/**
+ * Gives the symbolic name of a command, without its CMD_ prefix.
+ *
+ * @param cmd The command code
+ *
+ * @return The name of the command
+ */
+const __FlashStringHelper* FingerprintAnalyzer::cmdName(word cmd) {
+	switch (cmd) {
+		case CMD_OPEN:					return F("OPEN");
+		case CMD_CLOSE:					return F("CLOSE");
+		case CMD_USB_INTERNAL_CHECK:	return F("USB_INTERNAL_CHECK");
+		case CMD_CHANGE_BAUDRATE:		return F("CHANGE_BAUDRATE");
+		case CMD_SET_IAP_MODE:			return F("SET_IAP_MODE");
+		case CMD_CMOS_LED:				return F("CMOS_LED");
+		case CMD_GET_ENROLL_COUNT:		return F("GET_ENROLL_COUNT");
+		case CMD_CHECK_ENROLLED:		return F("CHECK_ENROLLED");
+		case CMD_ENROLL_START:			return F("ENROLL_START");
+		case CMD_ENROLL1:				return F("ENROLL1");
+		case CMD_ENROLL2:				return F("ENROLL2");
+		case CMD_ENROLL3:				return F("ENROLL3");
+		case CMD_IS_PRESS_FINGER:		return F("IS_PRESS_FINGER");
+		case CMD_DELETE_ID:				return F("DELETE_ID");
+		case CMD_DELETE_ALL:			return F("DELETE_ALL");
+		case CMD_VERIFY:				return F("VERIFY");
+		case CMD_IDENTIFY:				return F("IDENTIFY");
+		case CMD_VERIFY_TEMPLATE:		return F("VERIFY_TEMPLATE");
+		case CMD_IDENTIFY_TEMPLATE:		return F("IDENTIFY_TEMPLATE");
+		case CMD_CAPTURE_FINGER:		return F("CAPTURE_FINGER");
+		case CMD_MAKE_TEMPLATE:			return F("MAKE_TEMPLATE");
+		case CMD_GET_IMAGE:				return F("GET_IMAGE");
+		case CMD_GET_RAW_IMAGE:			return F("GET_RAW_IMAGE");
+		case CMD_GET_TEMPLATE:			return F("GET_TEMPLATE");
+		case CMD_SET_TEMPLATE:			return F("SET_TEMPLATE");
+		default:						return F("unknown");
+	}
+}
+
+/**
+ * Gives the symbolic name of a NACK error code.
+ *
+ * @param err The error code
+ *
+ * @return The name of the error
+ */
+const __FlashStringHelper* FingerprintAnalyzer::errName(word err) {
+	switch (err) {
+		case NACK_INVALID_POS:				return F("NACK_INVALID_POS");
+		case NACK_IS_NOT_USED:				return F("NACK_IS_NOT_USED");
+		case NACK_IS_ALREADY_USED:			return F("NACK_IS_ALREADY_USED");
+		case NACK_COMM_ERR:					return F("NACK_COMM_ERR");
+		case NACK_VERIFY_FAILED:			return F("NACK_VERIFY_FAILED");
+		case NACK_IDENTIFY_FAILED:			return F("NACK_IDENTIFY_FAILED");
+		case NACK_DB_IS_FULL:				return F("NACK_DB_IS_FULL");
+		case NACK_DB_IS_EMPTY:				return F("NACK_DB_IS_EMPTY");
+		case NACK_BAD_FINGER:				return F("NACK_BAD_FINGER");
+		case NACK_ENROLL_FAILED:			return F("NACK_ENROLL_FAILED");
+		case NACK_IS_NOT_SUPPORTED:			return F("NACK_IS_NOT_SUPPORTED");
+		case NACK_DEV_ERR:					return F("NACK_DEV_ERR");
+		case NACK_INVALID_PARAM:			return F("NACK_INVALID_PARAM");
+		case NACK_FINGER_IS_NOT_PRESSED:	return F("NACK_FINGER_IS_NOT_PRESSED");
+		default:							return F("unknown");
+	}
+}
+
+/**
+ * Reads a varint from a recording.
+ *
+ * @param rec The recording
+ * @param value Filled in with the value read
+ *
+ * @return True if a complete varint was read, false otherwise
+ */
+bool FingerprintAnalyzer::readVarint(Stream& rec, dword& value) {
+	int c;				// The byte being read
+	uint8_t shift = 0;	// Position of the bits held by the byte
+
+	value = 0;
+	do {
+		c = rec.read();
+		if (c < 0 || shift > 28) {
+			return false;
+		}
+
+		value |= (dword) (c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return true;
+}
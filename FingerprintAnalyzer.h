@@ -0,0 +1,86 @@
+#ifndef FINGERPRINT_ANALYZER_H
+#define FINGERPRINT_ANALYZER_H
+
+/* Includes */
+#include <Arduino.h>
+#include "FingerprintModule.h"
+#include "FingerprintRecorder.h"
+
+/* Symbolic constants */
+// The number of distinct command codes tracked
+#define ANA_CMD_COUNT 25
+
+// The number of latency histogram buckets, see the upper bounds in FingerprintAnalyzer.cpp
+#define ANA_HIST_BUCKETS 9
+
+// The number of distinct NACK error codes tracked
+#define ANA_ERR_SLOTS 16
+
+/* Class definition */
+// Decodes captured serial traffic and reports per-command timing
+class FingerprintAnalyzer {
+	private:
+		// Statistics kept for each command code
+		struct CmdStats {
+			dword count;					// Number of responses received
+			dword nacks;					// Number of NACK responses
+			uint64_t totalLatency;			// Sum of latencies in microseconds
+			dword maxLatency;				// Largest latency in microseconds
+			dword hist[ANA_HIST_BUCKETS];	// Latency histogram
+		};
+
+		// Decoding state of one direction of the traffic
+		struct Parser {
+			dword pos;						// Bytes of the current packet received so far (0 when hunting)
+			bool isData;					// True if the current packet is a data packet
+			byte pkt[CMD_PKT_SIZE];			// The current command or response packet
+			dword dataSize;					// Expected payload size of the next data packet, 0 if none expected
+			word sum;						// Running sum of the data packet bytes
+			byte tail[2];					// The last two bytes of the data packet, i.e. its checksum
+			unsigned long start;			// Time at which the current packet started
+			dword bytes;					// Total bytes seen in this direction
+			unsigned long firstTime;		// Time of the first byte seen
+			unsigned long lastTime;			// Time of the last byte seen
+			dword packets;					// Complete packets decoded
+			dword badChkSums;				// Packets whose checksum did not match
+			dword resyncBytes;				// Bytes thrown away while hunting for a packet header
+		};
+
+		CmdStats mCmd[ANA_CMD_COUNT];		// Statistics per command, in the order of the command table
+		word mErrCode[ANA_ERR_SLOTS];		// NACK error codes seen
+		dword mErrCount[ANA_ERR_SLOTS];		// Number of times each NACK error code was seen
+		Parser mParser[2];					// Decoding state, indexed by REC_DIRECTION
+		bool mPending;						// True while a command awaits its response
+		word mPendingCmd;					// The command awaiting its response
+		dword mPendingParam;				// The parameter of that command
+		unsigned long mPendingStart;		// Time at which that command started
+		dword mOrphans;						// Responses received with no command pending
+		dword mUnanswered;					// Commands sent before the previous one was answered
+		dword mGapCount;					// Number of inter-packet gaps measured
+		dword mGapTotal;					// Sum of inter-packet gaps in microseconds
+		dword mGapMax;						// Largest inter-packet gap in microseconds
+		unsigned long mLastPktEnd;			// Time at which the last packet in either direction ended
+		bool mAnyPkt;						// True once a packet has been decoded
+
+		void feedByte(REC_DIRECTION, unsigned long, byte);
+		void packetStarted(Parser&, unsigned long);
+		void packetDone(REC_DIRECTION, unsigned long);
+		void dataDone(REC_DIRECTION, unsigned long);
+		void recordResponse(unsigned long, bool, dword);
+		int8_t cmdIndex(word);
+		static dword dataSizeFor(word, dword, REC_DIRECTION);
+		static const __FlashStringHelper* cmdName(word);
+		static const __FlashStringHelper* errName(word);
+		static bool readVarint(Stream&, dword&);
+
+	public:
+		FingerprintAnalyzer();
+
+		void reset();
+		void feed(REC_DIRECTION, unsigned long, const byte*, uint32_t);
+		bool feedRecording(Stream&);
+		bool feedCsvLine(const char*);
+		void report(Print&);
+};
+
+#endif
@@ -0,0 +1,550 @@
+/**
+ * Append-only archive of fingerprint images, e.g. every GET_IMAGE capture kept for audit.
+ *
+ * Notes:
+ *	-	An archive lives in two storages: the data, holding one record per image, and
+ *		the index, holding one fixed-size entry per image. Both start with the magic
+ *		bytes 'F' 'P', 'A' for the data or 'X' for the index, and ARC_VERSION.
+ *	-	Each data record is a 16-byte header followed by the stored image: the magic
+ *		bytes 'F' 'I', the format (ARC_FORMAT), the sensor, the ID (2 bytes), the quality,
+ *		a reserved byte, the time (4 bytes) and the length of the stored image (4 bytes).
+ *	-	Each index entry is 16 bytes: the position of the record in the data (4 bytes),
+ *		the length of the stored image (4 bytes), the time (4 bytes), the ID (2 bytes),
+ *		the sensor and the quality. All values are little-endian, as on the wire.
+ *	-	Entry n sits at a fixed position in the index, so any image is found with one
+ *		read of the index and one of the data, with no scan. Scanning the index reads
+ *		ARC_SCAN_BLOCK entries at a time, without ever touching the images.
+ *	-	Images can be stored compressed by FingerprintEncoder (ARC_CODEC), typically half
+ *		the size. The length in the index is then the compressed length, readImage()
+ *		reads compressed bytes, and streamImage() decompresses on the way out.
+ *	-	An image is written to the data before its entry is written to the index. If
+ *		power is lost in between, begin() rebuilds the missing entries from the records'
+ *		headers. A record cut short is completed with zeroes up to the length its header
+ *		declares, and indexed as it then is: left as it was, the next record appended
+ *		would be read as the rest of it should its own index entry be lost too.
+ */
+
+// Includes
+#include "FingerprintArchive.h"
+
+// BEGIN FINGERPRINTSTORAGE PUBLIC
+
+/**
+ * Writes any buffered bytes out to the medium. Nothing to do by default.
+ */
+void FingerprintStorage::flush() {
+}
+
+// END FINGERPRINTSTORAGE PUBLIC
+
+// BEGIN FINGERPRINTMEMORYSTORAGE PUBLIC
+
+/**
+ * Creates an empty storage in the given buffer.
+ *
+ * @param buf The buffer to hold the bytes
+ * @param capacity The size of the buffer
+ */
+FingerprintMemoryStorage::FingerprintMemoryStorage(byte* buf, dword capacity) {
+	mBuf = buf;
+	mCapacity = capacity;
+	mSize = 0;
+}
+
+/**
+ * Retrieves the number of bytes stored.
+ *
+ * @return The number of bytes
+ */
+dword FingerprintMemoryStorage::size() {
+	return mSize;
+}
+
+/**
+ * Reads stored bytes.
+ *
+ * @param pos The position of the first byte to read
+ * @param buf Where to put the bytes
+ * @param len The number of bytes to read
+ *
+ * @return True if all the bytes were stored, false otherwise
+ */
+bool FingerprintMemoryStorage::read(dword pos, byte* buf, dword len) {
+	if (pos > mSize || len > mSize - pos) {
+		return false;
+	}
+
+	memcpy(buf, &mBuf[pos], len);
+
+	return true;
+}
+
+/**
+ * Adds bytes at the end of the storage, unless they don't all fit.
+ *
+ * @param buf The bytes to add
+ * @param len The number of bytes
+ *
+ * @return True if the bytes were added, false if the buffer was too full
+ */
+bool FingerprintMemoryStorage::append(const byte* buf, dword len) {
+	if (len > mCapacity - mSize) {
+		return false;
+	}
+
+	memcpy(&mBuf[mSize], buf, len);
+	mSize += len;
+
+	return true;
+}
+
+// END FINGERPRINTMEMORYSTORAGE PUBLIC
+
+// BEGIN FINGERPRINTARCHIVE PUBLIC
+
+/**
+ * Creates an archive over the given storages. Call begin() before using it.
+ *
+ * @param data Where the images go
+ * @param index Where the index goes
+ */
+FingerprintArchive::FingerprintArchive(FingerprintStorage& data, FingerprintStorage& index) : mData(data), mIndex(index) {
+	mCount = 0;
+	mEnd = ARC_HEADER_SIZE;
+	mRecovered = 0;
+	mScanFirst = 0;
+	mScanLen = 0;
+	mScanNext = 0;
+}
+
+/**
+ * Starts a new archive if both storages are empty, or opens the existing
+ * one, rebuilding any index entries lost when power failed after an image
+ * was written, and completing an image cut short.
+ *
+ * @return True if the archive is ready, false if a storage holds something else or is damaged
+ */
+bool FingerprintArchive::begin() {
+	ArchiveEntry entry;	// The entry of the last indexed image, then of each record found past it
+	byte format;		// The format of a record found past the last indexed one
+	byte header[ARC_HEADER_SIZE] = { ARC_MAGIC_1, ARC_MAGIC_2, 0, ARC_VERSION };
+
+	mCount = 0;
+	mEnd = ARC_HEADER_SIZE;
+	mRecovered = 0;
+	rewind();
+
+	// Start a new archive
+	if (mData.size() == 0 && mIndex.size() == 0) {
+		header[2] = ARC_DATA_MAGIC;
+		if (!mData.append(header, ARC_HEADER_SIZE)) {
+			return false;
+		}
+
+		header[2] = ARC_INDEX_MAGIC;
+		if (!mIndex.append(header, ARC_HEADER_SIZE)) {
+			return false;
+		}
+
+		mData.flush();
+		mIndex.flush();
+		return true;
+	}
+
+	// A partly written index entry can't be overwritten, so the index is damaged
+	if (!checkHeader(mData, ARC_DATA_MAGIC) || !checkHeader(mIndex, ARC_INDEX_MAGIC) || (mIndex.size() - ARC_HEADER_SIZE) % ARC_INDEX_ENTRY_SIZE != 0) {
+		return false;
+	}
+
+	mCount = (mIndex.size() - ARC_HEADER_SIZE) / ARC_INDEX_ENTRY_SIZE;
+	if (mCount > 0) {
+		if (!getEntry(mCount - 1, entry)) {
+			return false;
+		}
+		mEnd = entry.offset + ARC_RECORD_HEADER_SIZE + entry.length;
+	}
+
+	// Index the complete records written after the last indexed one
+	while (readHeader(mEnd, entry, format) && entry.length <= mData.size() - mEnd - ARC_RECORD_HEADER_SIZE) {
+		if (!appendIndex(entry)) {
+			return false;
+		}
+		++mRecovered;
+	}
+
+	// Complete a record cut short before appending after it, then index it too
+	if (mEnd < mData.size()) {
+		if (!completeRecord() || !readHeader(mEnd, entry, format) || !appendIndex(entry)) {
+			return false;
+		}
+		++mRecovered;
+	}
+
+	mIndex.flush();
+
+	return true;
+}
+
+/**
+ * Archives an image, typically straight after getImage() with getData().
+ *
+ * @param sensor The sensor which captured the image
+ * @param id The enrollment ID the image belongs to
+ * @param time The capture time, e.g. seconds since the epoch
+ * @param quality A quality score for the image
+ * @param image The image
+ * @param length The size of the image, IMAGE_SIZE for a full image
+ * @param format How the image is stored, ARC_CODEC if compressed by FingerprintEncoder (default ARC_RAW)
+ *
+ * @return True if the image was archived, false if a storage is full or failed
+ */
+bool FingerprintArchive::append(uint8_t sensor, word id, dword time, uint8_t quality, const byte* image, dword length, ARC_FORMAT format) {
+	byte header[ARC_RECORD_HEADER_SIZE];	// The header of the record
+	ArchiveEntry entry;						// The index entry of the image
+
+	entry.offset = mData.size();
+	entry.length = length;
+	entry.time = time;
+	entry.id = id;
+	entry.sensor = sensor;
+	entry.quality = quality;
+
+	header[0] = ARC_RECORD_MAGIC_1;
+	header[1] = ARC_RECORD_MAGIC_2;
+	header[2] = format;
+	header[3] = sensor;
+	header[4] = id & 0xFF;
+	header[5] = id >> 8;
+	header[6] = quality;
+	header[7] = 0x00;
+	putDword(&header[8], time);
+	putDword(&header[12], length);
+
+	// The image goes down first, so a lost index entry can always be rebuilt from it
+	if (!mData.append(header, ARC_RECORD_HEADER_SIZE) || !mData.append(image, length)) {
+		return false;
+	}
+	mData.flush();
+
+	if (!appendIndex(entry)) {
+		return false;
+	}
+	mIndex.flush();
+
+	return true;
+}
+
+/**
+ * Retrieves the number of images archived.
+ *
+ * @return The number of images
+ */
+dword FingerprintArchive::getCount() {
+	return mCount;
+}
+
+/**
+ * Retrieves the number of index entries begin() rebuilt from the data.
+ *
+ * @return The number of entries
+ */
+dword FingerprintArchive::getRecoveredCount() {
+	return mRecovered;
+}
+
+/**
+ * Retrieves the index entry of any image, reading only that entry.
+ *
+ * @param n The number of the image, 0 being the first archived
+ * @param entry Filled in with the entry
+ *
+ * @return True if the entry was read, false if there is no such image or the read failed
+ */
+bool FingerprintArchive::getEntry(dword n, ArchiveEntry& entry) {
+	byte buf[ARC_INDEX_ENTRY_SIZE];	// The raw entry
+
+	if (n >= mCount || !mIndex.read(ARC_HEADER_SIZE + n * ARC_INDEX_ENTRY_SIZE, buf, ARC_INDEX_ENTRY_SIZE)) {
+		return false;
+	}
+
+	parseEntry(buf, entry);
+
+	return true;
+}
+
+/**
+ * Sets where next() starts scanning the index.
+ *
+ * @param first The number of the first image to return
+ */
+void FingerprintArchive::rewind(dword first) {
+	mScanNext = first;
+	mScanLen = 0;
+}
+
+/**
+ * Retrieves the next index entry in a scan, reading the index a block of
+ * entries at a time.
+ *
+ * @param entry Filled in with the entry
+ *
+ * @return True if an entry was read, false at the end of the index or if a read failed
+ */
+bool FingerprintArchive::next(ArchiveEntry& entry) {
+	if (mScanNext >= mCount) {
+		return false;
+	}
+
+	if (mScanLen == 0 || mScanNext < mScanFirst || mScanNext >= mScanFirst + mScanLen) {
+		mScanFirst = mScanNext;
+		mScanLen = min((dword) ARC_SCAN_BLOCK, mCount - mScanFirst);
+
+		if (!mIndex.read(ARC_HEADER_SIZE + mScanFirst * ARC_INDEX_ENTRY_SIZE, mScanBuf, mScanLen * ARC_INDEX_ENTRY_SIZE)) {
+			mScanLen = 0;
+			return false;
+		}
+	}
+
+	parseEntry(&mScanBuf[(mScanNext - mScanFirst) * ARC_INDEX_ENTRY_SIZE], entry);
+	++mScanNext;
+
+	return true;
+}
+
+/**
+ * Retrieves how an archived image is stored, from its record's header.
+ *
+ * @param entry The image's index entry
+ * @param format Filled in with the format
+ *
+ * @return True if the header was read, false otherwise
+ */
+bool FingerprintArchive::getFormat(const ArchiveEntry& entry, ARC_FORMAT& format) {
+	ArchiveEntry header;	// The entry the header describes
+	byte raw;				// The format byte of the header
+
+	if (!readHeader(entry.offset, header, raw)) {
+		return false;
+	}
+
+	format = (ARC_FORMAT) raw;
+
+	return true;
+}
+
+/**
+ * Reads part or all of an archived image as stored, i.e. compressed for
+ * ARC_CODEC. Only the requested bytes are read, so e.g. a single row of a
+ * raw image costs one small read.
+ *
+ * @param entry The image's index entry
+ * @param from The position of the first byte to read within the stored image
+ * @param buf Where to put the bytes
+ * @param len The number of bytes to read
+ *
+ * @return True if the bytes were read, false if they are outside the image or the read failed
+ */
+bool FingerprintArchive::readImage(const ArchiveEntry& entry, dword from, byte* buf, dword len) {
+	if (from > entry.length || len > entry.length - from) {
+		return false;
+	}
+
+	return mData.read(entry.offset + ARC_RECORD_HEADER_SIZE + from, buf, len);
+}
+
+/**
+ * Writes a whole archived image to the given output, ARC_CHUNK_SIZE bytes
+ * at a time, e.g. to send it over a network without a 51,840-byte buffer.
+ * Compressed images are decompressed on the way unless told otherwise,
+ * e.g. to send them over a slow link as they are.
+ *
+ * @param entry The image's index entry
+ * @param out Where to write the image
+ * @param decode True to write compressed images decompressed (default), false to write them as stored
+ *
+ * @return True if the whole image was read and written, false otherwise
+ */
+bool FingerprintArchive::streamImage(const ArchiveEntry& entry, Print& out, bool decode) {
+	byte chunk[ARC_CHUNK_SIZE];		// The bytes being moved
+	dword pos;						// Position of the chunk within the image
+	dword len;						// Size of the chunk
+	ARC_FORMAT format;				// How the image is stored
+	FingerprintDecoder decoder(out);	// Decompresses ARC_CODEC images
+	Print* dest = &out;				// Where the stored bytes go
+
+	if (!getFormat(entry, format)) {
+		return false;
+	}
+
+	if (decode && format == ARC_CODEC) {
+		dest = &decoder;
+	}
+
+	for (pos = 0; pos < entry.length; pos += len) {
+		len = min((dword) ARC_CHUNK_SIZE, entry.length - pos);
+
+		if (!readImage(entry, pos, chunk, len) || dest->write(chunk, len) != len) {
+			return false;
+		}
+	}
+
+	return dest == &out || decoder.isDone();
+}
+
+// END FINGERPRINTARCHIVE PUBLIC
+
+// BEGIN FINGERPRINTARCHIVE PRIVATE
+
+/**
+ * Writes an index entry at the end of the index and moves past its record.
+ *
+ * @param entry The entry to write
+ *
+ * @return True if the entry was written, false otherwise
+ */
+bool FingerprintArchive::appendIndex(const ArchiveEntry& entry) {
+	byte buf[ARC_INDEX_ENTRY_SIZE];	// The raw entry
+
+	putDword(&buf[0], entry.offset);
+	putDword(&buf[4], entry.length);
+	putDword(&buf[8], entry.time);
+	buf[12] = entry.id & 0xFF;
+	buf[13] = entry.id >> 8;
+	buf[14] = entry.sensor;
+	buf[15] = entry.quality;
+
+	if (!mIndex.append(buf, ARC_INDEX_ENTRY_SIZE)) {
+		return false;
+	}
+
+	++mCount;
+	mEnd = entry.offset + ARC_RECORD_HEADER_SIZE + entry.length;
+
+	return true;
+}
+
+/**
+ * Completes the record cut short at the end of the data: writes the rest of
+ * its header, with zeroes where the length was not written so it isn't made
+ * any longer, then zeroes up to the length the header declares.
+ *
+ * @return True if the record was completed, false if the data past the last record isn't one or a write failed
+ */
+bool FingerprintArchive::completeRecord() {
+	byte header[ARC_RECORD_HEADER_SIZE] = { ARC_RECORD_MAGIC_1, ARC_RECORD_MAGIC_2 };	// A header of zeroes
+	byte zeroes[ARC_CHUNK_SIZE] = { 0 };	// Padding for the image
+	byte written[2];						// The magic bytes as written
+	dword have = min(mData.size() - mEnd, (dword) ARC_RECORD_HEADER_SIZE);	// Bytes of the header written
+	dword length;							// Length of the record as declared
+	dword pad;								// Bytes of padding still to write
+
+	// Whatever was written must be the start of a record
+	if (!mData.read(mEnd, written, min(have, (dword) 2)) || written[0] != ARC_RECORD_MAGIC_1 || (have > 1 && written[1] != ARC_RECORD_MAGIC_2)) {
+		return false;
+	}
+
+	if (have < ARC_RECORD_HEADER_SIZE && !mData.append(&header[have], ARC_RECORD_HEADER_SIZE - have)) {
+		return false;
+	}
+
+	if (!mData.read(mEnd + 12, header, 4)) {
+		return false;
+	}
+	length = getDword(header);
+
+	for (pad = mEnd + ARC_RECORD_HEADER_SIZE + length - mData.size(); pad > 0; pad -= min(pad, (dword) ARC_CHUNK_SIZE)) {
+		if (!mData.append(zeroes, min(pad, (dword) ARC_CHUNK_SIZE))) {
+			return false;
+		}
+	}
+
+	mData.flush();
+
+	return true;
+}
+
+/**
+ * Reads the header of the record at the given position in the data.
+ *
+ * @param pos The position of the record
+ * @param entry Filled in with the index entry the header describes
+ * @param format Filled in with the format of the stored image
+ *
+ * @return True if a header with the right magic bytes was read, false otherwise
+ */
+bool FingerprintArchive::readHeader(dword pos, ArchiveEntry& entry, byte& format) {
+	byte header[ARC_RECORD_HEADER_SIZE];	// The raw header
+
+	if (pos > mData.size() || mData.size() - pos < ARC_RECORD_HEADER_SIZE || !mData.read(pos, header, ARC_RECORD_HEADER_SIZE)) {
+		return false;
+	}
+
+	if (header[0] != ARC_RECORD_MAGIC_1 || header[1] != ARC_RECORD_MAGIC_2) {
+		return false;
+	}
+
+	format = header[2];
+	entry.offset = pos;
+	entry.sensor = header[3];
+	entry.id = (header[5] << 8) | header[4];
+	entry.quality = header[6];
+	entry.time = getDword(&header[8]);
+	entry.length = getDword(&header[12]);
+
+	return true;
+}
+
+/**
+ * Checks the magic bytes and version at the start of a storage.
+ *
+ * @param storage The storage to check
+ * @param magic The magic byte telling the data from the index
+ *
+ * @return True if the storage starts with the expected header, false otherwise
+ */
+bool FingerprintArchive::checkHeader(FingerprintStorage& storage, byte magic) {
+	byte header[ARC_HEADER_SIZE];	// The header read
+
+	return storage.size() >= ARC_HEADER_SIZE && storage.read(0, header, ARC_HEADER_SIZE)
+		&& header[0] == ARC_MAGIC_1 && header[1] == ARC_MAGIC_2 && header[2] == magic && header[3] == ARC_VERSION;
+}
+
+/**
+ * Decodes a raw index entry.
+ *
+ * @param buf The raw entry
+ * @param entry Filled in with the entry
+ */
+void FingerprintArchive::parseEntry(const byte* buf, ArchiveEntry& entry) {
+	entry.offset = getDword(&buf[0]);
+	entry.length = getDword(&buf[4]);
+	entry.time = getDword(&buf[8]);
+	entry.id = (buf[13] << 8) | buf[12];
+	entry.sensor = buf[14];
+	entry.quality = buf[15];
+}
+
+/**
+ * Stores a double-word as 4 little-endian bytes.
+ *
+ * @param buf Where to store it
+ * @param value The double-word
+ */
+void FingerprintArchive::putDword(byte* buf, dword value) {
+	for (uint8_t i = 0; i < 4; ++i) {
+		buf[i] = (value >> (8 * i)) & 0xFF;
+	}
+}
+
+/**
+ * Reads a double-word stored as 4 little-endian bytes.
+ *
+ * @param buf Where it is stored
+ *
+ * @return The double-word
+ */
+dword FingerprintArchive::getDword(const byte* buf) {
+	return ((dword) buf[3] << 24) | ((dword) buf[2] << 16) | ((dword) buf[1] << 8) | buf[0];
+}
+
+// END FINGERPRINTARCHIVE PRIVATE
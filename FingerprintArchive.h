@@ -0,0 +1,111 @@
+#ifndef FINGERPRINT_ARCHIVE_H
+#define FINGERPRINT_ARCHIVE_H
+
+/* Includes */
+#include <Arduino.h>
+#include "FingerprintModule.h"
+#include "FingerprintCodec.h"
+
+/* Symbolic constants */
+// Magic bytes and format version starting both the data and the index of an archive
+#define ARC_MAGIC_1 'F'
+#define ARC_MAGIC_2 'P'
+#define ARC_DATA_MAGIC 'A'
+#define ARC_INDEX_MAGIC 'X'
+#define ARC_VERSION 1
+#define ARC_HEADER_SIZE 4
+
+// Magic bytes starting each record in the data
+#define ARC_RECORD_MAGIC_1 'F'
+#define ARC_RECORD_MAGIC_2 'I'
+
+// The size of the header of each record in the data, and of each entry in the index
+#define ARC_RECORD_HEADER_SIZE 16
+#define ARC_INDEX_ENTRY_SIZE 16
+
+// The number of index entries read at a time while scanning
+#define ARC_SCAN_BLOCK 8
+
+// The number of image bytes moved at a time while streaming
+#define ARC_CHUNK_SIZE 64
+
+/* Enumerations */
+// How the image of a record is stored
+enum ARC_FORMAT {
+	ARC_RAW = 0,	// One byte per pixel, as sent by the sensor
+	ARC_CODEC = 1	// Compressed with FingerprintEncoder
+};
+
+/* Structures */
+// What the index holds about each archived image
+struct ArchiveEntry {
+	dword offset;		// Position of the image's record in the data
+	dword length;		// Number of bytes stored for the image
+	dword time;			// Capture time as given when archiving, e.g. seconds since the epoch
+	word id;			// Enrollment ID the image belongs to, or whatever the application uses
+	uint8_t sensor;		// The sensor which captured the image
+	uint8_t quality;	// Quality score given when archiving
+};
+
+/* Class definitions */
+// Somewhere bytes can be appended to and read back from anywhere, e.g. a file on an SD card
+class FingerprintStorage {
+	public:
+		virtual dword size() = 0;
+		virtual bool read(dword, byte*, dword) = 0;
+		virtual bool append(const byte*, dword) = 0;
+		virtual void flush();
+};
+
+// Storage in a buffer in RAM, for small archives or for running the archive on a desktop
+class FingerprintMemoryStorage : public FingerprintStorage {
+	private:
+		byte* mBuf;			// The buffer holding the bytes
+		dword mCapacity;	// The size of the buffer
+		dword mSize;		// Number of bytes stored
+
+	public:
+		FingerprintMemoryStorage(byte*, dword);
+
+		dword size();
+		bool read(dword, byte*, dword);
+		bool append(const byte*, dword);
+};
+
+// Append-only archive of fingerprint images with an index of fixed-size entries
+class FingerprintArchive {
+	private:
+		FingerprintStorage& mData;						// Where the image records go
+		FingerprintStorage& mIndex;						// Where the index entries go
+		dword mCount;									// Number of images archived
+		dword mEnd;										// Position in the data just past the last indexed record
+		dword mRecovered;								// Number of index entries rebuilt by begin()
+		byte mScanBuf[ARC_SCAN_BLOCK * ARC_INDEX_ENTRY_SIZE];	// Index entries read ahead while scanning
+		dword mScanFirst;								// Number of the first entry in mScanBuf
+		uint8_t mScanLen;								// Number of entries in mScanBuf
+		dword mScanNext;								// Number of the next entry next() returns
+
+		bool appendIndex(const ArchiveEntry&);
+		bool completeRecord();
+		bool readHeader(dword, ArchiveEntry&, byte&);
+		static bool checkHeader(FingerprintStorage&, byte);
+		static void parseEntry(const byte*, ArchiveEntry&);
+		static void putDword(byte*, dword);
+		static dword getDword(const byte*);
+
+	public:
+		FingerprintArchive(FingerprintStorage&, FingerprintStorage&);
+
+		bool begin();
+		bool append(uint8_t, word, dword, uint8_t, const byte*, dword, ARC_FORMAT format = ARC_RAW);
+		dword getCount();
+		dword getRecoveredCount();
+		bool getEntry(dword, ArchiveEntry&);
+		void rewind(dword first = 0);
+		bool next(ArchiveEntry&);
+		bool readImage(const ArchiveEntry&, dword, byte*, dword);
+		bool getFormat(const ArchiveEntry&, ARC_FORMAT&);
+		bool streamImage(const ArchiveEntry&, Print&, bool decode = true);
+};
+
+#endif
@@ -0,0 +1,301 @@
+/**
+ * Capture quality policy for identification and verification.
+ *
+ * Notes:
+ *	-	A low quality capture takes well under half the time of a high quality one, and
+ *		is good enough for most presses. identify() and verify() therefore capture at low
+ *		quality first, and only when that fails for a reason a better image could fix
+ *		(NACK_BAD_FINGER, or no match) capture again at high quality and retry. Other
+ *		failures, such as no finger on the sensor or a link error, are returned as they are.
+ *	-	Enrollment is left alone: enrollSequence() always captures at high quality, since a
+ *		poor enrollment template spoils every later match.
+ *	-	Each quality keeps running averages of the time an attempt takes (capture and match)
+ *		and of how often it matches, over roughly the last POLICY_WEIGHT attempts. Starting
+ *		low costs the low attempt plus, when it fails, a high one, so it only pays while
+ *		the low success rate stays above the ratio of the low to the high attempt time.
+ *		With setAdaptive(true) (the default) the policy starts at whichever quality is
+ *		cheaper on average, e.g. switching to high quality when a dirty sensor or dry
+ *		fingers make low quality captures fail, and tries low quality again once in
+ *		POLICY_EXPLORE attempts to notice when it pays again.
+ *	-	Only attempts which matched or failed on quality are sampled, so people lifting
+ *		their finger too early or a flaky link don't sway the policy.
+ */
+
+// Includes
+#include "FingerprintCapturePolicy.h"
+
+// BEGIN PUBLIC
+
+/**
+ * Creates an adaptive policy for the given module, starting at low quality
+ * with no history.
+ *
+ * @param fpm The module to capture with
+ */
+FingerprintCapturePolicy::FingerprintCapturePolicy(FingerprintModule& fpm) : mModule(fpm) {
+	mAdaptive = true;
+	clear();
+}
+
+/**
+ * Captures a fingerprint at the given quality, counting it for the
+ * statistics of that quality.
+ *
+ * @param mode The quality to capture at
+ *
+ * @return True if a fingerprint was captured, false otherwise (check the module's error code)
+ */
+bool FingerprintCapturePolicy::capture(CAPTURE_MODE mode) {
+	unsigned long start = mModule.getClock().millis();	// Time at which the capture began
+	bool success = mModule.captureFingerprint(mode == CAPTURE_HIGH);
+
+	++mStats[mode].captures;
+	mStats[mode].captured += success;
+	mStats[mode].captureTime += mModule.getClock().millis() - start;
+	mLastMode = mode;
+
+	return success;
+}
+
+/**
+ * Captures the finger on the sensor and identifies it, escalating to a high
+ * quality capture if a low quality one was not good enough. On success, the
+ * module's getResponseParam() returns the matched ID.
+ *
+ * @return True if the finger was identified, false otherwise (check the module's error code)
+ */
+bool FingerprintCapturePolicy::identify() {
+	return match(-1);
+}
+
+/**
+ * Captures the finger on the sensor and verifies it against the given ID,
+ * escalating to a high quality capture if a low quality one was not good
+ * enough.
+ *
+ * @param id The ID to verify against
+ *
+ * @return True if the finger matches the ID, false otherwise (check the module's error code)
+ */
+bool FingerprintCapturePolicy::verify(uint32_t id) {
+	return match(id);
+}
+
+/**
+ * Chooses whether the starting quality follows the statistics or is always
+ * low quality with escalation.
+ *
+ * @param adaptive True to tune the starting quality, false to always start low
+ */
+void FingerprintCapturePolicy::setAdaptive(bool adaptive) {
+	mAdaptive = adaptive;
+	tune();
+}
+
+/**
+ * Forgets every statistic and starts at low quality again.
+ */
+void FingerprintCapturePolicy::clear() {
+	memset(mStats, 0, sizeof(mStats));
+	mStart = CAPTURE_LOW;
+	mLastMode = CAPTURE_LOW;
+	mSinceLow = 0;
+	mEscalations = 0;
+}
+
+/**
+ * Retrieves the quality the next identification or verification starts at,
+ * apart from the occasional low quality start while high quality is preferred.
+ *
+ * @return The quality
+ */
+CAPTURE_MODE FingerprintCapturePolicy::getStartMode() {
+	return mStart;
+}
+
+/**
+ * Retrieves the quality of the last capture.
+ *
+ * @return The quality
+ */
+CAPTURE_MODE FingerprintCapturePolicy::getLastMode() {
+	return mLastMode;
+}
+
+/**
+ * Retrieves the number of captures attempted at the given quality.
+ *
+ * @param mode The quality
+ *
+ * @return The number of captures
+ */
+dword FingerprintCapturePolicy::getCaptureCount(CAPTURE_MODE mode) {
+	return mStats[mode].captures;
+}
+
+/**
+ * Retrieves the share of captures at the given quality which succeeded.
+ *
+ * @param mode The quality
+ *
+ * @return The percentage of captures, 0 if there were none
+ */
+uint8_t FingerprintCapturePolicy::getCaptureSuccessRate(CAPTURE_MODE mode) {
+	return mStats[mode].captures == 0 ? 0 : mStats[mode].captured * 100 / mStats[mode].captures;
+}
+
+/**
+ * Retrieves the share of successful captures at the given quality which
+ * went on to be identified or verified.
+ *
+ * @param mode The quality
+ *
+ * @return The percentage of captures, 0 if there were none
+ */
+uint8_t FingerprintCapturePolicy::getMatchRate(CAPTURE_MODE mode) {
+	return mStats[mode].captured == 0 ? 0 : mStats[mode].matched * 100 / mStats[mode].captured;
+}
+
+/**
+ * Retrieves the average latency of a capture at the given quality.
+ *
+ * @param mode The quality
+ *
+ * @return The average latency in milliseconds, 0 if there were no captures
+ */
+dword FingerprintCapturePolicy::getAvgCaptureLatency(CAPTURE_MODE mode) {
+	return mStats[mode].captures == 0 ? 0 : mStats[mode].captureTime / mStats[mode].captures;
+}
+
+/**
+ * Retrieves the running average time of a capture and match at the given
+ * quality, which the policy is tuned on.
+ *
+ * @param mode The quality
+ *
+ * @return The average time in milliseconds, 0 if no attempt was sampled
+ */
+dword FingerprintCapturePolicy::getAvgAttemptTime(CAPTURE_MODE mode) {
+	return mStats[mode].avgAttemptTime;
+}
+
+/**
+ * Retrieves the number of attempts retried at high quality after a low
+ * quality one failed.
+ *
+ * @return The number of escalations
+ */
+dword FingerprintCapturePolicy::getEscalationCount() {
+	return mEscalations;
+}
+
+// END PUBLIC
+
+// BEGIN PRIVATE
+
+/**
+ * Identifies or verifies the finger on the sensor, starting at the chosen
+ * quality and escalating to high quality after a quality failure.
+ *
+ * @param id The ID to verify against, or -1 to identify
+ *
+ * @return True if the finger was matched, false otherwise
+ */
+bool FingerprintCapturePolicy::match(int32_t id) {
+	CAPTURE_MODE mode = mAdaptive ? mStart : CAPTURE_LOW;	// The quality to start at
+	bool success;											// Whether the finger was matched
+
+	// Keep checking now and then whether low quality pays again
+	if (mode == CAPTURE_HIGH && ++mSinceLow >= POLICY_EXPLORE) {
+		mSinceLow = 0;
+		mode = CAPTURE_LOW;
+	}
+
+	success = attempt(mode, id);
+
+	if (!success && mode == CAPTURE_LOW && isQualityFailure(mModule.getErrorCode())) {
+		++mEscalations;
+		success = attempt(CAPTURE_HIGH, id);
+	}
+
+	tune();
+
+	return success;
+}
+
+/**
+ * Captures at the given quality and matches the result, sampling the
+ * outcome for the running averages if it says something about the quality.
+ *
+ * @param mode The quality to capture at
+ * @param id The ID to verify against, or -1 to identify
+ *
+ * @return True if the finger was matched, false otherwise
+ */
+bool FingerprintCapturePolicy::attempt(CAPTURE_MODE mode, int32_t id) {
+	ModeStats& stats = mStats[mode];						// The statistics of the quality
+	unsigned long start = mModule.getClock().millis();		// Time at which the attempt began
+	bool success = capture(mode);
+	dword elapsed;											// Time the attempt took in milliseconds
+
+	if (success) {
+		success = (id < 0) ? mModule.identify() : mModule.verify(id);
+		stats.matched += success;
+	}
+
+	if (!success && !isQualityFailure(mModule.getErrorCode())) {
+		return false;
+	}
+
+	// The first sample sets the averages, later ones move them by 1 / POLICY_WEIGHT
+	elapsed = mModule.getClock().millis() - start;
+	if (stats.attempts++ == 0) {
+		stats.avgAttemptTime = elapsed;
+		stats.successRate = success ? 1000 : 0;
+	} else {
+		stats.avgAttemptTime = stats.avgAttemptTime - stats.avgAttemptTime / POLICY_WEIGHT + elapsed / POLICY_WEIGHT;
+		stats.successRate = stats.successRate - stats.successRate / POLICY_WEIGHT + (success ? 1000 / POLICY_WEIGHT : 0);
+	}
+
+	return success;
+}
+
+/**
+ * Picks the starting quality with the lower expected time: starting low
+ * costs the low attempt, plus the high one whenever the low one fails, so it
+ * is chosen while the low success rate beats the ratio of the two attempt
+ * times. Low quality is kept until both qualities have been sampled.
+ */
+void FingerprintCapturePolicy::tune() {
+	ModeStats& low = mStats[CAPTURE_LOW];	// What was seen of low quality
+	ModeStats& high = mStats[CAPTURE_HIGH];	// What was seen of high quality
+
+	if (!mAdaptive || low.attempts == 0 || high.attempts == 0) {
+		mStart = CAPTURE_LOW;
+	} else {
+		mStart = (low.avgAttemptTime * 1000 < (dword) low.successRate * high.avgAttemptTime) ? CAPTURE_LOW : CAPTURE_HIGH;
+	}
+}
+
+/**
+ * Checks whether an error code means the capture was not good enough, as
+ * opposed to no finger, a link error or anything else a better image would
+ * not fix.
+ *
+ * @param err The error code
+ *
+ * @return True for a quality failure, false otherwise
+ */
+bool FingerprintCapturePolicy::isQualityFailure(dword err) {
+	switch (err) {
+		case NACK_BAD_FINGER:
+		case NACK_IDENTIFY_FAILED:
+		case NACK_VERIFY_FAILED:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+// END PRIVATE
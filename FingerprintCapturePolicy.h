@@ -0,0 +1,69 @@
+#ifndef FINGERPRINT_CAPTURE_POLICY_H
+#define FINGERPRINT_CAPTURE_POLICY_H
+
+/* Includes */
+#include "FingerprintModule.h"
+
+/* Symbolic constants */
+// The weight of the newest attempt in the running averages is 1 / POLICY_WEIGHT
+#define POLICY_WEIGHT 16
+
+// While attempts start at high quality, one in this many starts at low quality anyway to see if it pays again
+#define POLICY_EXPLORE 16
+
+/* Enumerations */
+// The capture qualities the sensor offers
+enum CAPTURE_MODE {
+	CAPTURE_LOW,			// Fast, but more often refused or not matched
+	CAPTURE_HIGH,			// Slow, but more reliable
+	CAPTURE_MODES			// The number of capture qualities
+};
+
+/* Class definition */
+// Captures at low quality to identify or verify quickly, and at high quality when that doesn't work
+class FingerprintCapturePolicy {
+	private:
+		// What was seen of one capture quality
+		struct ModeStats {
+			dword captures;					// Captures attempted
+			dword captured;					// Captures which succeeded
+			dword matched;					// Identifications or verifications which succeeded after a capture
+			dword captureTime;				// Total capture latency in milliseconds
+			dword attempts;					// Attempts sampled for the running averages
+			dword avgAttemptTime;			// Running average time of a capture and match in milliseconds
+			word successRate;				// Running average of attempts which matched, per thousand
+		};
+
+		FingerprintModule& mModule;			// The module captures are made with
+		ModeStats mStats[CAPTURE_MODES];	// What was seen of each quality
+		bool mAdaptive;						// True if the starting quality is tuned, false to always start low
+		CAPTURE_MODE mStart;				// The quality attempts currently start with
+		CAPTURE_MODE mLastMode;				// The quality of the last capture
+		uint8_t mSinceLow;					// Attempts started at high quality since one started at low quality
+		dword mEscalations;					// Attempts retried at high quality
+
+		bool match(int32_t);
+		bool attempt(CAPTURE_MODE, int32_t);
+		void tune();
+		static bool isQualityFailure(dword);
+
+	public:
+		FingerprintCapturePolicy(FingerprintModule&);
+
+		bool capture(CAPTURE_MODE);
+		bool identify();
+		bool verify(uint32_t);
+		void setAdaptive(bool);
+		void clear();
+
+		CAPTURE_MODE getStartMode();
+		CAPTURE_MODE getLastMode();
+		dword getCaptureCount(CAPTURE_MODE);
+		uint8_t getCaptureSuccessRate(CAPTURE_MODE);
+		uint8_t getMatchRate(CAPTURE_MODE);
+		dword getAvgCaptureLatency(CAPTURE_MODE);
+		dword getAvgAttemptTime(CAPTURE_MODE);
+		dword getEscalationCount();
+};
+
+#endif
@@ -0,0 +1,415 @@
+/**
+ * Lossless streaming codec for fingerprint images.
+ *
+ * Notes:
+ *	-	Each pixel is predicted from its neighbours to the left, above and above-left
+ *		with the median edge detector of LOCO-I / JPEG-LS, which follows ridges well. The
+ *		difference from the prediction is folded to 0-255, small differences first, and
+ *		written as a Rice code whose parameter adapts to the recent differences.
+ *	-	A compressed stream is the width and height (2 bytes each, little-endian), then the
+ *		codes, most significant bit first, padded with zeros to a whole byte. A code is q
+ *		ones, a zero and the k low bits of the difference, q being the difference shifted
+ *		right by k; when q would reach CODEC_QMAX, CODEC_QMAX ones are followed by the 8
+ *		bits of the difference instead. No code is ever longer than 24 bits.
+ *	-	Both ends are streams: the encoder is a Print taking pixels and the decoder is a
+ *		Print taking compressed bytes, each writing its result to another Print. Only one
+ *		row of pixels is kept, so either can sit on the image download path, e.g.
+ *		getImage(encoder) compresses an image as it arrives from the sensor.
+ *	-	The work per pixel is a few comparisons, additions and shifts, with no tables and no
+ *		multiplications, which suits 8-bit and 32-bit MCUs alike.
+ */
+
+// Includes
+#include "FingerprintCodec.h"
+
+// BEGIN FINGERPRINTCODECMODEL PROTECTED
+
+/**
+ * Gets ready for a new image.
+ *
+ * @param width The width of the image
+ * @param height The height of the image
+ */
+void FingerprintCodecModel::resetModel(word width, word height) {
+	mWidth = width;
+	mHeight = height;
+	mX = 0;
+	mY = 0;
+	mUpLeft = 0;
+	mSum = 4;
+	mCount = 1;
+}
+
+/**
+ * Predicts the next pixel from its neighbours with the median edge
+ * detector. The first row is predicted from the left and the first
+ * column from above.
+ *
+ * @return The predicted pixel
+ */
+byte FingerprintCodecModel::predict() {
+	byte a, b, c;	// The pixels to the left, above and above-left
+
+	if (mY == 0) {
+		return (mX == 0) ? 0 : mRow[mX - 1];
+	}
+
+	if (mX == 0) {
+		return mRow[0];
+	}
+
+	a = mRow[mX - 1];
+	b = mRow[mX];
+	c = mUpLeft;
+
+	if (c >= max(a, b)) {
+		return min(a, b);
+	} else if (c <= min(a, b)) {
+		return max(a, b);
+	}
+
+	return a + b - c;
+}
+
+/**
+ * Picks the Rice parameter for the next residual: the smallest k for which
+ * the recent residuals average no more than 2^k.
+ *
+ * @return The parameter
+ */
+uint8_t FingerprintCodecModel::riceParam() {
+	uint8_t k = 0;
+
+	while (k < CODEC_KMAX && ((dword) mCount << k) < mSum) {
+		++k;
+	}
+
+	return k;
+}
+
+/**
+ * Takes in the pixel just coded and its mapped residual, and moves on to
+ * the next pixel.
+ *
+ * @param pixel The pixel
+ * @param mapped Its mapped residual
+ */
+void FingerprintCodecModel::update(byte pixel, byte mapped) {
+	mSum += mapped;
+	if (++mCount == CODEC_RESET) {
+		mSum >>= 1;
+		mCount >>= 1;
+	}
+
+	// The pixel above is needed once more, as the above-left of the next pixel
+	mUpLeft = mRow[mX];
+	mRow[mX] = pixel;
+
+	if (++mX == mWidth) {
+		mX = 0;
+		++mY;
+	}
+}
+
+/**
+ * Checks whether every pixel of the image has been coded.
+ *
+ * @return True if the image is complete, false otherwise
+ */
+bool FingerprintCodecModel::isComplete() {
+	return mY >= mHeight;
+}
+
+/**
+ * Folds the difference between a pixel and its prediction to 0-255, the
+ * smallest differences getting the smallest values: 0, -1, 1, -2, 2, ...
+ *
+ * @param pixel The pixel
+ * @param pred The prediction
+ *
+ * @return The mapped residual
+ */
+byte FingerprintCodecModel::mapResidual(byte pixel, byte pred) {
+	int8_t d = (int8_t) (byte) (pixel - pred);	// The difference, wrapped to -128..127
+
+	return (d >= 0) ? (byte) (d << 1) : (byte) ((-d << 1) - 1);
+}
+
+/**
+ * Turns a mapped residual back into a pixel.
+ *
+ * @param mapped The mapped residual
+ * @param pred The prediction
+ *
+ * @return The pixel
+ */
+byte FingerprintCodecModel::unmapResidual(byte mapped, byte pred) {
+	int d = (mapped & 1) ? -((mapped + 1) >> 1) : (mapped >> 1);
+
+	return (byte) (pred + d);
+}
+
+// END FINGERPRINTCODECMODEL PROTECTED
+
+// BEGIN FINGERPRINTENCODER PUBLIC
+
+/**
+ * Creates an encoder writing to the given output. Call begin() before
+ * writing pixels.
+ *
+ * @param out Where the compressed stream goes
+ */
+FingerprintEncoder::FingerprintEncoder(Print& out) : mOut(out) {
+	mBits = 0;
+	mBitCount = 0;
+	mSize = 0;
+	resetModel(0, 0);
+}
+
+/**
+ * Starts a new image, writing the stream header.
+ *
+ * @param width The width of the image, 240 for GET_IMAGE
+ * @param height The height of the image, 216 for GET_IMAGE
+ *
+ * @return True if the header was written, false if the image is too wide or the output failed
+ */
+bool FingerprintEncoder::begin(word width, word height) {
+	byte header[CODEC_HEADER_SIZE] = { (byte) (width & 0xFF), (byte) (width >> 8), (byte) (height & 0xFF), (byte) (height >> 8) };
+
+	resetModel(width, height);
+	mBits = 0;
+	mBitCount = 0;
+	mSize = 0;
+
+	if (width == 0 || width > CODEC_MAX_WIDTH) {
+		return false;
+	}
+
+	mSize = mOut.write(header, CODEC_HEADER_SIZE);
+
+	return mSize == CODEC_HEADER_SIZE;
+}
+
+/**
+ * Compresses the next pixel.
+ *
+ * @param pixel The pixel
+ *
+ * @return 1, or 0 if the image is already complete
+ */
+size_t FingerprintEncoder::write(uint8_t pixel) {
+	byte mapped;	// The pixel's mapped residual
+	uint8_t k;		// The Rice parameter
+	byte q;			// The unary part of the code
+
+	if (isComplete()) {
+		return 0;
+	}
+
+	mapped = mapResidual(pixel, predict());
+	k = riceParam();
+	q = mapped >> k;
+
+	if (q < CODEC_QMAX) {
+		putBits((((uint32_t) 1 << q) - 1) << 1, q + 1);
+		putBits(mapped & ((1 << k) - 1), k);
+	} else {
+		putBits(((uint32_t) 1 << CODEC_QMAX) - 1, CODEC_QMAX);
+		putBits(mapped, 8);
+	}
+
+	update(pixel, mapped);
+
+	return 1;
+}
+
+/**
+ * Writes out the last, partly filled byte of the stream.
+ *
+ * @return True if every pixel of the image was given, false otherwise
+ */
+bool FingerprintEncoder::finish() {
+	if (mBitCount > 0) {
+		putBits(0, 8 - mBitCount);
+	}
+
+	return isComplete();
+}
+
+/**
+ * Retrieves the number of compressed bytes written so far, header included.
+ *
+ * @return The number of bytes
+ */
+dword FingerprintEncoder::getEncodedSize() {
+	return mSize;
+}
+
+// END FINGERPRINTENCODER PUBLIC
+
+// BEGIN FINGERPRINTENCODER PRIVATE
+
+/**
+ * Adds bits to the stream, writing out every completed byte.
+ *
+ * @param value The bits, in the lowest bits
+ * @param count The number of bits, at most 17
+ */
+void FingerprintEncoder::putBits(uint32_t value, uint8_t count) {
+	mBits = (mBits << count) | value;
+	mBitCount += count;
+
+	while (mBitCount >= 8) {
+		mBitCount -= 8;
+		mSize += mOut.write((uint8_t) (mBits >> mBitCount));
+	}
+}
+
+// END FINGERPRINTENCODER PRIVATE
+
+// BEGIN FINGERPRINTDECODER PUBLIC
+
+/**
+ * Creates a decoder writing pixels to the given output.
+ *
+ * @param out Where the pixels go
+ */
+FingerprintDecoder::FingerprintDecoder(Print& out) : mOut(out) {
+	begin();
+}
+
+/**
+ * Gets ready for a new compressed stream.
+ */
+void FingerprintDecoder::begin() {
+	resetModel(0, 0);
+	mHeaderLen = 0;
+	mFailed = false;
+	mBits = 0;
+	mBitCount = 0;
+	mSize = 0;
+}
+
+/**
+ * Takes the next byte of the compressed stream and writes out every pixel
+ * it completes.
+ *
+ * @param b The byte
+ *
+ * @return 1, or 0 if the stream is invalid or the image is already complete
+ */
+size_t FingerprintDecoder::write(uint8_t b) {
+	if (mFailed) {
+		return 0;
+	}
+
+	// Collect the header, then size the image
+	if (mHeaderLen < CODEC_HEADER_SIZE) {
+		mHeader[mHeaderLen++] = b;
+
+		if (mHeaderLen == CODEC_HEADER_SIZE) {
+			resetModel((mHeader[1] << 8) | mHeader[0], (mHeader[3] << 8) | mHeader[2]);
+			mFailed = (mWidth == 0 || mWidth > CODEC_MAX_WIDTH);
+		}
+
+		return mFailed ? 0 : 1;
+	}
+
+	if (isComplete()) {
+		return 0;
+	}
+
+	mBits = (mBits << 8) | b;
+	mBitCount += 8;
+
+	while (!isComplete() && decodeNext());
+
+	return 1;
+}
+
+/**
+ * Checks whether the whole image has been decoded.
+ *
+ * @return True if every pixel was written, false otherwise
+ */
+bool FingerprintDecoder::isDone() {
+	return !mFailed && mHeaderLen == CODEC_HEADER_SIZE && isComplete();
+}
+
+/**
+ * Retrieves the width given in the stream header.
+ *
+ * @return The width, 0 until the header has been received
+ */
+word FingerprintDecoder::getWidth() {
+	return mWidth;
+}
+
+/**
+ * Retrieves the height given in the stream header.
+ *
+ * @return The height, 0 until the header has been received
+ */
+word FingerprintDecoder::getHeight() {
+	return mHeight;
+}
+
+/**
+ * Retrieves the number of pixels written so far.
+ *
+ * @return The number of pixels
+ */
+dword FingerprintDecoder::getDecodedSize() {
+	return mSize;
+}
+
+// END FINGERPRINTDECODER PUBLIC
+
+// BEGIN FINGERPRINTDECODER PRIVATE
+
+/**
+ * Decodes the next pixel if all of its code has been received.
+ *
+ * @return True if a pixel was decoded, false if more bits are needed
+ */
+bool FingerprintDecoder::decodeNext() {
+	uint8_t k = riceParam();	// The Rice parameter
+	uint8_t q = 0;				// The unary part of the code
+	uint8_t need;				// The length of the code
+	byte mapped;				// The mapped residual
+	byte pixel;					// The decoded pixel
+
+	while (q < CODEC_QMAX && q < mBitCount && (mBits >> (mBitCount - 1 - q)) & 1) {
+		++q;
+	}
+
+	if (q == CODEC_QMAX) {
+		need = CODEC_QMAX + 8;
+	} else if (q == mBitCount) {
+		return false;
+	} else {
+		need = q + 1 + k;
+	}
+
+	if (mBitCount < need) {
+		return false;
+	}
+
+	mBitCount -= need;
+	if (q == CODEC_QMAX) {
+		mapped = (mBits >> mBitCount) & 0xFF;
+	} else {
+		mapped = (q << k) | ((mBits >> mBitCount) & ((1 << k) - 1));
+	}
+
+	pixel = unmapResidual(mapped, predict());
+	update(pixel, mapped);
+
+	mOut.write(pixel);
+	++mSize;
+
+	return true;
+}
+
+// END FINGERPRINTDECODER PRIVATE
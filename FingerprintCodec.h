@@ -0,0 +1,91 @@
+#ifndef FINGERPRINT_CODEC_H
+#define FINGERPRINT_CODEC_H
+
+/* Includes */
+#include <Arduino.h>
+#include "FingerprintModule.h"
+
+/* Symbolic constants */
+// The widest image which can be coded, the 240-pixel rows of GET_IMAGE
+#define CODEC_MAX_WIDTH 240
+
+// The size of the stream header holding the width and height
+#define CODEC_HEADER_SIZE 4
+
+// The longest unary part of a code; residuals which would need more are sent as 8 raw bits
+#define CODEC_QMAX 16
+
+// The largest Rice parameter used
+#define CODEC_KMAX 7
+
+// The number of residuals after which the adaptation statistics are halved
+#define CODEC_RESET 64
+
+/* Class definitions */
+// The prediction and adaptation state shared by the encoder and decoder, which must evolve identically
+class FingerprintCodecModel {
+	protected:
+		byte mRow[CODEC_MAX_WIDTH];	// The previous row, replaced pixel by pixel by the current one
+		word mWidth;				// The width of the image
+		word mHeight;				// The height of the image
+		word mX;					// Column of the next pixel
+		word mY;					// Row of the next pixel
+		byte mUpLeft;				// The pixel above and left of the next one
+		word mSum;					// Sum of the recent mapped residuals
+		word mCount;				// Number of recent mapped residuals
+
+		void resetModel(word, word);
+		byte predict();
+		uint8_t riceParam();
+		void update(byte, byte);
+		bool isComplete();
+		static byte mapResidual(byte, byte);
+		static byte unmapResidual(byte, byte);
+};
+
+// Compresses pixels written to it, one byte each in row order, into the given output
+class FingerprintEncoder : public Print, private FingerprintCodecModel {
+	private:
+		Print& mOut;		// Where the compressed stream goes
+		uint32_t mBits;		// Bits waiting to be written, the oldest highest
+		uint8_t mBitCount;	// Number of bits waiting
+		dword mSize;		// Number of compressed bytes written
+
+		void putBits(uint32_t, uint8_t);
+
+	public:
+		FingerprintEncoder(Print&);
+
+		bool begin(word, word);
+		size_t write(uint8_t);
+		using Print::write;
+		bool finish();
+		dword getEncodedSize();
+};
+
+// Decompresses a stream written to it into pixels written to the given output
+class FingerprintDecoder : public Print, private FingerprintCodecModel {
+	private:
+		Print& mOut;				// Where the pixels go
+		byte mHeader[CODEC_HEADER_SIZE];	// The stream header
+		uint8_t mHeaderLen;			// Number of header bytes received
+		bool mFailed;				// True if the stream is invalid
+		uint32_t mBits;				// Bits received but not decoded yet, the oldest highest
+		uint8_t mBitCount;			// Number of bits received but not decoded yet
+		dword mSize;				// Number of pixels written
+
+		bool decodeNext();
+
+	public:
+		FingerprintDecoder(Print&);
+
+		void begin();
+		size_t write(uint8_t);
+		using Print::write;
+		bool isDone();
+		word getWidth();
+		word getHeight();
+		dword getDecodedSize();
+};
+
+#endif
@@ -0,0 +1,1271 @@
+/**
+ * Virtual clock and sensor emulator for testing the fingerprint module without hardware.
+ *
+ * Notes:
+ *	-	FingerprintEmulator is a Stream which behaves like a GT-511C1R on the other end of
+ *		the serial line: it parses command packets, keeps an enrollment database, a finger
+ *		on the sensor and a captured image, and answers with response packets (and the
+ *		device information data packet for an open with error checking) once each command's
+ *		simulated processing time has passed. Commands are processed one after the other,
+ *		so a command sent while the sensor is busy waits its turn as it would on the device.
+ *	-	Fingers are plain numbers: setFinger(n) places finger n on the sensor and a capture
+ *		matches an enrolled ID if the same finger was enrolled there. EMU_NO_FINGER lifts it.
+ *	-	Processing times are measured on the clock given to the emulator. Give the module
+ *		the same FingerprintVirtualClock with setClock() and every wait in the driver only
+ *		moves virtual time forward, so timeouts, retries and latency scenarios spanning
+ *		minutes of sensor time run in milliseconds while the latencies the driver measures
+ *		(e.g. through a command observer) are still those of the simulated sensor:
+ *
+ *			FingerprintVirtualClock clock;
+ *			FingerprintEmulator emu(clock);
+ *			fpm.setStream(&emu);
+ *			fpm.setClock(&clock);
+ *
+ *	-	The default processing times are rough figures for the GT-511C1R; override them per
+ *		command with setLatency().
+ *	-	The serial line is simulated byte by byte in both directions: each byte takes
+ *		bitsPerByte / baudrate seconds (10 bits for 8N1), plus an optional random gap of up
+ *		to the jitter set with setUart(), and the sensor only starts on a command once the
+ *		command has crossed the line and the previous reply has been sent. Replies land in a
+ *		receive FIFO of the size set with setFifoSize(), standing in for the board's serial
+ *		buffer; bytes arriving while it is full are lost and counted as overruns. Together
+ *		with getLastTransferTime() and getFifoHighWater() this shows how long templates and
+ *		images take to transfer at each baudrate and how often the driver must read to
+ *		keep up. Templates and images are generated on the fly, so they take no RAM here.
+ *	-	setFaults() makes the line unreliable for soak testing: replies can be lost, have a
+ *		byte corrupted, or be preceded by a stray byte, at random with the given rates.
+ *	-	setPlugged(false) pulls the sensor off the line: everything in flight is lost and
+ *		nothing is answered. Plugging it back in powers it up again at 9600 bps with the
+ *		LED off, the enrolled templates being kept as they are in the sensor's flash.
+ */
+
+// Includes
+#include "FingerprintEmulator.h"
+
+// BEGIN FINGERPRINTVIRTUALCLOCK PUBLIC
+
+/**
+ * Creates a virtual clock starting at the given time.
+ *
+ * @param start The initial time in milliseconds, defaults to 0
+ */
+FingerprintVirtualClock::FingerprintVirtualClock(unsigned long start) {
+	mNow = start;
+}
+
+/**
+ * Retrieves the current virtual time.
+ *
+ * @return The virtual time in milliseconds
+ */
+unsigned long FingerprintVirtualClock::millis() {
+	return mNow;
+}
+
+/**
+ * Retrieves the current virtual time in microseconds.
+ *
+ * @return The number of virtual microseconds since the clock started
+ */
+unsigned long FingerprintVirtualClock::micros() {
+	return mNow * 1000UL;
+}
+
+/**
+ * Moves the virtual time forward by the given amount instead of waiting.
+ *
+ * @param ms The time to wait in milliseconds
+ */
+void FingerprintVirtualClock::delay(dword ms) {
+	mNow += ms;
+}
+
+/**
+ * Moves the virtual time forward by the given amount, e.g. to simulate time
+ * spent by the application between two commands.
+ *
+ * @param ms The time to skip in milliseconds
+ */
+void FingerprintVirtualClock::advance(dword ms) {
+	mNow += ms;
+}
+
+// END FINGERPRINTVIRTUALCLOCK PUBLIC
+
+// BEGIN FINGERPRINTEMULATOR PUBLIC
+
+/**
+ * Creates an emulated sensor with an empty database, no finger on it, and
+ * processing times measured on the given clock.
+ *
+ * @param clock The clock to measure processing times on, normally the one given to the module
+ */
+FingerprintEmulator::FingerprintEmulator(FingerprintClock& clock) : mClock(clock) {
+	mRxLen = 0;
+	mRxWireAt = 0;
+	mQueueHead = 0;
+	mQueueLen = 0;
+	mBusy = false;
+	mDoneAt = 0;
+	mIdleAt = 0;
+	mOutHead = 0;
+	mOutLen = 0;
+	mGenTotal = 0;
+	mGenPos = 0;
+	mGenSum = 0;
+	mGenKind = 0;
+	mGenFinger = EMU_NO_FINGER;
+	mInSize = 0;
+	mInLen = 0;
+	mWireAt = 0;
+	mReplyStart = 0;
+	mFifoSize = EMU_FIFO_DEFAULT;
+	mFifoHead = 0;
+	mFifoLen = 0;
+	mFinger = EMU_NO_FINGER;
+	mCaptured = EMU_NO_FINGER;
+	mImpression = 0;
+	mCapturedImpression = 0;
+	mFalseReject = 0;
+	mFalseAccept = 0;
+	mCapturedLow = false;
+	mLowBadFinger = 0;
+	mLowFalseReject = 0;
+	mEnrollID = -1;
+	mEnrollStage = 0;
+	mEnrollFinger = EMU_NO_FINGER;
+	mLedOn = false;
+	mBaudrate = 9600;
+	mLatencyCount = 0;
+	mCommands = 0;
+	mDropped = 0;
+	mPlugged = true;
+
+	setUart(9600);
+	resetUartStats();
+	setFaults(0, 0, 0);
+	mFaults = 0;
+
+	for (uint8_t i = 0; i < EMU_DB_SIZE; ++i) {
+		mDb[i] = EMU_NO_FINGER;
+	}
+
+	for (uint8_t i = 0; i < SERIAL_NUM_SIZE; ++i) {
+		mSerial[i] = i + 1;
+	}
+}
+
+/**
+ * Returns the number of reply bytes in the receive FIFO, bringing the
+ * simulated sensor and serial line up to the current time first.
+ *
+ * @return The number of bytes available to read
+ */
+int FingerprintEmulator::available() {
+	update();
+
+	return mFifoLen;
+}
+
+/**
+ * Reads the next reply byte from the receive FIFO.
+ *
+ * @return The byte read, or -1 if none was available
+ */
+int FingerprintEmulator::read() {
+	int c = -1;
+
+	update();
+
+	if (mFifoLen > 0) {
+		c = mFifo[mFifoHead];
+		mFifoHead = (mFifoHead + 1) % EMU_FIFO_MAX;
+		--mFifoLen;
+	}
+
+	return c;
+}
+
+/**
+ * Returns the next reply byte in the receive FIFO without reading it.
+ *
+ * @return The next byte, or -1 if none was available
+ */
+int FingerprintEmulator::peek() {
+	update();
+
+	return mFifoLen > 0 ? mFifo[mFifoHead] : -1;
+}
+
+/**
+ * Takes a byte sent by the driver. Bytes cross the line one after the other
+ * and are gathered into command packets, anything before a packet's start
+ * codes being ignored. Each complete packet is queued for processing from
+ * the time its last byte reaches the sensor.
+ *
+ * @param b The byte sent by the driver
+ *
+ * @return Always 1
+ */
+size_t FingerprintEmulator::write(uint8_t b) {
+	unsigned long sent;	// Time at which the byte starts crossing the line
+
+	update();
+
+	if (!mPlugged) {
+		return 1;
+	}
+
+	sent = now();
+	if ((long) (mRxWireAt - sent) > 0) {
+		sent = mRxWireAt;
+	}
+	mRxWireAt = sent + byteTime(false);
+
+	// A template upload takes the bytes, unless the driver gave up on it and sends a new command
+	if (mInSize > 0 && !(mInLen == 0 && mRxLen == 0 && b == CMD_START_CODE_1)) {
+		takeUpload(b);
+		return 1;
+	}
+	mInSize = 0;
+
+	// Hunt for the start codes of a command packet
+	if ((mRxLen == 0 && b != CMD_START_CODE_1) || (mRxLen == 1 && b != CMD_START_CODE_2)) {
+		mRxLen = 0;
+		return 1;
+	}
+
+	mRx[mRxLen++] = b;
+
+	if (mRxLen == CMD_PKT_SIZE) {
+		mRxLen = 0;
+		queueCommand(mRx, mRxWireAt);
+	}
+
+	return 1;
+}
+
+/**
+ * Nothing to flush, provided to complete the Stream interface.
+ */
+void FingerprintEmulator::flush() {
+}
+
+/**
+ * Places a finger on the sensor, or lifts it.
+ *
+ * @param finger The finger to place, or EMU_NO_FINGER to lift it
+ */
+void FingerprintEmulator::setFinger(int16_t finger) {
+	mFinger = finger;
+}
+
+/**
+ * Retrieves the finger currently on the sensor.
+ *
+ * @return The finger on the sensor, or EMU_NO_FINGER if none
+ */
+int16_t FingerprintEmulator::getFinger() {
+	return mFinger;
+}
+
+/**
+ * Stores a finger at the given ID directly, without going through an
+ * enrollment, to set up a database for a test.
+ *
+ * @param id The ID to store the finger at
+ * @param finger The finger to store, or EMU_NO_FINGER to free the ID
+ */
+void FingerprintEmulator::enroll(uint8_t id, int16_t finger) {
+	if (id < EMU_DB_SIZE) {
+		mDb[id] = finger;
+	}
+}
+
+/**
+ * Retrieves the finger enrolled at the given ID.
+ *
+ * @param id The ID to look up
+ *
+ * @return The finger enrolled there, or EMU_NO_FINGER if the ID is free or invalid
+ */
+int16_t FingerprintEmulator::getEnrolled(uint8_t id) {
+	return id < EMU_DB_SIZE ? mDb[id] : EMU_NO_FINGER;
+}
+
+/**
+ * Overrides the processing time of a command. Once EMU_LATENCY_SLOTS
+ * commands have been overridden, further new commands are ignored.
+ *
+ * @param cmd The command code
+ * @param ms The processing time in milliseconds
+ */
+void FingerprintEmulator::setLatency(word cmd, dword ms) {
+	uint8_t i;	// Index of the command's override
+
+	for (i = 0; i < mLatencyCount && mLatencyCmd[i] != cmd; ++i);
+
+	if (i < EMU_LATENCY_SLOTS) {
+		mLatencyCmd[i] = cmd;
+		mLatencyMs[i] = ms;
+
+		if (i == mLatencyCount) {
+			++mLatencyCount;
+		}
+	}
+}
+
+/**
+ * Sets the serial number reported in the device information.
+ *
+ * @param serial The serial number (SERIAL_NUM_SIZE bytes)
+ */
+void FingerprintEmulator::setSerialNumber(const byte serial[]) {
+	memcpy(mSerial, serial, SERIAL_NUM_SIZE);
+}
+
+/**
+ * Retrieves the baudrate the driver last switched the sensor to.
+ *
+ * @return The baudrate in bits per second
+ */
+uint32_t FingerprintEmulator::getBaudrate() {
+	return mBaudrate;
+}
+
+/**
+ * Checks whether the driver left the CMOS LED on.
+ *
+ * @return True if the LED is on, false otherwise
+ */
+bool FingerprintEmulator::isLedOn() {
+	return mLedOn;
+}
+
+/**
+ * Retrieves the number of commands processed so far.
+ *
+ * @return The number of commands
+ */
+dword FingerprintEmulator::getCommandCount() {
+	return mCommands;
+}
+
+/**
+ * Retrieves the number of commands dropped because EMU_CMD_QUEUE commands
+ * were already waiting.
+ *
+ * @return The number of dropped commands
+ */
+dword FingerprintEmulator::getDroppedCount() {
+	return mDropped;
+}
+
+/**
+ * Sets up the timing of the serial line. A change of baudrate requested by
+ * the driver with changeBaudrate() also changes the line's speed.
+ *
+ * @param baud The speed of the line in bits per second, 0 for instant transfers
+ * @param bitsPerByte The number of bits on the line per byte including start, parity and stop bits, defaults to 10 (8N1)
+ * @param jitter The largest random gap between two bytes sent by the sensor in microseconds, defaults to 0
+ * @param seed The seed of the jitter's random numbers, so runs can be repeated exactly
+ */
+void FingerprintEmulator::setUart(uint32_t baud, uint8_t bitsPerByte, dword jitter, uint32_t seed) {
+	mBaudrate = baud;
+	mBitsPerByte = bitsPerByte;
+	mJitter = jitter;
+	mRand = (seed != 0) ? seed : 1;
+	mWireFrac = 0;
+}
+
+/**
+ * Sets the capacity of the receive FIFO the sensor's replies land in.
+ *
+ * @param size The capacity in bytes, at most EMU_FIFO_MAX
+ */
+void FingerprintEmulator::setFifoSize(uint16_t size) {
+	mFifoSize = (size > EMU_FIFO_MAX) ? EMU_FIFO_MAX : size;
+}
+
+/**
+ * Retrieves the number of bytes lost because they arrived while the receive
+ * FIFO was full, i.e. because the driver did not read fast enough.
+ *
+ * @return The number of bytes lost
+ */
+dword FingerprintEmulator::getOverrunCount() {
+	return mOverruns;
+}
+
+/**
+ * Retrieves the most bytes the receive FIFO held at once.
+ *
+ * @return The number of bytes
+ */
+uint16_t FingerprintEmulator::getFifoHighWater() {
+	return mFifoHighWater;
+}
+
+/**
+ * Retrieves the number of bytes the sensor put on the line, whether or not
+ * they fit in the receive FIFO.
+ *
+ * @return The number of bytes
+ */
+dword FingerprintEmulator::getBytesSent() {
+	return mBytesSent;
+}
+
+/**
+ * Retrieves the time the sensor took to send its last complete reply, from
+ * the end of processing to the arrival of the last byte of the response
+ * packet, or of the data packet following it.
+ *
+ * @return The time in microseconds
+ */
+dword FingerprintEmulator::getLastTransferTime() {
+	return mLastTransfer;
+}
+
+/**
+ * Resets the overrun count, FIFO high water mark, bytes sent and last
+ * transfer time, e.g. between two runs of a benchmark.
+ */
+void FingerprintEmulator::resetUartStats() {
+	mOverruns = 0;
+	mFifoHighWater = mFifoLen;
+	mBytesSent = 0;
+	mLastTransfer = 0;
+}
+
+/**
+ * Sets how often the line garbles replies. Each rate is the chance, per
+ * thousand commands, of the fault hitting a command's reply. The faults are
+ * drawn from the same seeded random numbers as the jitter, so a run can be
+ * repeated exactly.
+ *
+ * @param drop The rate at which replies are lost altogether
+ * @param corrupt The rate at which a byte of the response packet is corrupted
+ * @param noise The rate at which a stray byte is sent ahead of the reply
+ */
+void FingerprintEmulator::setFaults(uint16_t drop, uint16_t corrupt, uint16_t noise) {
+	mDropRate = drop;
+	mCorruptRate = corrupt;
+	mNoiseRate = noise;
+}
+
+/**
+ * Retrieves the number of faults injected so far.
+ *
+ * @return The number of faults
+ */
+dword FingerprintEmulator::getFaultCount() {
+	return mFaults;
+}
+
+/**
+ * Unplugs the sensor from the line or plugs it back in. Unplugging loses the
+ * command being processed, the replies not yet received and any enrollment
+ * in progress. Plugging back in is a power-up: the line is back at 9600 bps
+ * and the LED is off.
+ *
+ * @param plugged True to plug the sensor in, false to unplug it
+ */
+void FingerprintEmulator::setPlugged(bool plugged) {
+	if (plugged == mPlugged) {
+		return;
+	}
+
+	update();
+	mPlugged = plugged;
+
+	mRxLen = 0;
+	mQueueLen = 0;
+	mBusy = false;
+	mOutLen = 0;
+	mGenTotal = 0;
+	mGenPos = 0;
+	mInSize = 0;
+	mInLen = 0;
+	mFifoLen = 0;
+	mEnrollID = -1;
+
+	if (plugged) {
+		mLedOn = false;
+		mBaudrate = 9600;
+		mWireFrac = 0;
+	}
+}
+
+/**
+ * Checks whether the sensor is plugged in.
+ *
+ * @return True if it is, false otherwise
+ */
+bool FingerprintEmulator::isPlugged() {
+	return mPlugged;
+}
+
+/**
+ * Makes verification and identification wrong now and then, like a real
+ * matcher: genuine fingers are turned down at the false reject rate and
+ * other fingers let through at the false accept rate. Both are 0 by default.
+ *
+ * @param falseReject Genuine matches refused, per thousand
+ * @param falseAccept Impostor matches accepted, per thousand
+ */
+void FingerprintEmulator::setMatchErrors(uint16_t falseReject, uint16_t falseAccept) {
+	mFalseReject = min(falseReject, (uint16_t) 1000);
+	mFalseAccept = min(falseAccept, (uint16_t) 1000);
+}
+
+/**
+ * Makes low quality captures worse than high quality ones, as on the real
+ * sensor: some are refused outright as a bad finger, and the rest refuse
+ * genuine fingers more often. Both are 0 by default.
+ *
+ * @param badFinger Low quality captures refused with NACK_BAD_FINGER, per thousand
+ * @param falseReject Genuine matches refused on top of the false reject rate, per thousand
+ */
+void FingerprintEmulator::setLowQualityErrors(uint16_t badFinger, uint16_t falseReject) {
+	mLowBadFinger = min(badFinger, (uint16_t) 1000);
+	mLowFalseReject = min(falseReject, (uint16_t) 1000);
+}
+
+// END FINGERPRINTEMULATOR PUBLIC
+
+// BEGIN FINGERPRINTEMULATOR PRIVATE
+
+/**
+ * Retrieves the current time in microseconds. Times only ever compare as
+ * differences, so the wrap-around of the multiplication is harmless.
+ *
+ * @return The current time in microseconds
+ */
+unsigned long FingerprintEmulator::now() {
+	return mClock.millis() * 1000UL;
+}
+
+/**
+ * Brings the simulated sensor and serial line up to the current time:
+ * commands are processed in order, each one starting once it has arrived
+ * and the previous reply has been sent, and reply bytes due by now are
+ * moved into the receive FIFO.
+ */
+void FingerprintEmulator::update() {
+	unsigned long t = now();	// The time to simulate up to
+
+	// Keep markers of an idle sensor and line current so they never fall too far behind to compare
+	if ((long) (t - mRxWireAt) > 0) {
+		mRxWireAt = t;
+	}
+	if (mQueueLen == 0 && txPending() == 0) {
+		mIdleAt = t;
+	}
+
+	for (;;) {
+		// Start on the next command once it has arrived and the sensor is free
+		if (mQueueLen > 0 && !mBusy && txPending() == 0) {
+			mDoneAt = mQueueAt[mQueueHead];
+			if ((long) (mIdleAt - mDoneAt) > 0) {
+				mDoneAt = mIdleAt;
+			}
+			mDoneAt += latencyFor(mQueue[mQueueHead]) * 1000UL;
+			mBusy = true;
+		}
+
+		if (mBusy && (long) (t - mDoneAt) >= 0) {
+			mIdleAt = mDoneAt;
+			mReplyStart = mDoneAt;
+			mWireAt = mDoneAt + byteTime(false);
+
+			execute(mQueue[mQueueHead]);
+			injectFaults();
+
+			mQueueHead = (mQueueHead + 1) % EMU_CMD_QUEUE;
+			--mQueueLen;
+			mBusy = false;
+		} else if (!drainWire(t)) {
+			break;
+		}
+	}
+}
+
+/**
+ * Moves the reply bytes which arrive by the given time from the sensor into
+ * the receive FIFO, losing those which find it full.
+ *
+ * @param until The time to simulate the line up to, in microseconds
+ *
+ * @return True if the last byte of the reply was sent, false otherwise
+ */
+bool FingerprintEmulator::drainWire(unsigned long until) {
+	while (txPending() > 0 && (long) (until - mWireAt) >= 0) {
+		byte b = nextTxByte();	// The byte arriving
+
+		if (mFifoLen < mFifoSize) {
+			mFifo[(mFifoHead + mFifoLen) % EMU_FIFO_MAX] = b;
+			if (++mFifoLen > mFifoHighWater) {
+				mFifoHighWater = mFifoLen;
+			}
+		} else {
+			++mOverruns;
+		}
+		++mBytesSent;
+
+		if (txPending() == 0) {
+			mIdleAt = mWireAt;
+			mLastTransfer = mWireAt - mReplyStart;
+			return true;
+		}
+
+		mWireAt += byteTime(true);
+	}
+
+	return false;
+}
+
+/**
+ * Retrieves the number of reply bytes the sensor has yet to send.
+ *
+ * @return The number of bytes
+ */
+uint32_t FingerprintEmulator::txPending() {
+	return mOutLen + (mGenTotal - mGenPos);
+}
+
+/**
+ * Takes the next reply byte to send: the queued response bytes first, then
+ * the generated data packet, if any.
+ *
+ * @return The byte
+ */
+byte FingerprintEmulator::nextTxByte() {
+	uint32_t pos = mGenPos;	// Position of the byte in the data packet
+	byte b;					// The byte
+
+	if (mOutLen > 0) {
+		b = mOut[mOutHead];
+		mOutHead = (mOutHead + 1) % EMU_OUT_SIZE;
+		--mOutLen;
+		return b;
+	}
+
+	if (pos == 0) {
+		b = DATA_START_CODE_1;
+	} else if (pos == 1) {
+		b = DATA_START_CODE_2;
+	} else if (pos == 2) {
+		b = DEVICE_ID_LSB;
+	} else if (pos == 3) {
+		b = DEVICE_ID_MSB;
+	} else if (pos < mGenTotal - 2) {
+		b = payloadByte(pos - 4);
+	} else if (pos == mGenTotal - 2) {
+		b = mGenSum & 0xFF;
+	} else {
+		b = mGenSum >> 8;
+	}
+
+	if (pos < mGenTotal - 2) {
+		mGenSum += b;
+	}
+
+	if (++mGenPos == mGenTotal) {
+		mGenTotal = 0;
+		mGenPos = 0;
+	}
+
+	return b;
+}
+
+/**
+ * Works out how long the next byte takes to cross the line. Fractions of a
+ * microsecond are carried over so long transfers add up exactly.
+ *
+ * @param withJitter True to add a random gap of up to the configured jitter
+ *
+ * @return The time in microseconds
+ */
+dword FingerprintEmulator::byteTime(bool withJitter) {
+	dword bits = (dword) mBitsPerByte * 1000000UL;	// Bits per byte, scaled to microseconds
+	dword t;										// The byte time
+
+	if (mBaudrate == 0) {
+		return 0;
+	}
+
+	t = bits / mBaudrate;
+	mWireFrac += bits % mBaudrate;
+	if (mWireFrac >= mBaudrate) {
+		mWireFrac -= mBaudrate;
+		++t;
+	}
+
+	if (withJitter && mJitter > 0) {
+		t += nextRandom() % (mJitter + 1);
+	}
+
+	return t;
+}
+
+/**
+ * Draws the next random number for the jitter and faults. Xorshift is
+ * cheap and repeatable from its seed.
+ *
+ * @return The random number
+ */
+uint32_t FingerprintEmulator::nextRandom() {
+	mRand ^= mRand << 13;
+	mRand ^= mRand >> 17;
+	mRand ^= mRand << 5;
+
+	return mRand;
+}
+
+/**
+ * Garbles the reply just produced according to the fault rates. The
+ * command itself has been carried out either way, as on a real sensor
+ * whose reply is damaged on the line.
+ */
+void FingerprintEmulator::injectFaults() {
+	byte stray;	// The stray byte sent ahead of the reply
+
+	if (mDropRate > 0 && nextRandom() % 1000 < mDropRate) {
+		mOutLen = 0;
+		mGenTotal = 0;
+		mGenPos = 0;
+		++mFaults;
+	} else if (mCorruptRate > 0 && nextRandom() % 1000 < mCorruptRate && mOutLen >= RESP_PKT_SIZE) {
+		// Flip a bit of the parameter so the checksum no longer matches
+		mOut[(mOutHead + 4 + nextRandom() % 4) % EMU_OUT_SIZE] ^= 0x01;
+		++mFaults;
+	} else if (mNoiseRate > 0 && nextRandom() % 1000 < mNoiseRate && mOutLen < EMU_OUT_SIZE) {
+		stray = nextRandom() & 0xFF;
+		if (stray == RES_START_CODE_1) {
+			stray = 0x00;
+		}
+
+		mOutHead = (mOutHead + EMU_OUT_SIZE - 1) % EMU_OUT_SIZE;
+		mOut[mOutHead] = stray;
+		++mOutLen;
+		++mFaults;
+	}
+}
+
+/**
+ * Queues a complete command packet for processing, or drops it if the
+ * queue is full.
+ *
+ * @param pkt The command packet
+ * @param at The time in microseconds at which the packet reached the sensor
+ */
+void FingerprintEmulator::queueCommand(const byte* pkt, unsigned long at) {
+	if (mQueueLen == EMU_CMD_QUEUE) {
+		++mDropped;
+	} else {
+		memcpy(mQueue[(mQueueHead + mQueueLen) % EMU_CMD_QUEUE], pkt, CMD_PKT_SIZE);
+		mQueueAt[(mQueueHead + mQueueLen) % EMU_CMD_QUEUE] = at;
+		++mQueueLen;
+	}
+}
+
+/**
+ * Takes a byte of the template data packet the driver uploads after a set
+ * template command. Anything before the packet's start codes is ignored.
+ * Once the whole packet has arrived, an EMU_CMD_UPLOADED command is queued
+ * so the template is stored, and answered, in turn with other commands.
+ *
+ * @param b The byte sent by the driver
+ */
+void FingerprintEmulator::takeUpload(byte b) {
+	byte pkt[CMD_PKT_SIZE];	// The internal command packet
+	word sum;				// Its checksum
+
+	if ((mInLen == 0 && b != DATA_START_CODE_1) || (mInLen == 1 && b != DATA_START_CODE_2)) {
+		mInLen = 0;
+		return;
+	}
+
+	if (mInLen < mInSize - 2) {
+		mInSum += b;
+
+		// Only templates the emulator made can be tied back to a finger
+		if (mInLen == 4) {
+			mInFinger = FingerprintSynth::templateFinger(b);
+		} else if (mInLen > 4 && b != FingerprintSynth::templateByte(mInFinger, mInLen - 4)) {
+			mInMatch = false;
+		}
+	} else {
+		mInGivenSum |= (word) b << (8 * (mInLen - (mInSize - 2)));
+	}
+
+	if (++mInLen == mInSize) {
+		mInSize = 0;
+
+		memset(pkt, 0, sizeof(pkt));
+		pkt[0] = CMD_START_CODE_1;
+		pkt[1] = CMD_START_CODE_2;
+		pkt[2] = DEVICE_ID_LSB;
+		pkt[3] = DEVICE_ID_MSB;
+		pkt[8] = EMU_CMD_UPLOADED & 0xFF;
+		pkt[9] = EMU_CMD_UPLOADED >> 8;
+		sum = checkSum(pkt, CMD_PKT_SIZE - 2);
+		pkt[10] = sum & 0xFF;
+		pkt[11] = sum >> 8;
+
+		queueCommand(pkt, mRxWireAt);
+	}
+}
+
+/**
+ * Carries out a command packet and queues the reply.
+ *
+ * @param pkt The command packet
+ */
+void FingerprintEmulator::execute(const byte* pkt) {
+	word cmd = (pkt[9] << 8) | pkt[8];	// The command code
+	dword param = ((dword) pkt[7] << 24) | ((dword) pkt[6] << 16) | (pkt[5] << 8) | pkt[4];	// The command parameter
+	uint8_t count = enrolledCount();	// Number of enrolled IDs
+	uint8_t i;							// Loop counter
+
+	if (cmd != EMU_CMD_UPLOADED) {
+		++mCommands;
+	}
+
+	if (checkSum(pkt, CMD_PKT_SIZE - 2) != ((pkt[11] << 8) | pkt[10])) {
+		reply(false, NACK_COMM_ERR);
+		return;
+	}
+
+	switch (cmd) {
+		case CMD_OPEN:
+			reply(true, 0);
+			if (param != 0) {
+				sendDeviceInfo();
+			}
+			break;
+
+		case CMD_CLOSE:
+			reply(true, 0);
+			break;
+
+		case CMD_CMOS_LED:
+			mLedOn = (param != 0);
+			reply(true, 0);
+			break;
+
+		case CMD_CHANGE_BAUDRATE:
+			if (param == 9600 || param == 19200 || param == 38400 || param == 57600 || param == 115200) {
+				mBaudrate = param;
+				reply(true, 0);
+			} else {
+				reply(false, NACK_INVALID_PARAM);
+			}
+			break;
+
+		case CMD_GET_ENROLL_COUNT:
+			reply(true, count);
+			break;
+
+		case CMD_CHECK_ENROLLED:
+			if (param >= EMU_DB_SIZE) {
+				reply(false, NACK_INVALID_POS);
+			} else if (mDb[param] == EMU_NO_FINGER) {
+				reply(false, NACK_IS_NOT_USED);
+			} else {
+				reply(true, 0);
+			}
+			break;
+
+		case CMD_ENROLL_START:
+			if (param >= EMU_DB_SIZE) {
+				reply(false, NACK_INVALID_POS);
+			} else if (mDb[param] != EMU_NO_FINGER) {
+				reply(false, NACK_IS_ALREADY_USED);
+			} else if (count == EMU_DB_SIZE) {
+				reply(false, NACK_DB_IS_FULL);
+			} else {
+				mEnrollID = param;
+				mEnrollStage = 0;
+				reply(true, 0);
+			}
+			break;
+
+		// Each template needs its own capture, and all three must be of the same finger
+		case CMD_ENROLL1:
+		case CMD_ENROLL2:
+		case CMD_ENROLL3:
+			if (mEnrollID < 0 || cmd - CMD_ENROLL1 != mEnrollStage || mCaptured == EMU_NO_FINGER) {
+				reply(false, NACK_ENROLL_FAILED);
+			} else if (mEnrollStage > 0 && mCaptured != mEnrollFinger) {
+				mEnrollID = -1;
+				reply(false, NACK_ENROLL_FAILED);
+			} else {
+				mEnrollFinger = mCaptured;
+				if (++mEnrollStage == 3) {
+					mDb[mEnrollID] = mEnrollFinger;
+					mEnrollID = -1;
+				}
+				reply(true, 0);
+			}
+			mCaptured = EMU_NO_FINGER;
+			break;
+
+		case CMD_IS_PRESS_FINGER:
+			reply(true, mFinger == EMU_NO_FINGER ? 1 : 0);
+			break;
+
+		case CMD_DELETE_ID:
+			if (param >= EMU_DB_SIZE) {
+				reply(false, NACK_INVALID_POS);
+			} else if (mDb[param] == EMU_NO_FINGER) {
+				reply(false, NACK_IS_NOT_USED);
+			} else {
+				mDb[param] = EMU_NO_FINGER;
+				reply(true, 0);
+			}
+			break;
+
+		case CMD_DELETE_ALL:
+			if (count == 0) {
+				reply(false, NACK_DB_IS_EMPTY);
+			} else {
+				for (i = 0; i < EMU_DB_SIZE; ++i) {
+					mDb[i] = EMU_NO_FINGER;
+				}
+				reply(true, 0);
+			}
+			break;
+
+		case CMD_VERIFY:
+			if (param >= EMU_DB_SIZE) {
+				reply(false, NACK_INVALID_POS);
+			} else if (mDb[param] == EMU_NO_FINGER) {
+				reply(false, NACK_IS_NOT_USED);
+			} else if (!matches(mCaptured, mDb[param])) {
+				reply(false, NACK_VERIFY_FAILED);
+			} else {
+				reply(true, 0);
+			}
+			break;
+
+		case CMD_IDENTIFY:
+			for (i = 0; i < EMU_DB_SIZE && (mDb[i] == EMU_NO_FINGER || !matches(mCaptured, mDb[i])); ++i);
+
+			if (count == 0) {
+				reply(false, NACK_DB_IS_EMPTY);
+			} else if (i == EMU_DB_SIZE) {
+				reply(false, NACK_IDENTIFY_FAILED);
+			} else {
+				reply(true, i);
+			}
+			break;
+
+		case CMD_CAPTURE_FINGER:
+			mCaptured = mFinger;
+			mCapturedImpression = mImpression++;
+			mCapturedLow = (param == 0);
+			if (mFinger == EMU_NO_FINGER) {
+				reply(false, NACK_FINGER_IS_NOT_PRESSED);
+			} else if (mCapturedLow && mLowBadFinger > 0 && nextRandom() % 1000 < mLowBadFinger) {
+				mCaptured = EMU_NO_FINGER;
+				reply(false, NACK_BAD_FINGER);
+			} else {
+				reply(true, 0);
+			}
+			break;
+
+		case CMD_MAKE_TEMPLATE:
+			if (mCaptured == EMU_NO_FINGER) {
+				reply(false, NACK_BAD_FINGER);
+			} else {
+				reply(true, 0);
+				sendData(cmd, mCaptured, TEMPLATE_SIZE);
+			}
+			break;
+
+		case CMD_GET_IMAGE:
+			reply(true, 0);
+			sendData(cmd, mCaptured, IMAGE_SIZE, mCapturedImpression);
+			break;
+
+		// The raw image is taken there and then, finger or not
+		case CMD_GET_RAW_IMAGE:
+			reply(true, 0);
+			sendData(cmd, mFinger, RAW_IMAGE_SIZE, mImpression++);
+			break;
+
+		case CMD_GET_TEMPLATE:
+			if (param >= EMU_DB_SIZE) {
+				reply(false, NACK_INVALID_POS);
+			} else if (mDb[param] == EMU_NO_FINGER) {
+				reply(false, NACK_IS_NOT_USED);
+			} else {
+				reply(true, 0);
+				sendData(cmd, mDb[param], TEMPLATE_SIZE);
+			}
+			break;
+
+		// The template itself follows the acknowledgement as a data packet
+		case CMD_SET_TEMPLATE:
+			if (param >= EMU_DB_SIZE) {
+				reply(false, NACK_INVALID_POS);
+			} else {
+				mInID = param;
+				mInSize = TEMPLATE_SIZE + DATA_PKT_ADD;
+				mInLen = 0;
+				mInSum = 0;
+				mInGivenSum = 0;
+				mInMatch = true;
+				reply(true, 0);
+			}
+			break;
+
+		// A template the emulator didn't make can't be tied to a finger, so it's refused
+		case EMU_CMD_UPLOADED:
+			if (mInSum != mInGivenSum) {
+				reply(false, NACK_COMM_ERR);
+			} else if (!mInMatch) {
+				reply(false, NACK_INVALID_PARAM);
+			} else {
+				mDb[mInID] = mInFinger;
+				reply(true, 0);
+			}
+			break;
+
+		default:
+			reply(false, NACK_IS_NOT_SUPPORTED);
+			break;
+	}
+}
+
+/**
+ * Queues a response packet.
+ *
+ * @param ack True for an ACK, false for a NACK
+ * @param param The response parameter, or the error code of a NACK
+ */
+void FingerprintEmulator::reply(bool ack, dword param) {
+	byte pkt[RESP_PKT_SIZE];	// The response packet
+	word sum;					// The packet's checksum
+
+	pkt[0] = RES_START_CODE_1;
+	pkt[1] = RES_START_CODE_2;
+	pkt[2] = DEVICE_ID_LSB;
+	pkt[3] = DEVICE_ID_MSB;
+	pkt[4] = param & 0xFF;
+	pkt[5] = (param >> 8) & 0xFF;
+	pkt[6] = (param >> 16) & 0xFF;
+	pkt[7] = (param >> 24) & 0xFF;
+	pkt[8] = ack ? ACK : NACK;
+	pkt[9] = 0x00;
+
+	sum = checkSum(pkt, RESP_PKT_SIZE - 2);
+	pkt[10] = sum & 0xFF;
+	pkt[11] = sum >> 8;
+
+	queueOut(pkt, RESP_PKT_SIZE);
+}
+
+/**
+ * Queues the device information data packet sent after an open with error
+ * checking.
+ */
+void FingerprintEmulator::sendDeviceInfo() {
+	byte pkt[DEVICE_INFO_SIZE + DATA_PKT_ADD];	// The data packet
+	dword firmware = 0x20120522;				// The firmware version reported
+	dword isoSize = 0x00000C80;					// The ISO template area size reported
+	word sum;									// The packet's checksum
+
+	pkt[0] = DATA_START_CODE_1;
+	pkt[1] = DATA_START_CODE_2;
+	pkt[2] = DEVICE_ID_LSB;
+	pkt[3] = DEVICE_ID_MSB;
+
+	for (uint8_t i = 0; i < 4; ++i) {
+		pkt[4 + i] = (firmware >> (8 * i)) & 0xFF;
+		pkt[8 + i] = (isoSize >> (8 * i)) & 0xFF;
+	}
+	memcpy(&pkt[12], mSerial, SERIAL_NUM_SIZE);
+
+	sum = checkSum(pkt, sizeof(pkt) - 2);
+	pkt[sizeof(pkt) - 2] = sum & 0xFF;
+	pkt[sizeof(pkt) - 1] = sum >> 8;
+
+	queueOut(pkt, sizeof(pkt));
+}
+
+/**
+ * Starts a data packet whose payload is generated byte by byte as it is
+ * sent, so even a full image takes no buffer space.
+ *
+ * @param kind The command the data packet answers
+ * @param finger The finger the payload is made from
+ * @param size The size of the payload
+ * @param impression The impression of the finger an image is drawn from (default 0)
+ */
+void FingerprintEmulator::sendData(word kind, int16_t finger, uint32_t size, uint16_t impression) {
+	mGenKind = kind;
+	mGenFinger = finger;
+	mSynth.select(finger, impression);
+	mGenTotal = size + DATA_PKT_ADD;
+	mGenPos = 0;
+	mGenSum = 0;
+}
+
+/**
+ * Generates a byte of the payload of the data packet being sent. Images
+ * are synthetic prints of the finger, each capture a new impression, and
+ * the 160x120 raw image is a coarser sampling of the same print. Templates
+ * only depend on the finger, so the same finger always gives the same
+ * template.
+ *
+ * @param i The position of the byte in the payload
+ *
+ * @return The byte
+ */
+byte FingerprintEmulator::payloadByte(uint32_t i) {
+	switch (mGenKind) {
+		case CMD_GET_IMAGE:
+			return mSynth.pixel(i % SYNTH_WIDTH, i / SYNTH_WIDTH);
+
+		case CMD_GET_RAW_IMAGE:
+			return mSynth.pixel((i % 160) * 3 / 2, (i / 160) * 9 / 5);
+
+		default:
+			return FingerprintSynth::templateByte(mGenFinger, i);
+	}
+}
+
+/**
+ * Decides whether a captured finger matches an enrolled one, getting it
+ * wrong as often as set with setMatchErrors() and, for low quality
+ * captures, setLowQualityErrors().
+ *
+ * @param captured The captured finger, EMU_NO_FINGER if none
+ * @param enrolled The enrolled finger
+ *
+ * @return True for a match, false otherwise
+ */
+bool FingerprintEmulator::matches(int16_t captured, int16_t enrolled) {
+	if (captured == EMU_NO_FINGER) {
+		return false;
+	}
+
+	if (captured == enrolled) {
+		uint16_t falseReject = mFalseReject + (mCapturedLow ? mLowFalseReject : 0);	// The false reject rate of this capture
+
+		return !(falseReject > 0 && nextRandom() % 1000 < falseReject);
+	}
+
+	return mFalseAccept > 0 && nextRandom() % 1000 < mFalseAccept;
+}
+
+/**
+ * Counts the enrolled IDs.
+ *
+ * @return The number of enrolled IDs
+ */
+uint8_t FingerprintEmulator::enrolledCount() {
+	uint8_t count = 0;
+
+	for (uint8_t i = 0; i < EMU_DB_SIZE; ++i) {
+		count += (mDb[i] != EMU_NO_FINGER);
+	}
+
+	return count;
+}
+
+/**
+ * Adds bytes to the response buffer, unless they don't all fit.
+ *
+ * @param buf The bytes to add
+ * @param size The number of bytes
+ *
+ * @return True if the bytes were added, false if the buffer was too full
+ */
+bool FingerprintEmulator::queueOut(const byte* buf, uint8_t size) {
+	if (mOutLen + size > EMU_OUT_SIZE) {
+		return false;
+	}
+
+	for (uint8_t i = 0; i < size; ++i) {
+		mOut[(mOutHead + mOutLen) % EMU_OUT_SIZE] = buf[i];
+		++mOutLen;
+	}
+
+	return true;
+}
+
+/**
+ * Works out how long the sensor takes to process a command, using the
+ * override set with setLatency() if there is one.
+ *
+ * @param pkt The command packet
+ *
+ * @return The processing time in milliseconds
+ */
+dword FingerprintEmulator::latencyFor(const byte* pkt) {
+	word cmd = (pkt[9] << 8) | pkt[8];	// The command code
+
+	for (uint8_t i = 0; i < mLatencyCount; ++i) {
+		if (mLatencyCmd[i] == cmd) {
+			return mLatencyMs[i];
+		}
+	}
+
+	switch (cmd) {
+		case CMD_OPEN:
+			return 50;
+
+		// A high quality capture (non-zero parameter) takes much longer
+		case CMD_CAPTURE_FINGER:
+			return pkt[4] != 0 ? 750 : 300;
+
+		case CMD_ENROLL1:
+		case CMD_ENROLL2:
+		case CMD_ENROLL3:
+			return 600;
+
+		case CMD_VERIFY:
+			return 150;
+
+		// A 1:N search takes longer the more templates there are to compare
+		case CMD_IDENTIFY:
+			return 150 + 20 * enrolledCount();
+
+		case CMD_DELETE_ALL:
+			return 100;
+
+		case CMD_MAKE_TEMPLATE:
+		case CMD_GET_RAW_IMAGE:
+			return 300;
+
+		case CMD_GET_IMAGE:
+			return 100;
+
+		default:
+			return 20;
+	}
+}
+
+/**
+ * Computes the checksum of the given bytes, i.e. their sum.
+ *
+ * @param buf The bytes
+ * @param size The number of bytes
+ *
+ * @return The checksum
+ */
+word FingerprintEmulator::checkSum(const byte* buf, uint8_t size) {
+	word sum = 0x0000;
+
+	for (uint8_t i = 0; i < size; ++i) {
+		sum += buf[i];
+	}
+
+	return sum;
+}
+
+// END FINGERPRINTEMULATOR PRIVATE
@@ -0,0 +1,178 @@
+#ifndef FINGERPRINT_EMULATOR_H
+#define FINGERPRINT_EMULATOR_H
+
+/* Includes */
+#include <Arduino.h>
+#include "FingerprintModule.h"
+#include "FingerprintSynth.h"
+
+/* Symbolic constants */
+// The number of enrollment IDs the emulated sensor can store
+#define EMU_DB_SIZE 20
+
+// The number of complete command packets held while the emulated sensor is busy
+#define EMU_CMD_QUEUE 4
+
+// The size of the buffer holding response bytes the sensor has yet to send
+#define EMU_OUT_SIZE 64
+
+// The largest receive FIFO that can be simulated, and the size used by default (the AVR core's Serial buffer)
+#define EMU_FIFO_MAX 256
+#define EMU_FIFO_DEFAULT 64
+
+// The number of commands whose processing time can be overridden with setLatency()
+#define EMU_LATENCY_SLOTS 8
+
+// The value of a finger meaning no finger is on the sensor
+#define EMU_NO_FINGER SYNTH_NO_FINGER
+
+// The command code queued internally once an uploaded template has fully arrived, unused by the sensor
+#define EMU_CMD_UPLOADED 0xFF71
+
+/* Class definitions */
+// A clock whose time only moves when it is told to, so waiting costs nothing
+class FingerprintVirtualClock : public FingerprintClock {
+	private:
+		unsigned long mNow;		// The current virtual time in milliseconds
+
+	public:
+		FingerprintVirtualClock(unsigned long start = 0);
+
+		unsigned long millis();
+		unsigned long micros();
+		void delay(dword);
+		void advance(dword);
+};
+
+// Stands in for a GT-511C1R, answering commands after a simulated processing and transfer time
+class FingerprintEmulator : public Stream {
+	private:
+		FingerprintClock& mClock;					// The clock processing times are measured on
+		byte mRx[CMD_PKT_SIZE];						// The command packet being received
+		uint8_t mRxLen;								// Number of bytes of mRx received so far
+		unsigned long mRxWireAt;					// Time in microseconds at which the last byte sent by the driver reaches the sensor
+		byte mQueue[EMU_CMD_QUEUE][CMD_PKT_SIZE];	// Complete commands waiting to be processed, the first one in progress
+		unsigned long mQueueAt[EMU_CMD_QUEUE];		// Time in microseconds at which each command reached the sensor
+		uint8_t mQueueHead;							// Index of the oldest command
+		uint8_t mQueueLen;							// Number of commands in the queue
+		bool mBusy;									// True while the oldest command is being processed
+		unsigned long mDoneAt;						// Time in microseconds at which the command in progress completes
+		unsigned long mIdleAt;						// Time in microseconds at which the sensor last finished sending a reply
+		byte mOut[EMU_OUT_SIZE];					// Response bytes the sensor has yet to send
+		uint8_t mOutHead;							// Index of the next response byte to send
+		uint8_t mOutLen;							// Number of response bytes to send
+		uint32_t mGenTotal;							// Size of the generated data packet being sent, 0 if none
+		uint32_t mGenPos;							// Number of bytes of the generated data packet sent so far
+		word mGenSum;								// Running checksum of the generated data packet
+		word mGenKind;								// The command the generated data packet answers
+		int16_t mGenFinger;							// The finger the generated data packet is made from
+		FingerprintSynth mSynth;					// Draws the images of the generated data packets
+		uint8_t mBitsPerByte;						// The number of bits on the line per byte, e.g. 10 for 8N1
+		dword mJitter;								// The largest random gap between two bytes in microseconds
+		unsigned long mWireAt;						// Time in microseconds at which the next byte sent by the sensor arrives
+		uint32_t mWireFrac;							// Fraction of a microsecond carried over between bytes, in 1/mBaudrate units
+		unsigned long mReplyStart;					// Time in microseconds at which the sensor started sending the current reply
+		dword mLastTransfer;						// Time in microseconds taken to send the last complete reply
+		uint32_t mRand;								// State of the jitter's random number generator
+		byte mFifo[EMU_FIFO_MAX];					// The driver's receive FIFO
+		uint16_t mFifoSize;							// The capacity of the receive FIFO
+		uint16_t mFifoHead;							// Index of the next byte to read from the receive FIFO
+		uint16_t mFifoLen;							// Number of bytes in the receive FIFO
+		uint16_t mFifoHighWater;					// The most bytes the receive FIFO ever held
+		dword mOverruns;							// Number of bytes lost because the receive FIFO was full
+		dword mBytesSent;							// Number of bytes the sensor put on the line
+		uint16_t mDropRate;							// Replies lost on the line, per thousand commands
+		uint16_t mCorruptRate;						// Replies with a corrupted byte, per thousand commands
+		uint16_t mNoiseRate;						// Replies preceded by a stray byte, per thousand commands
+		dword mFaults;								// Number of faults injected
+		uint32_t mInSize;							// Size of the data packet the driver is uploading, 0 if none is expected
+		uint32_t mInLen;							// Number of bytes of the uploaded data packet received so far
+		word mInSum;								// Running checksum of the uploaded data packet
+		word mInGivenSum;							// The checksum the uploaded data packet ends with
+		int16_t mInFinger;							// The finger the uploaded template was made from
+		bool mInMatch;								// True while the uploaded template looks like one the emulator made
+		uint8_t mInID;								// The ID the uploaded template is stored under
+		int16_t mDb[EMU_DB_SIZE];					// The finger enrolled at each ID, EMU_NO_FINGER if free
+		int16_t mFinger;							// The finger on the sensor, EMU_NO_FINGER if none
+		int16_t mCaptured;							// The finger in the last captured image, EMU_NO_FINGER if none
+		uint16_t mImpression;						// Number of impressions taken so far
+		uint16_t mCapturedImpression;				// The impression in the last captured image
+		uint16_t mFalseReject;						// Genuine matches refused, per thousand
+		uint16_t mFalseAccept;						// Impostor matches accepted, per thousand
+		bool mCapturedLow;							// True if the last captured image is a low quality one
+		uint16_t mLowBadFinger;						// Low quality captures refused as NACK_BAD_FINGER, per thousand
+		uint16_t mLowFalseReject;					// Extra genuine matches refused on low quality captures, per thousand
+		int32_t mEnrollID;							// The ID being enrolled, -1 if no enrollment is in progress
+		uint8_t mEnrollStage;						// The number of enrollment templates made so far
+		int16_t mEnrollFinger;						// The finger the enrollment templates were made from
+		bool mLedOn;								// Whether the CMOS LED is on
+		uint32_t mBaudrate;							// The speed of the serial line in bits per second, 0 for instant transfers
+		byte mSerial[SERIAL_NUM_SIZE];				// The serial number reported by open
+		word mLatencyCmd[EMU_LATENCY_SLOTS];		// Commands whose processing time was overridden
+		dword mLatencyMs[EMU_LATENCY_SLOTS];		// The overriding processing times in milliseconds
+		uint8_t mLatencyCount;						// Number of overrides in use
+		dword mCommands;							// Number of commands processed
+		dword mDropped;								// Number of commands dropped because the queue was full
+		bool mPlugged;								// Whether the sensor is connected to the line
+
+		unsigned long now();
+		void update();
+		bool drainWire(unsigned long);
+		uint32_t txPending();
+		byte nextTxByte();
+		dword byteTime(bool);
+		uint32_t nextRandom();
+		void injectFaults();
+		void queueCommand(const byte*, unsigned long);
+		void takeUpload(byte);
+		void execute(const byte*);
+		void reply(bool, dword);
+		void sendDeviceInfo();
+		void sendData(word, int16_t, uint32_t, uint16_t impression = 0);
+		bool matches(int16_t, int16_t);
+		uint8_t enrolledCount();
+		byte payloadByte(uint32_t);
+		bool queueOut(const byte*, uint8_t);
+		dword latencyFor(const byte*);
+		static word checkSum(const byte*, uint8_t);
+
+	public:
+		FingerprintEmulator(FingerprintClock&);
+
+		int available();
+		int read();
+		int peek();
+		size_t write(uint8_t);
+		void flush();
+		using Print::write;
+
+		void setFinger(int16_t);
+		int16_t getFinger();
+		void enroll(uint8_t, int16_t);
+		int16_t getEnrolled(uint8_t);
+		void setLatency(word, dword);
+		void setSerialNumber(const byte[]);
+		uint32_t getBaudrate();
+		bool isLedOn();
+		dword getCommandCount();
+		dword getDroppedCount();
+
+		void setUart(uint32_t, uint8_t bitsPerByte = 10, dword jitter = 0, uint32_t seed = 1);
+		void setFifoSize(uint16_t);
+		dword getOverrunCount();
+		uint16_t getFifoHighWater();
+		dword getBytesSent();
+		dword getLastTransferTime();
+		void resetUartStats();
+
+		void setFaults(uint16_t, uint16_t, uint16_t);
+		dword getFaultCount();
+
+		void setMatchErrors(uint16_t, uint16_t);
+		void setLowQualityErrors(uint16_t, uint16_t);
+
+		void setPlugged(bool);
+		bool isPlugged();
+};
+
+#endif
@@ -3,10 +3,13 @@
  *
  * Notes:
  *	-	Each time this class is instantiated, it statically allocates both the response and data
- *		packet buffers. The response packet buffer is set to an easily manageable 12 bytes, but
- *		the data packet buffer is allocated to its maximum possible size of 51,840 bytes.
- *		This means special attention should be made that there be enough RAM available to store
- *		this rather large object.
+ *		packet buffers. The response packet buffer is set to an easily manageable 12 bytes, and
+ *		the data packet buffer to DATA_BUFFER_SIZE bytes. By default that is DATA_PKT_MAX_SIZE,
+ *		51,846 bytes, enough for a whole image, so special attention should be made that there
+ *		be enough RAM available to store this rather large object. Define DATA_BUFFER_SIZE as
+ *		low as TEMPLATE_SIZE + DATA_PKT_ADD to save 51 KB per module, streaming images with
+ *		getImage(Print&) instead, and FINGERPRINT_RAM_BUDGET to have the compiler check the
+ *		size of the module (see the Footprint example).
  *	-	This library gives you public access to the response and data packet arrays. Mutual
  *		exclusion is not guaranteed, and any changes made using these pointers will permanently
  *		change the buffer. It's recommended to do a copy into your own data buffer, and to ensure
@@ -26,23 +29,206 @@
 // Includes
 #include "FingerprintModule.h"
 
+// Check the configuration and memory budget set in FingerprintModule.h
+static_assert(DATA_BUFFER_SIZE >= DEVICE_INFO_SIZE + DATA_PKT_ADD, "DATA_BUFFER_SIZE can't hold the device information");
+static_assert(DATA_BUFFER_SIZE <= DATA_PKT_MAX_SIZE, "DATA_BUFFER_SIZE is larger than any data packet");
+static_assert(FINGERPRINT_RAM_BUDGET == 0 || sizeof(FingerprintModule) <= FINGERPRINT_RAM_BUDGET, "FingerprintModule is over FINGERPRINT_RAM_BUDGET");
+
+// The clock used by every module until another one is set
+static FingerprintClock defaultClock;
+
+// Upper bounds of the command latency histogram buckets in milliseconds, the last bucket having none
+static const dword latencyBounds[METRIC_BUCKETS - 1] = { 10, 50, 100, 250, 500, 1000, 2500, 5000 };
+
+// BEGIN FINGERPRINTCLOCK PUBLIC
+
+/**
+ * Retrieves the current time.
+ *
+ * @return The number of milliseconds since the board started
+ */
+unsigned long FingerprintClock::millis() {
+	return ::millis();
+}
+
+/**
+ * Retrieves the current time with a finer resolution, for timestamps such
+ * as those of a FingerprintRecorder. A derived clock keeping time in
+ * milliseconds only should return millis() * 1000.
+ *
+ * @return The number of microseconds since the board started
+ */
+unsigned long FingerprintClock::micros() {
+	return ::micros();
+}
+
+/**
+ * Waits for the given amount of time.
+ *
+ * @param ms The time to wait in milliseconds
+ */
+void FingerprintClock::delay(dword ms) {
+	::delay(ms);
+}
+
+// END FINGERPRINTCLOCK PUBLIC
+
 // BEGIN PUBLIC
 
 /**
- * Initializes the fingerprint module by doing the following:
- *	- Open serial communications
+ * Initializes the fingerprint module's state. Serial communications are not
+ * touched here, so a global instance is safe to construct; call begin() and
+ * poll(), or simply open(), to bring the sensor up.
  */
 FingerprintModule::FingerprintModule() {
-	COMMS.begin(9600);
-	while(!COMMS);
+	mOpTime = 0;
+	mCancelToken = 0x00;
+	mDeadlineSet = false;
+	mAborted = false;
+	mAbortedStart = 0;
+	mAbortedDue = 0;
+	mBaudrate = 9600;
+	mCommsBegun = false;
+	mPortOpen = false;
+	mOpenState = OPEN_IDLE;
+	mComms = &COMMS;
+	mFlightNext = 0;
+	mFlightCount = 0;
+	mFlightOut = 0x00;
+	mCmdObserver = 0x00;
+	mCmdObserverCtx = 0x00;
+	mLastCmd = 0;
+	mCmdStart = 0;
+	mSent = false;
+	mClock = &defaultClock;
+	mPresence = 0x00;
+	mPresenceCtx = 0x00;
+	mDetached = false;
+	mSilent = 0;
+	memset(&mDevInfo, 0, sizeof(mDevInfo));
+
+	clearMetrics();
 }
 
 /**
  * Destroys the fingerprint module by doing the following:
- *	- Close serial communications
+ *	- Close serial communications, if this module started them on COMMS and
+ *	  still talks to the sensor through it rather than through a stream
  */
 FingerprintModule::~FingerprintModule() {
-	COMMS.end();
+	if (mPortOpen && mComms == &COMMS) {
+		COMMS.end();
+	}
+}
+
+/**
+ * Starts bringing the sensor up without blocking: opens serial communications
+ * at the given baudrate and returns immediately. The rest of the sequence,
+ * waiting for the port and sending the open command with error checking, is
+ * carried out by subsequent calls to poll(), so the rest of the firmware can
+ * start up in the meantime.
+ *
+ * @param baud The baudrate to talk to the sensor at, defaults to its power-on rate of 9600
+ */
+void FingerprintModule::begin(uint32_t baud) {
+	COMMS.begin(baud);
+	mBaudrate = baud;
+	mCommsBegun = true;
+	mPortOpen = true;
+	mOpenState = OPEN_WAIT_PORT;
+}
+
+/**
+ * Advances the open sequence started by begin() by one step, never waiting on
+ * the sensor. Call it regularly (e.g. from loop()) until it returns true or
+ * getOpenState() reports OPEN_FAILED, in which case getErrorCode() tells why.
+ *
+ * @return True once the sensor is open and ready, false otherwise
+ */
+bool FingerprintModule::poll() {
+	switch (mOpenState) {
+		// Wait for the serial port to come up, then send the open command
+		case OPEN_WAIT_PORT:
+			if (COMMS) {
+				mOpenStarted = mClock->millis();
+				mOpenState = send(CMD_OPEN, true) ? OPEN_WAIT_RESPONSE : OPEN_FAILED;
+			}
+			break;
+
+		// Only read the response once it has fully arrived so it isn't torn apart. Noise ahead of it is
+		// thrown away and, as in waitResponse(), the rest is waited for until the deadline
+		case OPEN_WAIT_RESPONSE:
+			if (mComms->available() >= RESP_PKT_SIZE && recvResponsePkt()) {
+				mOpenState = mRespStatus ? OPEN_WAIT_DATA : OPEN_FAILED;
+			} else if (mClock->millis() - mOpenStarted >= (dword) TIMEOUT * WAITTIME) {
+				// One last look, which also sets the error code if nothing usable came
+				mOpenState = (recvResponsePkt() && mRespStatus) ? OPEN_WAIT_DATA : OPEN_FAILED;
+			}
+			break;
+
+		// Same for the data packet holding the device information
+		case OPEN_WAIT_DATA:
+			if (mComms->available() >= DEVICE_INFO_SIZE + DATA_PKT_ADD) {
+				mOpenState = (recvDataPkt(DEVICE_INFO_SIZE) && storeDeviceInfo()) ? OPEN_READY : OPEN_FAILED;
+			} else if (mClock->millis() - mOpenStarted >= (dword) TIMEOUT * WAITTIME) {
+				mRespStatus = false;
+				mRespParam = NACK_NOT_RECVD;
+				mOpenState = OPEN_FAILED;
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	return mOpenState == OPEN_READY;
+}
+
+/**
+ * Retrieves the progress of the open sequence started by begin(). A
+ * blocking open() also moves the state to OPEN_READY or OPEN_FAILED.
+ *
+ * @return The current state of the open sequence
+ */
+OPEN_STATE FingerprintModule::getOpenState() {
+	return mOpenState;
+}
+
+/**
+ * Routes the bytes exchanged with the sensor through the given stream rather
+ * than reading and writing COMMS directly, e.g. to record the traffic with a
+ * FingerprintRecorder wrapped around COMMS, or to replay a recording with a
+ * FingerprintReplay. Starting, stopping and changing the speed of the serial
+ * port are still done on COMMS, except by reconnect(), which leaves COMMS
+ * alone while a stream is set and only notes the rate it tries.
+ *
+ * @param stream The stream to use, or null to go back to COMMS
+ */
+void FingerprintModule::setStream(Stream* stream) {
+	mComms = (stream != 0x00) ? stream : &COMMS;
+}
+
+/**
+ * Replaces the source of time used for timeouts, delays, deadlines and
+ * latency measurements. With a virtual clock whose delay() only moves its
+ * time forward, such as the one driving a FingerprintEmulator, scenarios
+ * spanning minutes of sensor time run in a few milliseconds while every
+ * reported latency is still in sensor time.
+ *
+ * @param clock The clock to use, or null to go back to millis() and delay()
+ */
+void FingerprintModule::setClock(FingerprintClock* clock) {
+	mClock = (clock != 0x00) ? clock : &defaultClock;
+}
+
+/**
+ * Retrieves the source of time used by the module, so code working with it
+ * (e.g. a scheduler or watchdog) can measure time the same way.
+ *
+ * @return The clock in use
+ */
+FingerprintClock& FingerprintModule::getClock() {
+	return *mClock;
 }
 
 /**
@@ -79,6 +265,311 @@ bool FingerprintModule::getResponseStatus() {
 	return mRespStatus;
 }
 
+/**
+ * Retrieves the time taken by the last multi-step operation which reports
+ * its duration, such as verifyAny().
+ *
+ * @return The duration of the operation in milliseconds
+ */
+dword FingerprintModule::getOperationTime() {
+	return mOpTime;
+}
+
+/**
+ * Attaches a cancellation token to the module. The token is a flag which can
+ * be raised at any time, e.g. from an interrupt or by a supervising task, to
+ * abort whatever operation is in progress. The module checks the flag while
+ * waiting on the sensor, so a raised flag makes the current command fail with
+ * NACK_CANCELLED within a few milliseconds, and every following command fail
+ * immediately until the flag is lowered again. Pass a null pointer to detach.
+ *
+ * @param token A pointer to the flag to watch, or null
+ */
+void FingerprintModule::setCancelToken(volatile bool* token) {
+	mCancelToken = token;
+}
+
+/**
+ * Gives every operation from now on a shared time budget. Once the budget is
+ * spent, the command in progress fails with NACK_DEADLINE_EXCEEDED and so does
+ * every following command until clearDeadline() or another setDeadline() is
+ * called. Wrapping a whole user interaction (e.g. an enrollSequence() or a
+ * capture and identify) in a deadline bounds its total latency.
+ *
+ * @param budget The time budget in milliseconds, starting now
+ */
+void FingerprintModule::setDeadline(dword budget) {
+	mDeadline = mClock->millis() + budget;
+	mDeadlineSet = true;
+}
+
+/**
+ * Removes the deadline set by setDeadline().
+ */
+void FingerprintModule::clearDeadline() {
+	mDeadlineSet = false;
+}
+
+/**
+ * Prints the flight recorder's history of the most recent packets, oldest
+ * first. Each line holds the time the packet was sent or received, its kind,
+ * its command or ACK/NACK code, its parameter and whether it succeeded. Only
+ * headers are kept, never payloads, so the history costs FLIGHT_RECORDER_SIZE
+ * small entries whatever the traffic.
+ *
+ * @param out Where to print the history
+ */
+void FingerprintModule::dumpFlightRecorder(Print& out) {
+	#if FLIGHT_RECORDER_SIZE > 0
+		uint8_t first = (mFlightNext + FLIGHT_RECORDER_SIZE - mFlightCount) % FLIGHT_RECORDER_SIZE;
+
+		out.print(F("Flight recorder, last "));
+		out.print(mFlightCount);
+		out.println(F(" packets:"));
+
+		for (uint8_t i = 0; i < mFlightCount; ++i) {
+			FlightEntry& e = mFlight[(first + i) % FLIGHT_RECORDER_SIZE];
+
+			out.print(e.time);
+			switch (e.kind) {
+				case FLIGHT_CMD:
+					out.print(F(" ms  CMD  0x"));
+					break;
+
+				case FLIGHT_RESP:
+					out.print(F(" ms  RESP 0x"));
+					break;
+
+				case FLIGHT_DATA:
+					out.print(F(" ms  DATA 0x"));
+					break;
+
+				case FLIGHT_DATA_SENT:
+					out.print(F(" ms  DOUT 0x"));
+					break;
+
+				default:
+					out.print(F(" ms  TIMEOUT 0x"));
+					break;
+			}
+			out.print(e.code, HEX);
+			out.print(F(" param 0x"));
+			out.print(e.param, HEX);
+			out.println(e.ok ? F(" ok") : F(" FAILED"));
+		}
+	#else
+		out.println(F("Flight recorder disabled"));
+	#endif
+}
+
+/**
+ * Sets where the flight recorder's history is dumped automatically when a
+ * communications error or device error is received.
+ *
+ * @param out Where to dump the history, or null to disable automatic dumps
+ */
+void FingerprintModule::setFlightRecorderOutput(Print* out) {
+	mFlightOut = out;
+}
+
+/**
+ * Sets a function to be called each time a command completes, whether it
+ * was acknowledged, refused, timed out or aborted. It receives the command
+ * code, whether an ACK was received, the response parameter or error code,
+ * and the time in milliseconds from sending the command to the outcome.
+ * Used to monitor the health of the sensor, e.g. by a FingerprintWatchdog.
+ *
+ * @param obs The function to call, or null to stop monitoring
+ * @param ctx A pointer handed untouched to the function (optional)
+ */
+void FingerprintModule::setCommandObserver(commandObserver obs, void* ctx) {
+	mCmdObserver = obs;
+	mCmdObserverCtx = ctx;
+}
+
+/**
+ * Throws away whatever is waiting in the receive buffer, e.g. the remains of
+ * a torn or late packet, then checks that the sensor answers a cheap command.
+ *
+ * @return True if the sensor answered, false otherwise
+ */
+bool FingerprintModule::resync() {
+	discardInput();
+
+	return getEnrollCount();
+}
+
+/**
+ * Waits for the late reply to a command which was given up on to come and
+ * go, so the next command starts in step. Every command does this first
+ * anyway; calling it beforehand lets the wait be accounted for, e.g. as part
+ * of a scheduler's queueing delay. Returns at once if nothing is pending.
+ *
+ * @return True once in step, false if the wait was aborted (check error code)
+ */
+bool FingerprintModule::settle() {
+	return !mAborted || settleInput();
+}
+
+/**
+ * Writes the module's counters in the Prometheus text exposition format:
+ * commands completed and refused per command code, errors per error code,
+ * a command latency histogram, bytes in and out, timeouts, reconnect
+ * retries and resyncs. The counters are plain integers updated by the
+ * driver as it talks to the sensor, so collecting them costs the I/O path
+ * nothing; this only reads them. Serve the output after an HTTP header to
+ * an EthernetClient or WiFiClient, or write it to a file for a textfile
+ * collector. To export several sensors at once, use the static version so
+ * each metric is written as one group.
+ *
+ * @param out Where to write the metrics
+ * @param sensor The value of the sensor label, or null for no label
+ */
+void FingerprintModule::writeMetrics(Print& out, const char* sensor) {
+	FingerprintModule* self = this;
+
+	writeMetrics(out, &self, &sensor, 1);
+}
+
+/**
+ * Writes the counters of several modules in the Prometheus text exposition
+ * format, each metric holding one sample per module labelled with its name.
+ *
+ * @param out Where to write the metrics
+ * @param modules The modules to export
+ * @param names The value of the sensor label for each module
+ * @param count The number of modules
+ */
+void FingerprintModule::writeMetrics(Print& out, FingerprintModule* const modules[], const char* const names[], uint8_t count) {
+	uint8_t i, j;	// Loop counters
+
+	writeMetricHeader(out, F("fingerprint_commands_total"), F("Commands completed, by command code."), F("counter"));
+	for (i = 0; i < count; ++i) {
+		for (j = 0; j < modules[i]->mCmdCountLen; ++j) {
+			out.print(F("fingerprint_commands_total"));
+			writeMetricLabels(out, names[i], F("command"), modules[i]->mCmdCounts[j].cmd);
+			out.println(modules[i]->mCmdCounts[j].count);
+		}
+	}
+
+	writeMetricHeader(out, F("fingerprint_command_failures_total"), F("Commands which failed, by command code."), F("counter"));
+	for (i = 0; i < count; ++i) {
+		for (j = 0; j < modules[i]->mCmdCountLen; ++j) {
+			out.print(F("fingerprint_command_failures_total"));
+			writeMetricLabels(out, names[i], F("command"), modules[i]->mCmdCounts[j].cmd);
+			out.println(modules[i]->mCmdCounts[j].nacks);
+		}
+	}
+
+	writeMetricHeader(out, F("fingerprint_errors_total"), F("Errors returned, by error code."), F("counter"));
+	for (i = 0; i < count; ++i) {
+		for (j = 0; j < modules[i]->mErrCountLen; ++j) {
+			out.print(F("fingerprint_errors_total"));
+			writeMetricLabels(out, names[i], F("error"), modules[i]->mErrCounts[j].code);
+			out.println(modules[i]->mErrCounts[j].count);
+		}
+	}
+
+	// Prometheus histograms are cumulative and measured in seconds
+	writeMetricHeader(out, F("fingerprint_command_latency_seconds"), F("Time from sending a command to its outcome."), F("histogram"));
+	for (i = 0; i < count; ++i) {
+		dword total = 0;	// Commands in this bucket or a faster one
+
+		for (j = 0; j < METRIC_BUCKETS; ++j) {
+			total += modules[i]->mLatencyHist[j];
+
+			out.print(F("fingerprint_command_latency_seconds_bucket{"));
+			if (names[i] != 0x00) {
+				out.print(F("sensor=\""));
+				out.print(names[i]);
+				out.print(F("\","));
+			}
+			out.print(F("le=\""));
+			if (j < METRIC_BUCKETS - 1) {
+				out.print(latencyBounds[j] / 1000.0, 3);
+			} else {
+				out.print(F("+Inf"));
+			}
+			out.print(F("\"} "));
+			out.println(total);
+		}
+
+		out.print(F("fingerprint_command_latency_seconds_sum"));
+		writeMetricLabels(out, names[i], 0x00, 0);
+		out.println(modules[i]->mLatencySum / 1000.0, 3);
+
+		out.print(F("fingerprint_command_latency_seconds_count"));
+		writeMetricLabels(out, names[i], 0x00, 0);
+		out.println(total);
+	}
+
+	writeMetricHeader(out, F("fingerprint_received_bytes_total"), F("Bytes read from the sensor."), F("counter"));
+	for (i = 0; i < count; ++i) {
+		out.print(F("fingerprint_received_bytes_total"));
+		writeMetricLabels(out, names[i], 0x00, 0);
+		out.println(modules[i]->mBytesIn);
+	}
+
+	writeMetricHeader(out, F("fingerprint_sent_bytes_total"), F("Bytes sent to the sensor."), F("counter"));
+	for (i = 0; i < count; ++i) {
+		out.print(F("fingerprint_sent_bytes_total"));
+		writeMetricLabels(out, names[i], 0x00, 0);
+		out.println(modules[i]->mBytesOut);
+	}
+
+	writeMetricHeader(out, F("fingerprint_timeouts_total"), F("Commands which got no response in time."), F("counter"));
+	for (i = 0; i < count; ++i) {
+		out.print(F("fingerprint_timeouts_total"));
+		writeMetricLabels(out, names[i], 0x00, 0);
+		out.println(modules[i]->mTimeouts);
+	}
+
+	writeMetricHeader(out, F("fingerprint_retries_total"), F("Extra open attempts made while reconnecting."), F("counter"));
+	for (i = 0; i < count; ++i) {
+		out.print(F("fingerprint_retries_total"));
+		writeMetricLabels(out, names[i], 0x00, 0);
+		out.println(modules[i]->mRetries);
+	}
+
+	writeMetricHeader(out, F("fingerprint_resyncs_total"), F("Times buffered input was thrown away to get back in step."), F("counter"));
+	for (i = 0; i < count; ++i) {
+		out.print(F("fingerprint_resyncs_total"));
+		writeMetricLabels(out, names[i], 0x00, 0);
+		out.println(modules[i]->mResyncs);
+	}
+
+	writeMetricHeader(out, F("fingerprint_resync_bytes_total"), F("Bytes thrown away to get back in step."), F("counter"));
+	for (i = 0; i < count; ++i) {
+		out.print(F("fingerprint_resync_bytes_total"));
+		writeMetricLabels(out, names[i], 0x00, 0);
+		out.println(modules[i]->mResyncBytes);
+	}
+
+	writeMetricHeader(out, F("fingerprint_detaches_total"), F("Times the sensor was found unplugged or silent."), F("counter"));
+	for (i = 0; i < count; ++i) {
+		out.print(F("fingerprint_detaches_total"));
+		writeMetricLabels(out, names[i], 0x00, 0);
+		out.println(modules[i]->mDetaches);
+	}
+}
+
+/**
+ * Resets every counter exported by writeMetrics().
+ */
+void FingerprintModule::clearMetrics() {
+	mCmdCountLen = 0;
+	mErrCountLen = 0;
+	memset(mLatencyHist, 0, sizeof(mLatencyHist));
+	mLatencySum = 0;
+	mBytesIn = 0;
+	mBytesOut = 0;
+	mTimeouts = 0;
+	mRetries = 0;
+	mResyncs = 0;
+	mResyncBytes = 0;
+	mDetaches = 0;
+}
+
 /**
  * Accepts an error code and returns a string containing the companying error
  * message.
@@ -97,6 +588,26 @@ String FingerprintModule::strFromError(word errCode) {
 			return F("the enrollment stage is not between 0 and 2, restart the enrollment");
 			break;
 
+		case NACK_CANCELLED:
+			return F("the operation was cancelled");
+			break;
+
+		case NACK_DEADLINE_EXCEEDED:
+			return F("the operation did not complete before its deadline");
+			break;
+
+		case NACK_SERIAL_MISMATCH:
+			return F("the sensor's serial number does not match the expected one");
+			break;
+
+		case NACK_DETACHED:
+			return F("the sensor is detached, reattach it");
+			break;
+
+		case NACK_BUFFER_TOO_SMALL:
+			return F("the data packet does not fit in the buffer, raise DATA_BUFFER_SIZE");
+			break;
+
 		case NACK_INVALID_POS:
 			return F("the given ID is not between 0 and 19");
 			break;
@@ -178,26 +689,51 @@ String FingerprintModule::strFromError(word errCode) {
  * bad input or communications errors. If the error is unrecoverable,
  * the function returns and the error can be retrieved using getErrorCode().
  * If the second argument (a function pointer) is provided, it will be called
- * with a char array of size 16 providing a basic user-oriented message, e.g.
- * "Place finger". This way, any output device can be attached to this function
- * and used to provide the user with instructions.
+ * with an EnrollEvent describing each step of the enrollment: the start and end
+ * of the sequence, every state transition, every capture attempt, and every
+ * failed command. The event is a single stack object re-used for the whole
+ * sequence, so no allocation or string handling takes place, and each event
+ * carries a timestamp and the time spent in the previous state so the duration
+ * of every stage can be measured. Any output device can be attached this way
+ * to provide the user with instructions (e.g. "Place finger" on entering CAPTURE).
+ * The enrollment waits indefinitely for a finger to be placed; use setDeadline()
+ * or setCancelToken() to bound it.
  *
  * @param id The ID of the fingerprint to enroll
- * @param out A pointer to a function taking in a const char* (optional)
+ * @param obs A pointer to a function taking in an EnrollEvent (optional)
+ * @param ctx A pointer passed back untouched to the observer (optional)
  *
  * @return True on enrollment success, false otherwise
  */
-bool FingerprintModule::enrollSequence(uint32_t id, writeFunc out) {
+bool FingerprintModule::enrollSequence(uint32_t id, enrollObserver obs, void* ctx) {
 	bool success = true;					// Indicates whether the enrollment was successful
 	bool done = false;						// Indicates whether or not to exit the state machine
 	ENROLL_STATE state = START;				// Stores the current state of the state machine
-	bool usingStream = (out != 0x00);		// True if an output function was given
-
-	if (usingStream) {
-		out("Beginning enroll");
-	}
+	unsigned long began = mClock->millis();	// Time at which the sequence started
+	unsigned long stateEntered = began;		// Time at which the current state was entered
+	EnrollEvent evt;						// The event passed to the observer, re-used for every notification
+
+	evt.state = START;
+	evt.prevState = START;
+	evt.stage = 0;
+	evt.attempt = 0;
+	evt.errCode = 0;
+	evt.success = true;
+	evt.stateDuration = 0;
+	notifyEnroll(obs, ctx, evt, ENROLL_BEGIN);
 
 	while (!done) {
+		// Report any transition made by the previous iteration
+		if (state != evt.state) {
+			unsigned long now = mClock->millis();
+
+			evt.prevState = evt.state;
+			evt.state = state;
+			evt.stateDuration = now - stateEntered;
+			stateEntered = now;
+			notifyEnroll(obs, ctx, evt, ENROLL_STATE_CHANGE);
+		}
+
 		switch (state) {
 			// Begin enrollment for the specified ID, end execution on error
 			case START:
@@ -217,18 +753,18 @@ bool FingerprintModule::enrollSequence(uint32_t id, writeFunc out) {
 
 			// Capture the image of a fingerprint
 			case CAPTURE:
-				// Give user instruction to place finger
-				if (usingStream) {
-					out("Place finger");
-				}
-
 				// Error out if CMOS could not light
 				if (!powerCMOS(true)) {
 					success = false;
 					done = true;
 				} else {
 					// Try and capture a fingerprint, if comms have broke down return
-					if (captureFingerprint(true)) {
+					++evt.attempt;
+					evt.success = captureFingerprint(true);
+					evt.errCode = evt.success ? 0 : mRespParam;
+					notifyEnroll(obs, ctx, evt, ENROLL_CAPTURE_ATTEMPT);
+
+					if (evt.success) {
 						state = ENROLL;
 					} else {
 						if (mRespParam == NACK_COMM_ERR) {
@@ -243,6 +779,9 @@ bool FingerprintModule::enrollSequence(uint32_t id, writeFunc out) {
 			case ENROLL:
 				// Try and enroll, reset on failure
 				if (createEnrollmentTemplate()) {
+					evt.stage = mEnrollmentStage;
+					evt.attempt = 0;
+
 					if (mEnrollmentStage == 3) {
 						state = COMPLETE;
 					} else {
@@ -251,6 +790,8 @@ bool FingerprintModule::enrollSequence(uint32_t id, writeFunc out) {
 				} else {
 					if (mRespParam == NACK_ENROLL_FAILED || mRespParam == NACK_BAD_FINGER) {
 						state = CAPTURE;
+						evt.errCode = mRespParam;
+						notifyEnroll(obs, ctx, evt, ENROLL_NACK);
 					} else {
 						success = false;
 						done = true;
@@ -262,42 +803,34 @@ bool FingerprintModule::enrollSequence(uint32_t id, writeFunc out) {
 			case COMPLETE:
 				// Blink 4 times to indicqte success; don't really care if this succeeded or not
 				powerCMOS(false);
-				delay(125);
+				pause(125);
 				powerCMOS(true);
-				delay(125);
+				pause(125);
 				powerCMOS(false);
-				delay(125);
+				pause(125);
 				powerCMOS(true);
-				delay(125);
+				pause(125);
 				powerCMOS(false);
-				delay(125);
+				pause(125);
 				powerCMOS(true);
-				delay(125);
+				pause(125);
 				powerCMOS(false);
-				delay(125);
+				pause(125);
 				powerCMOS(true);
-				delay(125);
+				pause(125);
 				powerCMOS(false);
 				done = true;
 				break;
 
 			// Used to ensure the user has removed his finger before another capture
 			case REMOVE_FINGER:
-				// Give user instruction to remove finger
-				if (usingStream) {
-					out("Remove finger");
-				}
-
 				// Error out if could not turn off CMOS
 				if (!powerCMOS(false)) {
 					success = false;
 					done = true;
 				} else {
-					// Wait 2 seconds for user to remove finger before checking
-					delay(2000);
-
-					// LED must be turned on to check if finger is pressed
-					if (!powerCMOS(true)) {
+					// Wait 2 seconds for user to remove finger before checking, LED must be turned on to check if finger is pressed
+					if (!pause(2000) || !powerCMOS(true)) {
 						success = false;
 						done = true;
 					} else {
@@ -319,17 +852,19 @@ bool FingerprintModule::enrollSequence(uint32_t id, writeFunc out) {
 				done = true;
 				break;
 		}
-	}
 
-	// Indicate success or failure if output stream used
-	if (usingStream) {
-		if (success) {
-			out("Success!");
-		} else {
-			out("Failed to enroll");
+		// Report the error which ended the sequence
+		if (done && !success) {
+			evt.errCode = mRespParam;
+			notifyEnroll(obs, ctx, evt, ENROLL_NACK);
 		}
 	}
 
+	// Indicate success or failure along with the total duration
+	evt.success = success;
+	evt.stateDuration = mClock->millis() - began;
+	notifyEnroll(obs, ctx, evt, ENROLL_END);
+
 	return success;
 }
 
@@ -337,7 +872,9 @@ bool FingerprintModule::enrollSequence(uint32_t id, writeFunc out) {
  * Initializes the fingerprint module. Should only be called on creation
  * of the fingerprint module. Parameter determines if the library should
  * request additional information from the fingerprint module to perform
- * more thorough error checking. This is recommended.
+ * more thorough error checking. This is recommended. This is the blocking
+ * alternative to begin() and poll(); if begin() was never called, serial
+ * communications are started at 9600 bps first.
  *
  * @param errChk True to perform error checking (default), false otherwise
  *
@@ -346,27 +883,24 @@ bool FingerprintModule::enrollSequence(uint32_t id, writeFunc out) {
 bool FingerprintModule::open(bool errChk) {
 	bool success;	// Indicates whether or not the open successfully completed
 
+	// Start serial communications at the power-on rate if begin() was never called
+	if (!mCommsBegun) {
+		beginComms(9600);
+	}
+
 	// Send the open command, wait a bit for the response, and retrieve response packet
 	send(CMD_OPEN, errChk);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
-	}
+	waitResponse();
 
 	// If further error checking was requested, check the data packet for a non-zero serial ID
 	if (errChk && mRespStatus) {
-		uint8_t i;	// Loop counter
-
-		success = recvDataPkt(24);
-
-		if (success) {
-			// Iterate through the serial ID as long as all of its bytes are 0
-			for (i = 8; i < 24 && (mDataPkt[i] == 0x00); ++i);
-			success &= (i != 24);
-		}
+		success = recvDataPkt(DEVICE_INFO_SIZE) && storeDeviceInfo();
 	} else {
 		success = mRespStatus;
 	}
 
+	mOpenState = success ? OPEN_READY : OPEN_FAILED;
+
 	#ifdef DEBUG
 		if (!mRespStatus) {
 			Serial.print(F("Open operation failed: "));
@@ -380,100 +914,265 @@ bool FingerprintModule::open(bool errChk) {
 }
 
 /**
- * Sends the close command. Does not do anything to the fingerprint module but
- * does receive an ACK.
+ * Re-establishes communications with a sensor which was already set up
+ * before, e.g. after the microcontroller reboots while the sensor stays
+ * powered. The sensor keeps whatever baudrate it was last switched to, so
+ * rather than starting at 9600 and renegotiating, the last known baudrate is
+ * tried first and the sensor's identity is checked against the last known
+ * serial number with a single open() round trip. Only if the sensor doesn't
+ * answer at that rate are the other supported rates tried one by one.
+ * Persist getBaudrate() and getSerialNumber() after a successful open to
+ * supply the arguments on the next boot.
  *
- * @return True if succeeds, false otherwise
+ * If a sensor answers but its serial number differs, this returns false with
+ * error code NACK_SERIAL_MISMATCH; the new sensor is nonetheless open and
+ * usable at getBaudrate(). If no sensor answers at any rate, the module is
+ * marked detached so later commands fail at once (see reattach()).
+ *
+ * If the search is cancelled, runs out of time or finds the sensor unplugged,
+ * it stops there and the baudrate and detached state are put back as they
+ * were, so whatever runs next doesn't talk to the sensor at a rate it isn't at.
+ *
+ * @param baud The last known baudrate of the sensor
+ * @param serial The last known serial number of the sensor (SERIAL_NUM_SIZE bytes)
+ *
+ * @return True if the expected sensor is open and ready, false otherwise
  */
-bool FingerprintModule::close() {
-	// Send the close command, wait a bit for the response, and retrieve response packet
-	send(CMD_CLOSE);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
+bool FingerprintModule::reconnect(uint32_t baud, const byte serial[]) {
+	static const uint32_t rates[] = { 9600, 19200, 38400, 57600, 115200 };	// Baudrates supported by the sensor
+	bool found;																// Whether a sensor answered
+	bool wasDetached = mDetached;											// Detached state to put back if the search is cut short
+	uint32_t prevBaud = mBaudrate;											// Baudrate to put back if the search is cut short
+
+	// Whatever marked the sensor as gone, look for it again unless it is known to be unplugged
+	mDetached = (mPresence != 0x00 && !mPresence(mPresenceCtx));
+	mSilent = 0;
+
+	// Fast path: the sensor is most likely still at the rate it was left at
+	if (!mCommsBegun || baud != mBaudrate) {
+		switchComms(baud);
+	}
+	found = open(true);
+
+	// Slow path: find the rate the sensor is at by trying each of them
+	for (uint8_t i = 0; i < sizeof(rates) / sizeof(rates[0]) && !found && !isAborted(); ++i) {
+		if (rates[i] != baud) {
+			switchComms(rates[i]);
+			mSilent = 0;
+			found = open(true);
+			++mRetries;
+		}
 	}
 
-	#ifdef DEBUG
-		if (!mRespStatus) {
-			Serial.print(F("Close operation failed: "));
-			Serial.println(strFromError(mRespParam));
-		} else {
-			Serial.println(F("Close operation succeeded"));
+	// Cut short: go back to where the search started rather than leave the port at the last rate tried
+	if (!found && isAborted()) {
+		if (mBaudrate != prevBaud) {
+			switchComms(prevBaud);
 		}
-	#endif
+		mDetached = mDetached || wasDetached;
+	}
 
-	return mRespStatus;
-}
+	// Nothing answers at any rate, so stop waiting on the sensor until it is back
+	if (!found && mRespParam == NACK_NOT_RECVD && DETACH_SILENCE > 0) {
+		detach();
+	}
 
-/**
- * Turns the CMOS LED on or off. Parameter is true for on, false
- * for off. Returns true on success.
- *
- * @param on True if CMOS LED should be turned, false for off
- *
- * @return True if the operation succeeded, false otherwise
- */
-bool FingerprintModule::powerCMOS(bool on) {
-	// Send the close command, wait a bit for the response, and retrieve response packet
-	send(CMD_CMOS_LED, on);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
+	if (found && memcmp(mDevInfo.serialNumber, serial, SERIAL_NUM_SIZE) != 0) {
+		mRespStatus = false;
+		mRespParam = NACK_SERIAL_MISMATCH;
+		found = false;
 	}
 
 	#ifdef DEBUG
-		if (!mRespStatus) {
-			Serial.print(F("CMOS operation failed: "));
+		if (!found) {
+			Serial.print(F("Reconnect operation failed: "));
 			Serial.println(strFromError(mRespParam));
 		} else {
-			Serial.println(F("CMOS operation succeeded"));
+			Serial.print(F("Reconnected to the sensor at "));
+			Serial.print(mBaudrate);
+			Serial.println(F(" bps"));
 		}
 	#endif
 
-	return mRespStatus;
+	return found;
 }
 
 /**
- * Changes the serial speed at which communications are done. Module
- * is initialized to 9600 bps on initial power-on.
- * NOTE: Could not successfully test this function, broken for now.
- *
- * @param baud The baudrate to switch to
+ * Sets a function telling whether the sensor is plugged in, e.g. reading a
+ * card-detect style pin on the connector or checking a USB serial adapter is
+ * still enumerated. It is called while waiting on the sensor, so a command in
+ * flight when the sensor is unplugged fails within ABORT_POLL_TIME with
+ * NACK_DETACHED instead of running into its timeout. Without one, the sensor
+ * is only taken as detached once DETACH_SILENCE commands in a row got no
+ * byte back.
  *
- * @return True if the operation succeeded, false otherwise
+ * @param check The function, or null to stop checking
+ * @param ctx A pointer handed untouched to the function (optional)
  */
-bool FingerprintModule::changeBaudrate(uint32_t baud) {
-	// Send the close command, wait a bit for the response, and retrieve response packet
-	send(CMD_CHANGE_BAUDRATE, baud);
-	COMMS.flush();
-	COMMS.end();
-	COMMS.begin(baud);
-	while(!COMMS);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
-	}
-
-	#ifdef DEBUG
-		if (!mRespStatus) {
-			Serial.print(F("Baudrate change operation failed: "));
-			Serial.println(strFromError(mRespParam));
-		} else {
-			Serial.println(F("Baudrate change operation succeeded"));
-		}
-	#endif
-
-	return mRespStatus;
+void FingerprintModule::setPresenceCheck(presenceCheck check, void* ctx) {
+	mPresence = check;
+	mPresenceCtx = ctx;
 }
 
 /**
- * Gets the number of enrolled fingerprints stored in the module.
+ * Checks whether the sensor is attached. Once it is found detached, every
+ * command fails at once with NACK_DETACHED until reattach() or reconnect()
+ * finds it again.
  *
- * @return True if the operation succeeds, false otherwise
+ * @return True if the sensor is taken as attached, false otherwise
+ */
+bool FingerprintModule::isAttached() {
+	return !mDetached && (mPresence == 0x00 || mPresence(mPresenceCtx));
+}
+
+/**
+ * Brings a detached sensor back once it is plugged in again, with the
+ * baudrate and serial number it had, so the application carries on as
+ * before. A sensor which lost power starts again at 9600 bps, which
+ * reconnect() tries right after the last known rate; the sensor is then
+ * switched back to the last known rate. Returns at once if the presence
+ * check says the sensor is still unplugged, so it is cheap to call often.
+ *
+ * @return True if the same sensor is back at the same baudrate, false otherwise
+ */
+bool FingerprintModule::reattach() {
+	byte serial[SERIAL_NUM_SIZE];	// The serial number of the sensor before it went away
+	uint32_t baud = mBaudrate;		// The baudrate the sensor was used at
+	bool success;					// Whether the sensor came back
+
+	if (mPresence != 0x00 && !mPresence(mPresenceCtx)) {
+		mRespStatus = false;
+		mRespParam = NACK_DETACHED;
+		return false;
+	}
+
+	memcpy(serial, mDevInfo.serialNumber, SERIAL_NUM_SIZE);
+	success = reconnect(baud, serial);
+
+	if (success && mBaudrate != baud) {
+		success = changeBaudrate(baud);
+	}
+
+	return success;
+}
+
+/**
+ * Retrieves the baudrate currently used to talk to the sensor.
+ *
+ * @return The baudrate in bits per second
+ */
+uint32_t FingerprintModule::getBaudrate() {
+	return mBaudrate;
+}
+
+/**
+ * Retrieves the sensor's serial number, as read by the last successful
+ * open() with error checking. All zeroes if no such open happened yet.
+ *
+ * @return A pointer to the SERIAL_NUM_SIZE bytes of the serial number
+ */
+const byte* FingerprintModule::getSerialNumber() {
+	return mDevInfo.serialNumber;
+}
+
+/**
+ * Retrieves the device information (firmware version, maximum ISO template
+ * area size and serial number) sent by the sensor in reply to the last open()
+ * with error checking, or to the open sequence run by poll(). All zeroes if
+ * no such open happened yet.
+ *
+ * @return The cached device information
+ */
+const DeviceInfo& FingerprintModule::getDeviceInfo() {
+	return mDevInfo;
+}
+
+/**
+ * Sends the close command. Does not do anything to the fingerprint module but
+ * does receive an ACK.
+ *
+ * @return True if succeeds, false otherwise
+ */
+bool FingerprintModule::close() {
+	// Send the close command, wait a bit for the response, and retrieve response packet
+	send(CMD_CLOSE);
+	waitResponse();
+
+	#ifdef DEBUG
+		if (!mRespStatus) {
+			Serial.print(F("Close operation failed: "));
+			Serial.println(strFromError(mRespParam));
+		} else {
+			Serial.println(F("Close operation succeeded"));
+		}
+	#endif
+
+	return mRespStatus;
+}
+
+/**
+ * Turns the CMOS LED on or off. Parameter is true for on, false
+ * for off. Returns true on success.
+ *
+ * @param on True if CMOS LED should be turned, false for off
+ *
+ * @return True if the operation succeeded, false otherwise
+ */
+bool FingerprintModule::powerCMOS(bool on) {
+	// Send the close command, wait a bit for the response, and retrieve response packet
+	send(CMD_CMOS_LED, on);
+	waitResponse();
+
+	#ifdef DEBUG
+		if (!mRespStatus) {
+			Serial.print(F("CMOS operation failed: "));
+			Serial.println(strFromError(mRespParam));
+		} else {
+			Serial.println(F("CMOS operation succeeded"));
+		}
+	#endif
+
+	return mRespStatus;
+}
+
+/**
+ * Changes the serial speed at which communications are done. Module
+ * is initialized to 9600 bps on initial power-on.
+ * NOTE: Could not successfully test this function, broken for now.
+ *
+ * @param baud The baudrate to switch to
+ *
+ * @return True if the operation succeeded, false otherwise
+ */
+bool FingerprintModule::changeBaudrate(uint32_t baud) {
+	// Send the close command, wait a bit for the response, and retrieve response packet
+	send(CMD_CHANGE_BAUDRATE, baud);
+	mComms->flush();
+	COMMS.end();
+	beginComms(baud);
+	waitResponse();
+
+	#ifdef DEBUG
+		if (!mRespStatus) {
+			Serial.print(F("Baudrate change operation failed: "));
+			Serial.println(strFromError(mRespParam));
+		} else {
+			Serial.println(F("Baudrate change operation succeeded"));
+		}
+	#endif
+
+	return mRespStatus;
+}
+
+/**
+ * Gets the number of enrolled fingerprints stored in the module.
+ *
+ * @return True if the operation succeeds, false otherwise
  */
 bool FingerprintModule::getEnrollCount() {
 	// Send the get command, wait a bit for the response, and retrieve response packet
 	send(CMD_GET_ENROLL_COUNT);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
-	}
+	waitResponse();
 
 	#ifdef DEBUG
 		if (!mRespStatus) {
@@ -501,9 +1200,7 @@ bool FingerprintModule::getEnrollCount() {
 bool FingerprintModule::isIDEnrolled(uint32_t id) {
 	// Send the command, wait a bit for the response, then retrieve the response
 	send(CMD_CHECK_ENROLLED, id);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
-	}
+	waitResponse();
 
 	#ifdef DEBUG
 		if (!mRespStatus) {
@@ -536,9 +1233,7 @@ bool FingerprintModule::isIDEnrolled(uint32_t id) {
 bool FingerprintModule::startEnrollment(uint32_t id) {
 	// Send the command and retrieve response after allowing for a delay
 	send(CMD_ENROLL_START, id);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
-	}
+	waitResponse();
 
 	// Reset the enrollment stage
 	if (mRespStatus) {
@@ -585,9 +1280,7 @@ bool FingerprintModule::createEnrollmentTemplate() {
 		default:
 			return false;
 	}
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
-	}
+	waitResponse();
 
 	if (mRespStatus) {
 		++mEnrollmentStage;
@@ -617,9 +1310,7 @@ bool FingerprintModule::createEnrollmentTemplate() {
  */
 bool FingerprintModule::isFingerPressed() {
 	send(CMD_IS_PRESS_FINGER);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
-	}
+	waitResponse();
 
 	if (mRespStatus && mRespParam != 0) {
 		mRespParam = NACK_FINGER_IS_NOT_PRESSED;
@@ -651,9 +1342,7 @@ bool FingerprintModule::isFingerPressed() {
 bool FingerprintModule::captureFingerprint(bool highQual) {
 	// Send the command, wait for a bit, and then receive the response
 	send(CMD_CAPTURE_FINGER, highQual);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
-	}
+	waitResponse();
 
 	#ifdef DEBUG
 		if (!mRespStatus) {
@@ -680,9 +1369,7 @@ bool FingerprintModule::captureFingerprint(bool highQual) {
  */
 bool FingerprintModule::deleteID(uint32_t id) {
 	send(CMD_DELETE_ID, id);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
-	}
+	waitResponse();
 
 	#ifdef DEBUG
 		if (!mRespStatus) {
@@ -708,9 +1395,7 @@ bool FingerprintModule::deleteID(uint32_t id) {
  */
 bool FingerprintModule::deleteAll() {
 	send(CMD_DELETE_ALL);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
-	}
+	waitResponse();
 
 	#ifdef DEBUG
 		if (!mRespStatus) {
@@ -735,9 +1420,7 @@ bool FingerprintModule::deleteAll() {
  */
 bool FingerprintModule::verify(uint32_t id) {
 	send(CMD_VERIFY, id);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
-	}
+	waitResponse();
 
 	#ifdef DEBUG
 		if (!mRespStatus) {
@@ -754,6 +1437,61 @@ bool FingerprintModule::verify(uint32_t id) {
 	return mRespStatus;
 }
 
+/**
+ * Performs a series of 1:1 verifications of the captured fingerprint against
+ * each of the given candidate IDs, stopping at the first match. Only one
+ * captureFingerprint() call is needed beforehand; every verification reuses
+ * that capture. Candidates which are not enrolled or out of range are skipped,
+ * while any other error (e.g. a comms error) ends the search immediately.
+ * On success, getResponseParam() returns the ID which matched. In both cases,
+ * getOperationTime() returns the time taken by the whole search.
+ *
+ * @param ids An array of candidate IDs to verify against, in order of preference
+ * @param count The number of IDs in the array
+ *
+ * @return True if the captured fingerprint matches one of the IDs, false otherwise
+ */
+bool FingerprintModule::verifyAny(const uint32_t ids[], uint8_t count) {
+	unsigned long start = mClock->millis();	// Time at which the search began
+	bool matched = false;					// Indicates whether one of the candidates matched
+	bool done = false;						// Indicates the search should stop early
+
+	for (uint8_t i = 0; i < count && !done; ++i) {
+		if (verify(ids[i])) {
+			matched = true;
+			done = true;
+			mRespParam = ids[i];
+		} else if (mRespParam != NACK_VERIFY_FAILED && mRespParam != NACK_IS_NOT_USED && mRespParam != NACK_INVALID_POS) {
+			done = true;
+		}
+	}
+
+	// If every candidate was tried without a match, report a failed verification
+	if (!done) {
+		mRespStatus = false;
+		mRespParam = NACK_VERIFY_FAILED;
+	}
+
+	mOpTime = mClock->millis() - start;
+
+	#ifdef DEBUG
+		if (!matched) {
+			Serial.print(F("Failed to verify the captured fingerprint against "));
+			Serial.print(count);
+			Serial.print(F(" candidate IDs: "));
+			Serial.println(strFromError(mRespParam));
+		} else {
+			Serial.print(F("The captured fingerprint matches candidate ID #"));
+			Serial.println(mRespParam);
+		}
+		Serial.print(F("Candidate search took "));
+		Serial.print(mOpTime);
+		Serial.println(F(" ms"));
+	#endif
+
+	return matched;
+}
+
 /**
  * Performs a 1:N identification of the captured fingerprint. If successful, this function
  * will take a captured fingerprint and will store the ID of the template it matches
@@ -764,9 +1502,7 @@ bool FingerprintModule::verify(uint32_t id) {
  */
 bool FingerprintModule::identify() {
 	send(CMD_IDENTIFY);
-	for (int i = 0; i < TIMEOUT && !recvResponsePkt(); ++i) {
-		delay(WAITTIME);
-	}
+	waitResponse();
 
 	#ifdef DEBUG
 		if (!mRespStatus) {
@@ -797,10 +1533,232 @@ bool FingerprintModule::verifyTemplate(uint32_t id, byte templ[]) {
 	return success;
 }
 
+/**
+ * Retrieves the template enrolled with the given ID from the module. On
+ * success, getData() points to the TEMPLATE_SIZE bytes of the template.
+ *
+ * @param id The ID of the template to retrieve
+ *
+ * @return True if the template was received, false otherwise (check error code)
+ */
+bool FingerprintModule::getTemplate(uint32_t id) {
+	// Don't have the sensor send what can't be kept
+	if (fitsBuffer(TEMPLATE_SIZE)) {
+		send(CMD_GET_TEMPLATE, id);
+
+		if (waitResponse() && mRespStatus) {
+			recvDataPkt(TEMPLATE_SIZE);
+		}
+	}
+
+	#ifdef DEBUG
+		if (!mRespStatus) {
+			Serial.print(F("Attempted to retrieve template with ID #"));
+			Serial.print(id);
+			Serial.print(F(": "));
+			Serial.println(strFromError(mRespParam));
+		} else {
+			Serial.print(F("Successfully retrieved template with ID #"));
+			Serial.println(id);
+		}
+	#endif
+
+	return mRespStatus;
+}
+
+/**
+ * Uploads a template to the module and stores it under the given ID,
+ * replacing whatever was enrolled there. The template can be one retrieved
+ * with getTemplate(), including from another module, and may point into
+ * getData().
+ *
+ * @param id The ID to store the template under
+ * @param templ The TEMPLATE_SIZE bytes of the template
+ *
+ * @return True if the template was stored, false otherwise (check error code)
+ */
+bool FingerprintModule::setTemplate(uint32_t id, const byte templ[]) {
+	// The data packet is built in the buffer, so it must fit before anything is sent
+	if (fitsBuffer(TEMPLATE_SIZE)) {
+		send(CMD_SET_TEMPLATE, id);
+
+		// The module acknowledges the ID, then takes the template and answers again; both make one command
+		if (waitResponse(false) && mRespStatus) {
+			if (sendDataPkt(templ, TEMPLATE_SIZE)) {
+				waitResponse(false);
+			} else if (mRespStatus) {
+				// A failed write rather than a cancellation, whose error code stays
+				mRespStatus = false;
+				mRespParam = NACK_COMM_ERR;
+			}
+		}
+
+		reportCommand();
+	}
+
+	#ifdef DEBUG
+		if (!mRespStatus) {
+			Serial.print(F("Attempted to store a template with ID #"));
+			Serial.print(id);
+			Serial.print(F(": "));
+			Serial.println(strFromError(mRespParam));
+		} else {
+			Serial.print(F("Successfully stored a template with ID #"));
+			Serial.println(id);
+		}
+	#endif
+
+	return mRespStatus;
+}
+
+/**
+ * Retrieves the 240x216 image taken by the last captureFingerprint() call.
+ * On success, getData() points to the IMAGE_SIZE bytes of the image, one
+ * byte per pixel. At 9600 bps the transfer takes close to a minute, so
+ * switch to a higher baudrate first. Fails with NACK_BUFFER_TOO_SMALL if
+ * DATA_BUFFER_SIZE was lowered, in which case use getImage(Print&).
+ *
+ * @return True if the image was received, false otherwise (check error code)
+ */
+bool FingerprintModule::getImage() {
+	// Don't have the sensor send what can't be kept
+	if (fitsBuffer(IMAGE_SIZE)) {
+		send(CMD_GET_IMAGE);
+
+		if (waitResponse() && mRespStatus) {
+			recvDataPkt(IMAGE_SIZE);
+		}
+	}
+
+	#ifdef DEBUG
+		if (!mRespStatus) {
+			Serial.print(F("Attempted to retrieve the fingerprint image: "));
+			Serial.println(strFromError(mRespParam));
+		} else {
+			Serial.println(F("Successfully retrieved the fingerprint image"));
+		}
+	#endif
+
+	return mRespStatus;
+}
+
+/**
+ * Retrieves the 240x216 image taken by the last captureFingerprint() call
+ * and writes it to the given output as it arrives, one byte per pixel,
+ * instead of keeping it in the data packet buffer. Put a
+ * FingerprintEncoder in front of a file or network client to compress
+ * the image on the way, with no image-sized buffer anywhere. The output
+ * must keep up with the serial line, and has been given the whole image
+ * before a bad checksum is found, so discard what it got on failure.
+ *
+ * @param out Where to write the image
+ *
+ * @return True if the image was received, false otherwise (check error code)
+ */
+bool FingerprintModule::getImage(Print& out) {
+	send(CMD_GET_IMAGE);
+
+	if (waitResponse() && mRespStatus) {
+		recvDataPkt(IMAGE_SIZE, &out);
+	}
+
+	#ifdef DEBUG
+		if (!mRespStatus) {
+			Serial.print(F("Attempted to stream the fingerprint image: "));
+			Serial.println(strFromError(mRespParam));
+		} else {
+			Serial.println(F("Successfully streamed the fingerprint image"));
+		}
+	#endif
+
+	return mRespStatus;
+}
+
+/**
+ * Retrieves the payload of the last data packet received, e.g. the
+ * template or image fetched by getTemplate() or getImage(). The buffer is
+ * overwritten by the next data packet.
+ *
+ * @return A pointer to the payload
+ */
+const byte* FingerprintModule::getData() {
+	return &mDataPkt[4];
+}
+
 // END PUBLIC
 
 // BEGIN PRIVATE
 
+/**
+ * Starts serial communications at the given baudrate and waits for the
+ * port to be ready.
+ *
+ * @param baud The baudrate to use
+ */
+void FingerprintModule::beginComms(uint32_t baud) {
+	COMMS.begin(baud);
+	while(!COMMS);
+	mBaudrate = baud;
+	mCommsBegun = true;
+	mPortOpen = true;
+}
+
+/**
+ * Moves serial communications to the given baudrate for reconnect(). While
+ * a stream set with setStream() carries the bytes, COMMS isn't involved, so
+ * it is left alone and only the rate is noted.
+ *
+ * @param baud The baudrate to use
+ */
+void FingerprintModule::switchComms(uint32_t baud) {
+	if (mComms == &COMMS) {
+		COMMS.end();
+		beginComms(baud);
+	} else {
+		mBaudrate = baud;
+		mCommsBegun = true;
+	}
+}
+
+/**
+ * Checks whether the last command failed because it was cancelled, ran out
+ * of time or found the sensor detached, rather than on the sensor's side.
+ *
+ * @return True if the last command was cut short, false otherwise
+ */
+bool FingerprintModule::isAborted() {
+	return !mRespStatus && (mRespParam == NACK_CANCELLED || mRespParam == NACK_DEADLINE_EXCEEDED || mRespParam == NACK_DETACHED);
+}
+
+/**
+ * Parses the device information data packet received after an open command
+ * and keeps it, so callers can get the firmware version and serial number
+ * without another round trip and a later reconnect() can check it's talking
+ * to the same sensor. The serial number must not be all zeroes.
+ *
+ * @return True if the serial number is valid, false otherwise
+ */
+bool FingerprintModule::storeDeviceInfo() {
+	uint8_t i;	// Loop counter
+
+	// The payload starts after the 2 start codes and 2 device ID bytes, and its fields are little-endian
+	mDevInfo.firmwareVersion = ((dword) mDataPkt[7] << 24) | ((dword) mDataPkt[6] << 16) | ((dword) mDataPkt[5] << 8) | mDataPkt[4];
+	mDevInfo.isoAreaMaxSize = ((dword) mDataPkt[11] << 24) | ((dword) mDataPkt[10] << 16) | ((dword) mDataPkt[9] << 8) | mDataPkt[8];
+	memcpy(mDevInfo.serialNumber, &mDataPkt[12], SERIAL_NUM_SIZE);
+
+	#ifdef DEBUG
+		Serial.print(F("Firmware version: "));
+		Serial.print(mDevInfo.firmwareVersion, HEX);
+		Serial.print(F(", ISO area max size: "));
+		Serial.println(mDevInfo.isoAreaMaxSize);
+	#endif
+
+	// Iterate through the serial ID as long as all of its bytes are 0
+	for (i = 0; i < SERIAL_NUM_SIZE && (mDevInfo.serialNumber[i] == 0x00); ++i);
+
+	return (i != SERIAL_NUM_SIZE);
+}
+
 /**
  * Sends the specified command and parameters to the fingerprint
  * module. An optional third argument can be used to specify whether the
@@ -818,6 +1776,26 @@ bool FingerprintModule::send(word cmd, dword param, bool isBigEndian) {
 	byte paramArr[4];	// Array containing each byte of the parameter
 	byte cmdArr[2];		// Array containing each byte of the command
 	byte chkSumArr[2];	// Array containing each byte of the checksum
+	word origCmd = cmd;	// The command as given, kept for the flight recorder
+	dword origParam = param;
+
+	// Note which command this is before anything can stop it, so an error is never put down to the last one
+	mLastCmd = cmd;
+	mCmdStart = mClock->millis();
+	mSent = false;
+
+	// Don't talk to the sensor at all if the operation has been cancelled or has run out of time
+	if (checkAbort()) {
+		return false;
+	}
+
+	// Let the late response to an abandoned command come and go first, so it isn't taken for ours
+	if (mAborted && !settleInput()) {
+		return false;
+	}
+
+	// The command's latency runs from when it is sent, after any wait above
+	mCmdStart = mClock->millis();
 
 	// Build out each byte of the command packet, starting with the header
 	pkt[0] = CMD_START_CODE_1;
@@ -859,18 +1837,300 @@ bool FingerprintModule::send(word cmd, dword param, bool isBigEndian) {
 	#endif
 
 	// Send the completed packet to the fingerprint reader via the serial interface
-	uint32_t bytesSent = COMMS.write(pkt, 12);
+	uint32_t bytesSent = mComms->write(pkt, 12);
+	mBytesOut += bytesSent;
+	mSent = true;
+
+	logFlight(FLIGHT_CMD, origCmd, origParam, bytesSent == 12);
 
 	// Return true if all 12 bytes were sent
 	return (bytesSent == 12);
 }
 
+/**
+ * Sends a data packet to the fingerprint module, built in the data packet
+ * buffer. The data may already be in that buffer, e.g. from getData().
+ *
+ * @param data The data to send
+ * @param size The size of the data, without counting packet metadata
+ *
+ * @return True if the whole packet was sent
+ */
+bool FingerprintModule::sendDataPkt(const byte* data, uint32_t size) {
+	uint32_t totalPktSize = size + DATA_PKT_ADD;	// The total size of the data packet with metadata
+	word chkSum;									// The packet's checksum
+
+	if (checkAbort()) {
+		return false;
+	}
+
+	memmove(&mDataPkt[4], data, size);
+	mDataPkt[0] = DATA_START_CODE_1;
+	mDataPkt[1] = DATA_START_CODE_2;
+	mDataPkt[2] = DEVICE_ID_LSB;
+	mDataPkt[3] = DEVICE_ID_MSB;
+
+	chkSum = computeCheckSum(mDataPkt, totalPktSize - 2);
+	mDataPkt[totalPktSize - 2] = chkSum & 0xFF;
+	mDataPkt[totalPktSize - 1] = chkSum >> 8;
+
+	#ifdef DEBUG
+		Serial.print(F("Sending data packet of "));
+		Serial.print(totalPktSize);
+		Serial.println(F(" bytes"));
+	#endif
+
+	uint32_t bytesSent = mComms->write(mDataPkt, totalPktSize);
+	mBytesOut += bytesSent;
+
+	logFlight(FLIGHT_DATA_SENT, 0, size, bytesSent == totalPktSize);
+
+	return (bytesSent == totalPktSize);
+}
+
+/**
+ * Waits for the response to the command that was just sent, for up to
+ * TIMEOUT * WAITTIME milliseconds. The receive buffer is checked every
+ * ABORT_POLL_TIME milliseconds and the response is read as soon as it has
+ * fully arrived, so that a data packet following it is read before it can
+ * overflow the buffer. Returns early if the operation is cancelled or passes
+ * its deadline, in which case the error code reflects the reason. If send()
+ * gave up before writing the command, there is nothing to wait for: this
+ * returns at once with the error code send() set, and the command is neither
+ * counted as timed out nor reported.
+ *
+ * @param report True to report the command's outcome once the wait ends (default), false if more of it follows
+ *
+ * @return True if a response packet was received, false otherwise
+ */
+bool FingerprintModule::waitResponse(bool report) {
+	unsigned long start = mClock->millis();	// Time at which the wait began
+	bool received = false;					// Indicates a response packet was received
+	bool aborted = false;					// Indicates the wait was cut short by a cancellation or deadline
+	bool expired = false;					// Indicates the wait timed out
+	dword bytesIn = mBytesIn;				// Bytes read before the wait, to tell silence from a bad reply
+
+	// No reply will come to a command which was never sent, so don't wait for one or flush it later
+	if (!mSent) {
+		return false;
+	}
+
+	while (!received && !aborted && !expired) {
+		if (checkAbort()) {
+			aborted = true;
+		} else if (mComms->available() >= RESP_PKT_SIZE && recvResponsePkt()) {
+			received = true;
+		} else if (mClock->millis() - start >= (dword) TIMEOUT * WAITTIME) {
+			// One last look, which also sets the error code if nothing usable came
+			received = recvResponsePkt();
+			expired = !received;
+		} else {
+			mClock->delay(ABORT_POLL_TIME);
+		}
+	}
+
+	if (!received && !aborted) {
+		logFlight(FLIGHT_TIMEOUT, 0, NACK_NOT_RECVD, false);
+		++mTimeouts;
+	}
+
+	// The response may still come, late
+	if (!received) {
+		abandon(false);
+	}
+
+	// A sensor which keeps saying nothing at all is no longer there
+	if (mBytesIn != bytesIn) {
+		mSilent = 0;
+	} else if (expired && DETACH_SILENCE > 0 && ++mSilent >= DETACH_SILENCE) {
+		detach();
+	}
+
+	if (report) {
+		reportCommand();
+	}
+
+	return received;
+}
+
+/**
+ * Counts the outcome of the last command sent for writeMetrics() and hands
+ * it to the command observer, with the time since the command was sent. A
+ * command which send() gave up on before writing it reached nothing and has
+ * no latency, so it is neither counted nor reported.
+ */
+void FingerprintModule::reportCommand() {
+	if (!mSent) {
+		return;
+	}
+
+	countCommand(mLastCmd, mRespStatus, mRespParam, mClock->millis() - mCmdStart);
+
+	// Report the outcome and latency of the command to whoever is monitoring the sensor
+	if (mCmdObserver != 0x00) {
+		mCmdObserver(mLastCmd, mRespStatus, mRespParam, mClock->millis() - mCmdStart, mCmdObserverCtx);
+	}
+}
+
+/**
+ * Delays for the given amount of time, checking every ABORT_POLL_TIME
+ * milliseconds whether the operation has been cancelled or has passed
+ * its deadline.
+ *
+ * @param ms The time to wait in milliseconds
+ *
+ * @return True if the full time elapsed, false if the wait was aborted
+ */
+bool FingerprintModule::pause(dword ms) {
+	unsigned long start = mClock->millis();	// Time at which the wait began
+
+	while (mClock->millis() - start < ms) {
+		if (checkAbort()) {
+			return false;
+		}
+
+		mClock->delay(ABORT_POLL_TIME);
+	}
+
+	return !checkAbort();
+}
+
+/**
+ * Checks whether the sensor is detached, the cancellation token has been
+ * raised or the deadline has passed. If so, the response status and error
+ * code are updated accordingly.
+ *
+ * @return True if the operation should be aborted, false otherwise
+ */
+bool FingerprintModule::checkAbort() {
+	if (checkDetached()) {
+		mRespParam = NACK_DETACHED;
+	} else if (mCancelToken != 0x00 && *mCancelToken) {
+		mRespParam = NACK_CANCELLED;
+	} else if (mDeadlineSet && (long)(mClock->millis() - mDeadline) >= 0) {
+		mRespParam = NACK_DEADLINE_EXCEEDED;
+	} else {
+		return false;
+	}
+
+	mRespStatus = false;
+
+	return true;
+}
+
+/**
+ * Checks whether the sensor is detached, asking the presence check if one
+ * is set.
+ *
+ * @return True if the sensor is detached, false otherwise
+ */
+bool FingerprintModule::checkDetached() {
+	if (!mDetached && mPresence != 0x00 && !mPresence(mPresenceCtx)) {
+		detach();
+	}
+
+	return mDetached;
+}
+
+/**
+ * Notes that the command just sent was given up on before all of its reply
+ * was read, so the next command first waits for the rest with settleInput().
+ *
+ * @param responded True if its response packet was read, false if it may still come
+ */
+void FingerprintModule::abandon(bool responded) {
+	mAborted = true;
+	mAbortedStart = mCmdStart;
+	mAbortedDue = mBytesIn + (responded ? 0 : RESP_PKT_SIZE);
+}
+
+/**
+ * Gets back in step after a command was abandoned: waits until its response
+ * has come, or is overdue, and the line has then been quiet for SETTLE_TIME
+ * milliseconds, so any data packet after the response has come too, then
+ * throws everything received away. Flushing straight away would leave a
+ * response still on its way to be read as the reply to the next command,
+ * and every reply after it one command late.
+ *
+ * @return True once back in step, false if the wait was aborted, in which case the next command carries on with it
+ */
+bool FingerprintModule::settleInput() {
+	unsigned long quiet = mClock->millis();	// Time since which nothing arrived
+	bool discarded = false;					// Whether anything was thrown away
+
+	while (true) {
+		if (mComms->available()) {
+			while (mComms->available()) {
+				readComms();
+				++mResyncBytes;
+			}
+
+			discarded = true;
+			quiet = mClock->millis();
+		}
+
+		// The response to the abandoned command came, or never will, and nothing followed it
+		if (((int32_t) (mBytesIn - mAbortedDue) >= 0 || mClock->millis() - mAbortedStart >= (dword) TIMEOUT * WAITTIME)
+				&& mClock->millis() - quiet >= SETTLE_TIME) {
+			break;
+		}
+
+		if (checkAbort()) {
+			mResyncs += discarded;
+			return false;
+		}
+
+		mClock->delay(ABORT_POLL_TIME);
+	}
+
+	mResyncs += discarded;
+	mAborted = false;
+
+	return true;
+}
+
+/**
+ * Checks whether a data packet with the given payload fits in the data
+ * packet buffer, setting the error code if it doesn't.
+ *
+ * @param size The size of the payload
+ *
+ * @return True if it fits, false otherwise
+ */
+bool FingerprintModule::fitsBuffer(uint32_t size) {
+	if (size + DATA_PKT_ADD <= DATA_BUFFER_SIZE) {
+		return true;
+	}
+
+	mRespStatus = false;
+	mRespParam = NACK_BUFFER_TOO_SMALL;
+
+	return false;
+}
+
+/**
+ * Marks the sensor as detached, so every command fails at once until it is
+ * attached again.
+ */
+void FingerprintModule::detach() {
+	mDetached = true;
+	mAborted = false;	// A sensor which is gone won't answer what was abandoned
+	mSilent = 0;
+	++mDetaches;
+
+	#ifdef DEBUG
+		Serial.println(F("The sensor is detached"));
+	#endif
+}
+
 /**
  * Attempts to receive a response packet from the fingerprint module
  * and places it in the response packet buffer. If there is previous
  * unreceived data in the serial buffer, this data is thrown out until
- * a response packet is found and retrieved. If a complete 12-byte
- * response packet is received, returns true; otherwise, returns false
+ * a response packet is found and retrieved. A packet is only read once
+ * all 12 bytes have arrived, so stray bytes ahead of it don't tear it
+ * apart. If a complete 12-byte response packet is received, returns
+ * true; otherwise, returns false
  *
  * @return True if receive was successful
  */
@@ -880,12 +2140,25 @@ bool FingerprintModule::recvResponsePkt() {
 	word givenChkSum = 0x0000;		// Stores the received packet's given checksum
 
 	// Retrieve and store a response packet if possible
-	while (COMMS.available() && !done) {
+	while (!done) {
+		// Throw away anything ahead of the start of a packet
+		if (mComms->available() && mComms->peek() != RES_START_CODE_1) {
+			++mResyncs;
+		}
+		while (mComms->available() && mComms->peek() != RES_START_CODE_1) {
+			readComms();
+			++mResyncBytes;
+		}
+
+		if (mComms->available() < RESP_PKT_SIZE) {
+			break;
+		}
+
 		byte incomingByte;
 
-		incomingByte = COMMS.read();
+		incomingByte = readComms();
 
-		if (incomingByte == 0x55 && COMMS.read() == 0xAA) {
+		if (incomingByte == 0x55 && readComms() == 0xAA) {
 			uint8_t i;			// Loop counter
 
 			// Set the first 2 bytes of the response packet
@@ -893,8 +2166,8 @@ bool FingerprintModule::recvResponsePkt() {
 			buff[1] = 0xAA;
 
 			// Start the loop at the 3rd byte and read the response
-			for (i = 2; i < 12 && COMMS.available(); ++i) {
-				buff[i] = COMMS.read();
+			for (i = 2; i < 12 && mComms->available(); ++i) {
+				buff[i] = readComms();
 			}
 
 			// If we successfully read the remaining 10 response bytes, indicate receive done successfully and grab checksum
@@ -930,6 +2203,15 @@ bool FingerprintModule::recvResponsePkt() {
 		}
 	}
 
+	// Keep a trace of every packet received, dumping the history when the link or the device fails
+	if (done) {
+		logFlight(FLIGHT_RESP, (buff[9] << 8) | buff[8], mRespParam, mRespStatus);
+
+		if (!mRespStatus && (mRespParam == NACK_COMM_ERR || mRespParam == NACK_DEV_ERR) && mFlightOut != 0x00) {
+			dumpFlightRecorder(*mFlightOut);
+		}
+	}
+
 	// Debug prints the received response packet to USB serial
 	#ifdef DEBUG
 		if (!done) {
@@ -951,53 +2233,100 @@ bool FingerprintModule::recvResponsePkt() {
  * Attempts to receive a data packet from the fingerprint module
  * and places it in the data packet buffer. If there is previous
  * unreceived data in the serial buffer, this data is thrown out until
- * a data packet is found and retrieved. If a complete data packet is
- * received, returns true; otherwise, returns false
+ * a data packet is found and retrieved. Since a large packet takes
+ * several seconds to arrive, bytes are read as they come in, waiting
+ * up to BYTE_TIMEOUT milliseconds for each one. If a complete data
+ * packet is received, returns true; otherwise, returns false and sets
+ * the error code to NACK_NOT_RECVD or NACK_BAD_CHKSUM. If a sink is given,
+ * the payload is written to it byte by byte as it arrives instead of being
+ * kept in the buffer, so it must keep up with the serial line; the checksum
+ * is only known once the whole payload has been written. Cancellations and
+ * deadlines are only acted on between packets: a packet is always read to
+ * its end, as the sensor keeps sending it regardless, unless the sensor is
+ * found detached.
  *
  * @param The size of the data being received, without counting packet metadata
+ * @param sink Where to write the payload, or null to keep it in the buffer (default)
  *
  * @return True if receive was successful
  */
-bool FingerprintModule::recvDataPkt(uint32_t size) {
+bool FingerprintModule::recvDataPkt(uint32_t size, Print* sink) {
 	word givenChkSum = 0x0000;			// The received packet's given check sum
+	word chkSum = 0x0000;				// The sum of the bytes received before the check sum
 	uint32_t totalPktSize = size + 6;	// The total size of the data packet with metadata
 	byte done = false;					// Indicates the loop to stop iterating through the serial receive buffer
+	int incomingByte;					// The byte being read, -1 once bytes stop coming
 
-	// Retrieve and store a data packet if possible
-	while (COMMS.available() && !done) {
-		byte incomingByte;
-
-		incomingByte = COMMS.read();
+	// Never write past the buffer, even if a caller forgot to check
+	if (sink == 0x00 && !fitsBuffer(size)) {
+		return false;
+	}
 
-		if (incomingByte == 0x5A && COMMS.read() == 0xA5) {
-			uint8_t i;			// Loop counter
+	// Retrieve and store a data packet if possible
+	while (!done && (incomingByte = readByte()) >= 0) {
+		if (incomingByte != 0x5A) {
+			++mResyncBytes;
+		} else if (readByte() == 0xA5) {
+			uint32_t i;			// Loop counter
 
 			// Set the first 2 bytes of the response packet
 			mDataPkt[0] = 0x5A;
 			mDataPkt[1] = 0xA5;
+			chkSum = 0x5A + 0xA5;
+			givenChkSum = 0x0000;
 
-			// Start the loop at the 3rd byte and read the response
-			for (i = 2; i < totalPktSize && COMMS.available(); ++i) {
-				mDataPkt[i] = COMMS.read();
+			// Start the loop at the 3rd byte and read the response, summing it as it comes
+			for (i = 2; i < totalPktSize && (incomingByte = readByte()) >= 0; ++i) {
+				if (i >= totalPktSize - 2) {
+					givenChkSum |= (word) incomingByte << (8 * (i - (totalPktSize - 2)));
+				} else {
+					chkSum += incomingByte;
+				}
+
+				if (sink == 0x00 || i < 4) {
+					mDataPkt[i] = incomingByte;
+				} else if (i < totalPktSize - 2) {
+					sink->write((uint8_t) incomingByte);
+				}
 			}
 
 			// If we successfully read the remaining bytes, indicate receive done successfully
 			if (i == totalPktSize) {
 				done = true;
-				givenChkSum = (mDataPkt[totalPktSize - 1] << 8) | mDataPkt[totalPktSize - 2];
 			}
 		}
 	}
 
+	// The rest of the packet may still be on its way, unless the sensor is gone
+	if (!done) {
+		mRespStatus = false;
+		mRespParam = mDetached ? NACK_DETACHED : NACK_NOT_RECVD;
+		if (!mDetached) {
+			abandon(true);
+		}
+	}
 	// Check the checksum and indicate failure if incorrect
-	if (done && computeCheckSum(mDataPkt, totalPktSize - 2) != givenChkSum) {
+	else if (chkSum != givenChkSum) {
 		done = false;
+		mRespStatus = false;
+		mRespParam = NACK_BAD_CHKSUM;
+
+		logFlight(FLIGHT_DATA, 0, size, false);
+		if (mFlightOut != 0x00) {
+			dumpFlightRecorder(*mFlightOut);
+		}
+	} else {
+		logFlight(FLIGHT_DATA, 0, size, true);
 	}
 
-	// Debug prints the received response packet to USB serial
+	// Debug prints the received response packet to USB serial, only the size of templates and images
 	#ifdef DEBUG
 		if (!done) {
 			Serial.println(F("Did not receive a complete data packet"));
+		} else if (sink != 0x00 || totalPktSize > DEVICE_INFO_SIZE + DATA_PKT_ADD) {
+			Serial.print(F("Received data packet of "));
+			Serial.print(totalPktSize);
+			Serial.println(F(" bytes"));
 		} else {
 			Serial.print(F("Received data packet: "));
 			for (uint32_t i = 0; i < totalPktSize; ++i) {
@@ -1011,6 +2340,203 @@ bool FingerprintModule::recvDataPkt(uint32_t size) {
 	return done;
 }
 
+/**
+ * Reads the next byte from the sensor, waiting up to BYTE_TIMEOUT
+ * milliseconds for it to arrive. The wait is kept short so the serial
+ * receive buffer doesn't overflow while a large packet streams in. Only a
+ * detached sensor cuts the wait short: a cancellation or deadline in the
+ * middle of a packet would leave the rest of it to be read as the reply to
+ * the next command.
+ *
+ * @return The byte read, or -1 if none arrived in time or the sensor is detached
+ */
+int FingerprintModule::readByte() {
+	unsigned long start = mClock->millis();	// Time at which the wait began
+
+	while (!mComms->available()) {
+		if (mClock->millis() - start >= BYTE_TIMEOUT || checkDetached()) {
+			return -1;
+		}
+
+		mClock->delay(1);
+	}
+
+	return readComms();
+}
+
+/**
+ * Reads a byte from the sensor, counting it for writeMetrics().
+ *
+ * @return The byte read, or -1 if none was available
+ */
+int FingerprintModule::readComms() {
+	int c = mComms->read();
+
+	if (c >= 0) {
+		++mBytesIn;
+	}
+
+	return c;
+}
+
+/**
+ * Throws away everything waiting in the receive buffer, counting it as a
+ * resync if there was anything.
+ */
+void FingerprintModule::discardInput() {
+	if (mComms->available()) {
+		++mResyncs;
+	}
+
+	while (mComms->available()) {
+		readComms();
+		++mResyncBytes;
+	}
+}
+
+/**
+ * Counts a completed command for writeMetrics(): its completion and
+ * failure, its error code and its latency. Commands and error codes past
+ * the number of slots available are not counted individually.
+ *
+ * @param cmd The command code
+ * @param ok Whether the command succeeded
+ * @param param The error code if it failed
+ * @param latency Time from command to outcome in milliseconds
+ */
+void FingerprintModule::countCommand(word cmd, bool ok, dword param, dword latency) {
+	uint8_t i;	// Index of the command's, then the error code's, slot
+
+	for (i = 0; i < mCmdCountLen && mCmdCounts[i].cmd != cmd; ++i);
+	if (i == mCmdCountLen && mCmdCountLen < METRIC_CMD_SLOTS) {
+		mCmdCounts[i].cmd = cmd;
+		mCmdCounts[i].count = 0;
+		mCmdCounts[i].nacks = 0;
+		++mCmdCountLen;
+	}
+	if (i < mCmdCountLen) {
+		++mCmdCounts[i].count;
+		mCmdCounts[i].nacks += !ok;
+	}
+
+	if (!ok) {
+		for (i = 0; i < mErrCountLen && mErrCounts[i].code != param; ++i);
+		if (i == mErrCountLen && mErrCountLen < METRIC_ERR_SLOTS) {
+			mErrCounts[i].code = param;
+			mErrCounts[i].count = 0;
+			++mErrCountLen;
+		}
+		if (i < mErrCountLen) {
+			++mErrCounts[i].count;
+		}
+	}
+
+	for (i = 0; i < METRIC_BUCKETS - 1 && latency > latencyBounds[i]; ++i);
+	++mLatencyHist[i];
+	mLatencySum += latency;
+}
+
+/**
+ * Writes the HELP and TYPE lines which start a metric in the Prometheus
+ * text exposition format.
+ *
+ * @param out Where to write the lines
+ * @param name The name of the metric
+ * @param help The description of the metric
+ * @param type The type of the metric, e.g. counter
+ */
+void FingerprintModule::writeMetricHeader(Print& out, const __FlashStringHelper* name, const __FlashStringHelper* help, const __FlashStringHelper* type) {
+	out.print(F("# HELP "));
+	out.print(name);
+	out.print(F(" "));
+	out.println(help);
+	out.print(F("# TYPE "));
+	out.print(name);
+	out.print(F(" "));
+	out.println(type);
+}
+
+/**
+ * Writes the labels of a sample, if any, followed by the space which
+ * separates them from the value.
+ *
+ * @param out Where to write the labels
+ * @param sensor The value of the sensor label, or null for none
+ * @param label The name of a label holding a code in hexadecimal, or null for none
+ * @param code The code held by that label
+ */
+void FingerprintModule::writeMetricLabels(Print& out, const char* sensor, const __FlashStringHelper* label, word code) {
+	if (sensor != 0x00 || label != 0x00) {
+		out.print(F("{"));
+
+		if (sensor != 0x00) {
+			out.print(F("sensor=\""));
+			out.print(sensor);
+			out.print(F("\""));
+		}
+
+		if (label != 0x00) {
+			if (sensor != 0x00) {
+				out.print(F(","));
+			}
+			out.print(label);
+			out.print(F("=\"0x"));
+			if (code < 0x10) {
+				out.print(F("0"));
+			}
+			out.print(code, HEX);
+			out.print(F("\""));
+		}
+
+		out.print(F("}"));
+	}
+
+	out.print(F(" "));
+}
+
+/**
+ * Adds an entry to the flight recorder, overwriting the oldest one once
+ * the ring is full. Does nothing if the flight recorder is disabled.
+ *
+ * @param kind The kind of packet or event
+ * @param code The command code, or the ACK/NACK code of a response
+ * @param param The command or response parameter, or the size of a data packet
+ * @param ok Whether the packet was sent or received successfully
+ */
+void FingerprintModule::logFlight(FLIGHT_KIND kind, word code, dword param, bool ok) {
+	#if FLIGHT_RECORDER_SIZE > 0
+		FlightEntry& e = mFlight[mFlightNext];
+
+		e.time = mClock->millis();
+		e.kind = kind;
+		e.ok = ok;
+		e.code = code;
+		e.param = param;
+
+		mFlightNext = (mFlightNext + 1) % FLIGHT_RECORDER_SIZE;
+		if (mFlightCount < FLIGHT_RECORDER_SIZE) {
+			++mFlightCount;
+		}
+	#endif
+}
+
+/**
+ * Stamps the given enrollment event with its type and the current time,
+ * then hands it to the observer if one was given.
+ *
+ * @param obs The observer to notify, may be null
+ * @param ctx The observer's context pointer
+ * @param evt The event to send
+ * @param type The type of event being sent
+ */
+void FingerprintModule::notifyEnroll(enrollObserver obs, void* ctx, EnrollEvent& evt, ENROLL_EVENT type) {
+	if (obs != 0x00) {
+		evt.type = type;
+		evt.timestamp = mClock->millis();
+		obs(evt, ctx);
+	}
+}
+
 /**
  * Takes in a byte array and computes its check-sum up to the given size.
  *
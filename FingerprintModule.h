@@ -16,6 +16,18 @@
 // The amount of time to wait between each response retry, in milliseconds
 #define WAITTIME 500
 
+// The interval in milliseconds at which waits check for cancellation and deadlines
+#define ABORT_POLL_TIME 10
+
+// The maximum time in milliseconds to wait for the next byte of a data packet
+#define BYTE_TIMEOUT 100
+
+// The time in milliseconds the line must stay quiet before the leftovers of an abandoned command are thrown away
+#define SETTLE_TIME 100
+
+// The number of commands in a row answered by silence after which the sensor is taken as detached, 0 to never
+#define DETACH_SILENCE 3
+
 // Commonly used bytes for all packets
 #define DEVICE_ID_MSB 0x00
 #define DEVICE_ID_LSB 0x01
@@ -37,9 +49,44 @@
 #define RESP_PKT_SIZE 12
 #define DATA_PKT_MAX_SIZE 51846	// The maximum possible size of a data packet
 #define DATA_PKT_ADD 6			// The size of the non-variable part of the data packet
+#define SERIAL_NUM_SIZE 16		// The size of the sensor's serial number
+#define DEVICE_INFO_SIZE 24		// The size of the device information sent in reply to an open command
+#define TEMPLATE_SIZE 498		// The size of a fingerprint template
+#define IMAGE_SIZE 51840		// The size of a 240x216 fingerprint image
+#define RAW_IMAGE_SIZE 19200	// The size of a 160x120 raw image
+
+// The size of each module's data packet buffer, from DEVICE_INFO_SIZE + DATA_PKT_ADD to DATA_PKT_MAX_SIZE
+// DATA_PKT_MAX_SIZE keeps whole images; TEMPLATE_SIZE + DATA_PKT_ADD saves 51 KB per module but images
+// must then be streamed with getImage(Print&). Like the settings below, it can be given on the command line
+#ifndef DATA_BUFFER_SIZE
+#define DATA_BUFFER_SIZE DATA_PKT_MAX_SIZE
+#endif
 
-// Uncomment if you want debug messages printed to the USB serial monitor
+// The most RAM a FingerprintModule may take in bytes, checked when compiling, 0 for no limit
+#ifndef FINGERPRINT_RAM_BUDGET
+#define FINGERPRINT_RAM_BUDGET 0
+#endif
+
+// The number of recent packet headers kept by the flight recorder, set to 0 to disable it
+#ifndef FLIGHT_RECORDER_SIZE
+#define FLIGHT_RECORDER_SIZE 16
+#endif
+
+// The number of distinct command codes and NACK error codes counted for writeMetrics()
+#ifndef METRIC_CMD_SLOTS
+#define METRIC_CMD_SLOTS 16
+#endif
+#ifndef METRIC_ERR_SLOTS
+#define METRIC_ERR_SLOTS 12
+#endif
+
+// The number of command latency histogram buckets, see their upper bounds in FingerprintModule.cpp
+#define METRIC_BUCKETS 9
+
+// Uncomment if you want debug messages printed to the USB serial monitor, or build with FINGERPRINT_NO_DEBUG
+#ifndef FINGERPRINT_NO_DEBUG
 #define DEBUG
+#endif
 
 /* Enumerations */
 // Command codes
@@ -90,6 +137,11 @@ enum RESPONSE {
 enum RESPONSE_ERROR {
 	NACK_NOT_RECVD = 0x0001,				// No response packet was received
 	NACK_INVALID_ENROLLMENT_STAGE = 0x0002,	// The stage of enrollment is not between 0 and 2
+	NACK_CANCELLED = 0x0003,				// The operation was cancelled through the cancellation token
+	NACK_DEADLINE_EXCEEDED = 0x0004,		// The operation did not complete before the deadline
+	NACK_SERIAL_MISMATCH = 0x0005,			// The sensor's serial number is not the one expected
+	NACK_DETACHED = 0x0006,					// The sensor is unplugged or stopped answering, see reattach()
+	NACK_BUFFER_TOO_SMALL = 0x0007,			// The data packet doesn't fit in DATA_BUFFER_SIZE
 
 	NACK_INVALID_POS = 0x1003,				// Specified ID not between 0-19
 	NACK_IS_NOT_USED = 0x1004,				// Specified ID is not in use
@@ -120,6 +172,34 @@ enum ENROLL_STATE {
 	REMOVE_FINGER
 };
 
+// The kinds of events reported by enrollSequence
+enum ENROLL_EVENT {
+	ENROLL_BEGIN,			// The enrollment sequence has started
+	ENROLL_STATE_CHANGE,	// The state machine moved from prevState to state
+	ENROLL_CAPTURE_ATTEMPT,	// A fingerprint capture was attempted, success holds the outcome
+	ENROLL_NACK,			// A command failed, errCode holds the error
+	ENROLL_END				// The enrollment sequence has ended, success holds the outcome
+};
+
+// The steps of the non-blocking open sequence started by begin()
+enum OPEN_STATE {
+	OPEN_IDLE,				// begin() has not been called
+	OPEN_WAIT_PORT,			// Waiting for the serial port to be ready
+	OPEN_WAIT_RESPONSE,		// Waiting for the response to the open command
+	OPEN_WAIT_DATA,			// Waiting for the device information data packet
+	OPEN_READY,				// The sensor is open and ready
+	OPEN_FAILED				// The open failed, check the error code
+};
+
+// The kinds of entries kept by the flight recorder
+enum FLIGHT_KIND {
+	FLIGHT_CMD,				// A command packet was sent
+	FLIGHT_RESP,			// A response packet was received
+	FLIGHT_DATA,			// A data packet was received
+	FLIGHT_DATA_SENT,		// A data packet was sent
+	FLIGHT_TIMEOUT			// No response arrived in time
+};
+
 /* Type definitions */
 // Check if byte, word, and dword are defined, define them if not
 #ifndef byte
@@ -134,40 +214,192 @@ typedef uint16_t word;
 typedef uint32_t dword;
 #endif
 
-// Used in enrollSequence, defines a type for a lambda function given to write to an output
-typedef void (*writeFunc)(const char* str);
+// The device information sent by the sensor in reply to an open command with error checking
+struct DeviceInfo {
+	dword firmwareVersion;				// Version of the firmware running on the sensor
+	dword isoAreaMaxSize;				// Maximum size of the ISO template area
+	byte serialNumber[SERIAL_NUM_SIZE];	// Unique serial number of the sensor
+};
+
+// One entry of the flight recorder, holding a packet's header but never its payload
+struct FlightEntry {
+	unsigned long time;		// The value of millis() when the packet was sent or received
+	byte kind;				// The kind of entry (FLIGHT_KIND)
+	bool ok;				// Whether the packet was sent or received successfully and, for a response, was an ACK
+	word code;				// The command code, or the ACK/NACK code of a response
+	dword param;			// The command or response parameter, or the payload size of a data packet
+};
+
+// How often a command was sent and refused, kept for writeMetrics()
+struct CommandCount {
+	word cmd;				// The command code
+	dword count;			// Number of times the command completed
+	dword nacks;			// Number of times it failed
+};
+
+// How often an error code was returned, kept for writeMetrics()
+struct ErrorCount {
+	word code;				// The error code (RESPONSE_ERROR)
+	dword count;			// Number of times it was returned
+};
+
+// Describes one step of an enrollment, passed to the observer given to enrollSequence
+struct EnrollEvent {
+	ENROLL_EVENT type;				// The kind of event
+	ENROLL_STATE state;				// The state the enrollment is currently in
+	ENROLL_STATE prevState;			// The state the enrollment was in before the latest transition
+	uint8_t stage;					// The number of enrollment templates completed so far (0 to 3)
+	uint16_t attempt;				// The number of capture attempts made for the current stage
+	dword errCode;					// The latest error code, valid for ENROLL_NACK and failed capture attempts
+	bool success;					// The outcome of a capture attempt or of the whole enrollment
+	unsigned long timestamp;		// The value of millis() when the event was sent
+	unsigned long stateDuration;	// Time in ms spent in prevState, or the total duration for ENROLL_END
+};
+
+// Used in enrollSequence, defines a type for a function receiving enrollment events
+typedef void (*enrollObserver)(const EnrollEvent& evt, void* ctx);
+
+// Called each time a command completes, used to monitor latency and errors
+typedef void (*commandObserver)(word cmd, bool ok, dword param, dword latency, void* ctx);
+
+// Used in setPresenceCheck, tells whether the sensor is plugged in
+typedef bool (*presenceCheck)(void* ctx);
+
+/* Class definitions */
+// The driver's source of time, by default the Arduino's millis(), micros() and delay()
+// Derive from it and hand it to setClock() to run the driver on simulated time
+class FingerprintClock {
+	public:
+		virtual ~FingerprintClock() {}
+
+		virtual unsigned long millis();
+		virtual unsigned long micros();
+		virtual void delay(dword);
+};
 
-/* Class definition */
 class FingerprintModule {
 	private:
 		byte mRespPkt[RESP_PKT_SIZE];		// Buffer to hold the response packet
-		byte mDataPkt[DATA_PKT_MAX_SIZE];	// Buffer to hold data packets
+		byte mDataPkt[DATA_BUFFER_SIZE];	// Buffer to hold data packets
 		bool mRespStatus;					// Holds whether an ACK or NACK was received
 		dword mRespParam;					// Holds the response parameter: either an error code or a response param
 		uint8_t mEnrollmentStage;			// Used during enrollment, keeps track of if this is the first, second, or third fingerprint image
+		dword mOpTime;						// Duration in milliseconds of the last timed operation (e.g. verifyAny)
+		volatile bool* mCancelToken;		// Flag which aborts the current operation when raised, may be null
+		unsigned long mDeadline;			// Time at which the current operations must be complete
+		bool mDeadlineSet;					// True if mDeadline is in effect
+		bool mAborted;						// True if a command was abandoned and a late response may still arrive
+		unsigned long mAbortedStart;		// Time at which the abandoned command was sent
+		dword mAbortedDue;					// Bytes read by the time the abandoned command's response has come
+		uint32_t mBaudrate;					// The baudrate currently used to talk to the sensor
+		DeviceInfo mDevInfo;				// The sensor's device information, as read by open()
+		bool mCommsBegun;					// True once serial communications have been started
+		bool mPortOpen;						// True once this module has started COMMS, so it is ended on destruction
+		OPEN_STATE mOpenState;				// Progress of the open sequence
+		unsigned long mOpenStarted;			// Time at which the non-blocking open command was sent
+		Stream* mComms;						// The stream carrying the bytes to and from the sensor, COMMS by default
+#if FLIGHT_RECORDER_SIZE > 0
+		FlightEntry mFlight[FLIGHT_RECORDER_SIZE];	// Ring of the most recent packet headers
+#endif
+		uint8_t mFlightNext;				// Index of the next flight recorder entry to write
+		uint8_t mFlightCount;				// Number of flight recorder entries in use
+		Print* mFlightOut;					// Where to dump the flight recorder on errors, may be null
+		commandObserver mCmdObserver;		// Called each time a command completes, may be null
+		void* mCmdObserverCtx;				// The context pointer handed to mCmdObserver
+		word mLastCmd;						// The last command sent
+		unsigned long mCmdStart;			// Time at which the last command was sent
+		bool mSent;							// True once the last command was written to the sensor, so a reply may come
+		FingerprintClock* mClock;			// The source of time for timeouts, delays and latencies
+		CommandCount mCmdCounts[METRIC_CMD_SLOTS];	// Completions and failures per command
+		uint8_t mCmdCountLen;				// Number of slots of mCmdCounts in use
+		ErrorCount mErrCounts[METRIC_ERR_SLOTS];	// Occurrences per error code
+		uint8_t mErrCountLen;				// Number of slots of mErrCounts in use
+		dword mLatencyHist[METRIC_BUCKETS];	// Command latency histogram, the last bucket holding everything slower
+		dword mLatencySum;					// Sum of all command latencies in milliseconds
+		dword mBytesIn;						// Bytes read from the sensor
+		dword mBytesOut;					// Bytes sent to the sensor
+		dword mTimeouts;					// Commands which got no response in time
+		dword mRetries;						// Extra open attempts made by reconnect() at other baudrates
+		dword mResyncs;						// Times buffered input was thrown away to get back in step
+		dword mResyncBytes;					// Bytes thrown away to get back in step
+		presenceCheck mPresence;			// Tells whether the sensor is plugged in, may be null
+		void* mPresenceCtx;					// The context pointer handed to mPresence
+		bool mDetached;						// True once the sensor is found gone, until it is attached again
+		uint8_t mSilent;					// Number of commands in a row which got no byte back
+		dword mDetaches;					// Times the sensor was found gone
 
 		word flipEndianness(word);
 		dword flipEndianness(dword);
 		void split(word, byte*);
 		void split(dword, byte*);
+		void beginComms(uint32_t);
+		void switchComms(uint32_t);
+		bool isAborted();
+		bool storeDeviceInfo();
 		word computeCheckSum(byte*, uint32_t);
 		bool send(word, dword param = 0x00000000, bool isBigEndian = true);
-		bool sendDataPkt();
+		bool sendDataPkt(const byte*, uint32_t);
+		bool waitResponse(bool report = true);
+		void reportCommand();
+		bool pause(dword);
+		bool checkAbort();
+		bool checkDetached();
+		void abandon(bool);
+		bool settleInput();
+		void detach();
+		bool fitsBuffer(uint32_t);
 		bool recvResponsePkt();
-		bool recvDataPkt(uint32_t size);
+		bool recvDataPkt(uint32_t size, Print* sink = 0x00);
+		int readByte();
+		void notifyEnroll(enrollObserver, void*, EnrollEvent&, ENROLL_EVENT);
+		void logFlight(FLIGHT_KIND, word, dword, bool);
+		int readComms();
+		void discardInput();
+		void countCommand(word, bool, dword, dword);
+		static void writeMetricHeader(Print&, const __FlashStringHelper*, const __FlashStringHelper*, const __FlashStringHelper*);
+		static void writeMetricLabels(Print&, const char*, const __FlashStringHelper*, word);
 
 	public:
 		FingerprintModule();
 		~FingerprintModule();
 
+		void begin(uint32_t baud = 9600);
+		bool poll();
+		OPEN_STATE getOpenState();
+		void setStream(Stream*);
+		void setClock(FingerprintClock*);
+		FingerprintClock& getClock();
+
 		dword getResponseParam();
 		dword getErrorCode();
 		bool getResponseStatus();
+		dword getOperationTime();
 		String strFromError(word);
 
-		bool enrollSequence(uint32_t, writeFunc out = 0x00);
+		void setCancelToken(volatile bool*);
+		void setDeadline(dword);
+		void clearDeadline();
+
+		void dumpFlightRecorder(Print&);
+		void setFlightRecorderOutput(Print*);
+		void setCommandObserver(commandObserver, void* ctx = 0x00);
+		bool resync();
+		bool settle();
+
+		void writeMetrics(Print&, const char* sensor = 0x00);
+		static void writeMetrics(Print&, FingerprintModule* const[], const char* const[], uint8_t);
+		void clearMetrics();
+
+		bool enrollSequence(uint32_t, enrollObserver obs = 0x00, void* ctx = 0x00);
 
 		bool open(bool errChk = true);
+		bool reconnect(uint32_t, const byte[]);
+		void setPresenceCheck(presenceCheck, void* ctx = 0x00);
+		bool isAttached();
+		bool reattach();
+		uint32_t getBaudrate();
+		const byte* getSerialNumber();
+		const DeviceInfo& getDeviceInfo();
 		bool close();
 		bool powerCMOS(bool);
 		bool changeBaudrate(uint32_t);
@@ -180,9 +412,15 @@ class FingerprintModule {
 		bool deleteID(uint32_t);
 		bool deleteAll();
 		bool verify(uint32_t);
+		bool verifyAny(const uint32_t[], uint8_t);
 		bool identify();
 		bool verifyTemplate(uint32_t, byte[]);
 		bool identifyTemplate(byte[]);
+		bool getTemplate(uint32_t);
+		bool setTemplate(uint32_t, const byte[]);
+		bool getImage();
+		bool getImage(Print&);
+		const byte* getData();
 };
 
 #endif
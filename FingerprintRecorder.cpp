@@ -0,0 +1,492 @@
+/**
+ * Serial traffic recorder and deterministic replay for the fingerprint module.
+ *
+ * Notes:
+ *	-	FingerprintRecorder is a Stream wrapped around the serial interface to the sensor.
+ *		Install it with FingerprintModule::setStream() and all traffic passes through
+ *		unchanged while being written to a sink (e.g. a file on an SD card) as
+ *		timestamped chunks. Sent packets are written as one chunk each; received bytes
+ *		are gathered into chunks of up to REC_CHUNK_SIZE bytes, a chunk ending whenever
+ *		the driver finds the receive buffer empty.
+ *	-	Recording format: the magic bytes 'F' 'P' 'R' and REC_VERSION, then one record per
+ *		chunk made up of a direction byte (REC_DIRECTION), the time elapsed since the
+ *		previous chunk in microseconds as a varint, the length of the chunk as a varint,
+ *		and the bytes themselves. Varints hold 7 bits per byte, least significant first,
+ *		with the top bit set on every byte but the last.
+ *	-	FingerprintReplay stands in for the sensor and plays a recording back to the
+ *		driver. Bytes the driver sends are compared to the recorded transmissions, and
+ *		recorded receptions are handed back either at their original delay after the
+ *		preceding transmission (real-time) or as soon as they are asked for (as fast as
+ *		possible). Mismatches point at the first place the driver's behaviour differs
+ *		from the recorded run, which makes bisecting parser and timing regressions
+ *		deterministic.
+ *	-	Both take their time from a FingerprintClock, the Arduino's micros() by default.
+ *		Give them the module's clock with setClock(&fpm.getClock()) when it runs on a
+ *		FingerprintVirtualClock, e.g. against a FingerprintEmulator, so the recording holds
+ *		the emulator's times and a real-time replay follows them exactly.
+ */
+
+// Includes
+#include "FingerprintRecorder.h"
+
+static_assert(REPLAY_BUFFER_SIZE >= RESP_PKT_SIZE, "REPLAY_BUFFER_SIZE can't hold a response packet");
+
+// The clock used by every recorder and replay until another one is set
+static FingerprintClock defaultClock;
+
+// BEGIN FINGERPRINTRECORDER PUBLIC
+
+/**
+ * Creates a recorder passing traffic through to the given serial interface
+ * and writing the recording to the given sink.
+ *
+ * @param wire The serial interface to the sensor, usually COMMS
+ * @param sink Where the recording is written
+ */
+FingerprintRecorder::FingerprintRecorder(Stream& wire, Print& sink) : mWire(wire), mSink(sink) {
+	mRxLen = 0;
+	mRxTime = 0;
+	mLastTime = 0;
+	mStarted = false;
+	mChunks = 0;
+	mClock = &defaultClock;
+}
+
+/**
+ * Returns the number of bytes waiting on the serial interface. Finding it
+ * empty ends the chunk of received bytes being gathered.
+ *
+ * @return The number of bytes available to read
+ */
+int FingerprintRecorder::available() {
+	int count = mWire.available();
+
+	if (count == 0) {
+		flushRx();
+	}
+
+	return count;
+}
+
+/**
+ * Reads a byte from the serial interface and adds it to the chunk of
+ * received bytes being gathered.
+ *
+ * @return The byte read, or -1 if none was available
+ */
+int FingerprintRecorder::read() {
+	int c = mWire.read();
+
+	if (c >= 0) {
+		if (mRxLen == 0) {
+			mRxTime = mClock->micros();
+		}
+
+		mRxBuf[mRxLen++] = (byte) c;
+
+		if (mRxLen == REC_CHUNK_SIZE) {
+			flushRx();
+		}
+	}
+
+	return c;
+}
+
+/**
+ * Returns the next byte on the serial interface without reading it.
+ *
+ * @return The next byte, or -1 if none was available
+ */
+int FingerprintRecorder::peek() {
+	return mWire.peek();
+}
+
+/**
+ * Sends a single byte to the sensor and records it as its own chunk.
+ *
+ * @param b The byte to send
+ *
+ * @return The number of bytes sent
+ */
+size_t FingerprintRecorder::write(uint8_t b) {
+	return write(&b, 1);
+}
+
+/**
+ * Sends a buffer to the sensor and records it as a single chunk. Any
+ * received bytes still being gathered are recorded first so the order
+ * of the recording matches what the driver saw.
+ *
+ * @param buf The bytes to send
+ * @param size The number of bytes to send
+ *
+ * @return The number of bytes sent
+ */
+size_t FingerprintRecorder::write(const uint8_t* buf, size_t size) {
+	unsigned long now;	// Time at which the bytes were sent
+	size_t sent;		// Number of bytes the serial interface accepted
+
+	flushRx();
+
+	now = mClock->micros();
+	sent = mWire.write(buf, size);
+	writeChunk(REC_TX, now, buf, sent);
+
+	return sent;
+}
+
+/**
+ * Records any received bytes still being gathered, then flushes both the
+ * serial interface and the sink.
+ */
+void FingerprintRecorder::flush() {
+	flushRx();
+	mWire.flush();
+	mSink.flush();
+}
+
+/**
+ * Replaces the source of time for the timestamps of the recording. Give it
+ * the module's clock, &fpm.getClock(), so the recording holds the times the
+ * driver sees, including under a FingerprintVirtualClock.
+ *
+ * @param clock The clock to use, or null to go back to micros()
+ */
+void FingerprintRecorder::setClock(FingerprintClock* clock) {
+	mClock = (clock != 0x00) ? clock : &defaultClock;
+}
+
+/**
+ * Retrieves the number of chunks recorded so far.
+ *
+ * @return The number of chunks
+ */
+dword FingerprintRecorder::getChunkCount() {
+	return mChunks;
+}
+
+// END FINGERPRINTRECORDER PUBLIC
+
+// BEGIN FINGERPRINTRECORDER PRIVATE
+
+/**
+ * Records the received bytes gathered so far as one chunk, if there are any.
+ */
+void FingerprintRecorder::flushRx() {
+	if (mRxLen > 0) {
+		writeChunk(REC_RX, mRxTime, mRxBuf, mRxLen);
+		mRxLen = 0;
+	}
+}
+
+/**
+ * Writes one chunk to the sink, preceded by the magic bytes if this is the
+ * first chunk of the recording.
+ *
+ * @param dir The direction of the chunk
+ * @param time The time at which the chunk was sent or received, in microseconds
+ * @param buf The bytes of the chunk
+ * @param size The number of bytes in the chunk
+ */
+void FingerprintRecorder::writeChunk(REC_DIRECTION dir, unsigned long time, const byte* buf, uint32_t size) {
+	if (!mStarted) {
+		mSink.write((uint8_t) REC_MAGIC_1);
+		mSink.write((uint8_t) REC_MAGIC_2);
+		mSink.write((uint8_t) REC_MAGIC_3);
+		mSink.write((uint8_t) REC_VERSION);
+		mLastTime = time;
+		mStarted = true;
+	}
+
+	mSink.write((uint8_t) dir);
+	writeVarint(time - mLastTime);
+	writeVarint(size);
+	mSink.write(buf, size);
+
+	mLastTime = time;
+	++mChunks;
+}
+
+/**
+ * Writes an unsigned value to the sink as a varint.
+ *
+ * @param value The value to write
+ */
+void FingerprintRecorder::writeVarint(dword value) {
+	while (value >= 0x80) {
+		mSink.write((uint8_t) ((value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+	mSink.write((uint8_t) value);
+}
+
+// END FINGERPRINTRECORDER PRIVATE
+
+// BEGIN FINGERPRINTREPLAY PUBLIC
+
+/**
+ * Creates a replay of the given recording.
+ *
+ * @param recording The recording to play back, positioned at its start
+ * @param realTime True to hand back received bytes at their original timing (default), false for as fast as possible
+ */
+FingerprintReplay::FingerprintReplay(Stream& recording, bool realTime) : mRec(recording) {
+	mRealTime = realTime;
+	mStarted = false;
+	mHaveRecord = false;
+	mEnded = false;
+	mDir = REC_TX;
+	mRemaining = 0;
+	mRecTime = 0;
+	mAnchorRec = 0;
+	mAnchorNow = 0;
+	mMismatches = 0;
+	mSkipped = 0;
+	mRxHead = 0;
+	mRxLen = 0;
+	mClock = &defaultClock;
+}
+
+/**
+ * Returns the number of recorded received bytes which are due to be handed
+ * to the driver, counted across consecutive received chunks up to
+ * REPLAY_BUFFER_SIZE, as a packet may have been recorded in several.
+ *
+ * @return The number of bytes available to read
+ */
+int FingerprintReplay::available() {
+	fillRx();
+
+	return mRxLen;
+}
+
+/**
+ * Hands the driver the next recorded received byte, if it is due.
+ *
+ * @return The byte, or -1 if none is due
+ */
+int FingerprintReplay::read() {
+	int c = -1;
+
+	fillRx();
+	if (mRxLen > 0) {
+		c = mRx[mRxHead];
+		mRxHead = (mRxHead + 1) % REPLAY_BUFFER_SIZE;
+		--mRxLen;
+	}
+
+	return c;
+}
+
+/**
+ * Returns the next recorded received byte without consuming it, if it is due.
+ *
+ * @return The byte, or -1 if none is due
+ */
+int FingerprintReplay::peek() {
+	fillRx();
+
+	return mRxLen > 0 ? mRx[mRxHead] : -1;
+}
+
+/**
+ * Takes a byte sent by the driver and compares it to the recorded
+ * transmission. Recorded received bytes the driver never read before
+ * sending are skipped. The end of a recorded transmission becomes the
+ * reference point for the timing of the following receptions.
+ *
+ * @param b The byte sent by the driver
+ *
+ * @return Always 1
+ */
+size_t FingerprintReplay::write(uint8_t b) {
+	// Skip whatever the driver didn't read, e.g. after an aborted command
+	mSkipped += mRxLen;
+	mRxLen = 0;
+	while ((mHaveRecord || nextRecord()) && mDir == REC_RX) {
+		while (mRemaining > 0) {
+			mRec.read();
+			--mRemaining;
+			++mSkipped;
+		}
+		mHaveRecord = false;
+	}
+
+	if (!mHaveRecord) {
+		++mMismatches;
+	} else {
+		if (mRec.read() != b) {
+			++mMismatches;
+		}
+
+		if (--mRemaining == 0) {
+			mHaveRecord = false;
+			mAnchorRec = mRecTime;
+			mAnchorNow = mClock->micros();
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Nothing to flush, provided to complete the Stream interface.
+ */
+void FingerprintReplay::flush() {
+}
+
+/**
+ * Replaces the source of time used to hand back received bytes at their
+ * recorded timing. Give it the module's clock, &fpm.getClock(), so the delays
+ * of the recording are played out in the time the driver waits in.
+ *
+ * @param clock The clock to use, or null to go back to micros()
+ */
+void FingerprintReplay::setClock(FingerprintClock* clock) {
+	mClock = (clock != 0x00) ? clock : &defaultClock;
+}
+
+/**
+ * Checks whether the whole recording has been played.
+ *
+ * @return True if there is nothing left to play, false otherwise
+ */
+bool FingerprintReplay::isFinished() {
+	return mRxLen == 0 && !mHaveRecord && !nextRecord();
+}
+
+/**
+ * Retrieves the number of bytes sent by the driver which differ from the
+ * recording, including bytes sent past its end.
+ *
+ * @return The number of mismatched bytes
+ */
+dword FingerprintReplay::getMismatchCount() {
+	return mMismatches;
+}
+
+/**
+ * Retrieves the number of recorded received bytes which were skipped
+ * because the driver sent something before reading them.
+ *
+ * @return The number of skipped bytes
+ */
+dword FingerprintReplay::getSkippedCount() {
+	return mSkipped;
+}
+
+// END FINGERPRINTREPLAY PUBLIC
+
+// BEGIN FINGERPRINTREPLAY PRIVATE
+
+/**
+ * Reads the header of the next record, checking the magic bytes first if
+ * nothing was read yet. The start of the recording is the first timing reference.
+ *
+ * @return True if a record was started, false at the end of the recording
+ */
+bool FingerprintReplay::nextRecord() {
+	int dir;		// The direction byte of the record
+	dword delta;	// Recorded time since the previous record
+	dword size;		// Size of the record
+
+	if (mEnded) {
+		return false;
+	}
+
+	if (!mStarted) {
+		mStarted = true;
+
+		if (mRec.read() != REC_MAGIC_1 || mRec.read() != REC_MAGIC_2 || mRec.read() != REC_MAGIC_3 || mRec.read() != REC_VERSION) {
+			mEnded = true;
+			return false;
+		}
+
+		// Play the first record right away
+		mAnchorRec = 0;
+		mAnchorNow = mClock->micros();
+	}
+
+	dir = mRec.read();
+	if (dir < 0 || !readVarint(delta) || !readVarint(size)) {
+		mEnded = true;
+		return false;
+	}
+
+	mDir = (dir == REC_RX) ? REC_RX : REC_TX;
+	mRecTime += delta;
+	mRemaining = size;
+	mHaveRecord = (size > 0);
+
+	return mHaveRecord || nextRecord();
+}
+
+/**
+ * Reads a varint from the recording.
+ *
+ * @param value Filled in with the value read
+ *
+ * @return True if a complete varint was read, false at the end of the recording
+ */
+bool FingerprintReplay::readVarint(dword& value) {
+	int c;				// The byte being read
+	uint8_t shift = 0;	// Position of the bits held by the byte
+
+	value = 0;
+	do {
+		c = mRec.read();
+		if (c < 0 || shift > 28) {
+			return false;
+		}
+
+		value |= (dword) (c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return true;
+}
+
+/**
+ * Checks whether the current record holds received bytes that are due to
+ * be handed to the driver: always in as-fast-as-possible mode, otherwise
+ * once as much time has passed since the driver's last transmission as had
+ * passed in the recording.
+ *
+ * @return True if received bytes can be read, false otherwise
+ */
+bool FingerprintReplay::rxReady() {
+	if (!mHaveRecord && !nextRecord()) {
+		return false;
+	}
+
+	if (mDir != REC_RX) {
+		return false;
+	}
+
+	return !mRealTime || (long) (mClock->micros() - mAnchorNow) >= (long) (mRecTime - mAnchorRec);
+}
+
+/**
+ * Moves the received bytes which are due into the ring, carrying on into
+ * the following records while they are due receptions too, so a packet
+ * recorded across several chunks can be seen whole.
+ */
+void FingerprintReplay::fillRx() {
+	int c;	// The byte being moved
+
+	while (mRxLen < REPLAY_BUFFER_SIZE && rxReady()) {
+		c = mRec.read();
+		if (c < 0) {
+			mHaveRecord = false;
+			mEnded = true;
+			break;
+		}
+
+		mRx[(mRxHead + mRxLen) % REPLAY_BUFFER_SIZE] = c;
+		++mRxLen;
+
+		if (--mRemaining == 0) {
+			mHaveRecord = false;
+		}
+	}
+}
@@ -0,0 +1,102 @@
+#ifndef FINGERPRINT_RECORDER_H
+#define FINGERPRINT_RECORDER_H
+
+/* Includes */
+#include <Arduino.h>
+#include "FingerprintModule.h"
+
+/* Symbolic constants */
+// The 4 bytes starting every recording, the last one being the format version
+#define REC_MAGIC_1 'F'
+#define REC_MAGIC_2 'P'
+#define REC_MAGIC_3 'R'
+#define REC_VERSION 1
+
+// The maximum number of received bytes gathered into a single chunk
+#define REC_CHUNK_SIZE 32
+
+// The number of due received bytes a replay gathers from consecutive chunks, at least a response packet
+#define REPLAY_BUFFER_SIZE 32
+
+/* Enumerations */
+// The direction of a recorded chunk, as seen from the microcontroller
+enum REC_DIRECTION {
+	REC_TX = 0x00,	// Bytes sent to the sensor
+	REC_RX = 0x01	// Bytes received from the sensor
+};
+
+/* Class definitions */
+// Passes the traffic to and from the sensor through while recording it
+class FingerprintRecorder : public Stream {
+	private:
+		Stream& mWire;					// The serial interface to the sensor
+		Print& mSink;					// Where the recording is written
+		byte mRxBuf[REC_CHUNK_SIZE];	// Received bytes not yet written to the recording
+		uint8_t mRxLen;					// Number of bytes in mRxBuf
+		unsigned long mRxTime;			// Time at which the first byte of mRxBuf was received
+		unsigned long mLastTime;		// Time of the last chunk written
+		bool mStarted;					// True once the magic bytes have been written
+		dword mChunks;					// Number of chunks written
+		FingerprintClock* mClock;		// The source of time for the timestamps
+
+		void flushRx();
+		void writeChunk(REC_DIRECTION, unsigned long, const byte*, uint32_t);
+		void writeVarint(dword);
+
+	public:
+		FingerprintRecorder(Stream& wire, Print& sink);
+
+		int available();
+		int read();
+		int peek();
+		size_t write(uint8_t);
+		size_t write(const uint8_t*, size_t);
+		using Print::write;
+		void flush();
+
+		void setClock(FingerprintClock*);
+		dword getChunkCount();
+};
+
+// Stands in for the sensor by playing back a recording
+class FingerprintReplay : public Stream {
+	private:
+		Stream& mRec;					// The recording being played back
+		bool mRealTime;					// True to release received bytes at their original timing
+		bool mStarted;					// True once the magic bytes have been checked
+		bool mHaveRecord;				// True while a record is being played
+		bool mEnded;					// True once the recording is exhausted or invalid
+		REC_DIRECTION mDir;				// The direction of the current record
+		dword mRemaining;				// Bytes of the current record not yet played
+		unsigned long mRecTime;			// Recorded time of the current record
+		unsigned long mAnchorRec;		// Recorded time of the last transmission played
+		unsigned long mAnchorNow;		// Actual time at which that transmission was played
+		dword mMismatches;				// Number of written bytes which differ from the recording
+		dword mSkipped;					// Number of recorded received bytes the driver never read
+		byte mRx[REPLAY_BUFFER_SIZE];	// Ring of due received bytes not yet read by the driver
+		uint8_t mRxHead;				// Index of the oldest byte of mRx
+		uint8_t mRxLen;					// Number of bytes in mRx
+		FingerprintClock* mClock;		// The source of time for real-time playback
+
+		bool nextRecord();
+		bool readVarint(dword&);
+		bool rxReady();
+		void fillRx();
+
+	public:
+		FingerprintReplay(Stream& recording, bool realTime = true);
+
+		int available();
+		int read();
+		int peek();
+		size_t write(uint8_t);
+		using Print::write;
+		void flush();
+
+		void setClock(FingerprintClock*);
+		bool isFinished();
+		dword getMismatchCount();
+		dword getSkippedCount();
+};
+
+#endif
@@ -0,0 +1,581 @@
+/**
+ * Priority-aware job scheduler for a fingerprint module shared between
+ * interactive use and background work.
+ *
+ * Notes:
+ *	-	Jobs are queued with submit() and run one at a time by calling run() from the
+ *		main loop. Interactive jobs are always started before background jobs, and jobs
+ *		of the same priority run in the order they were submitted.
+ *	-	Submitting an interactive job while a background job is running preempts it: the
+ *		background job's pending command fails with NACK_CANCELLED at the next packet
+ *		boundary and the job is put back at the front of its queue to be run again once
+ *		the interactive work is done. Background jobs should therefore keep track of their
+ *		progress in their context so that a re-run resumes where it left off.
+ *	-	If the preempted command had already been sent, its reply still comes. The
+ *		interactive job is only started once that reply has come and gone, and the wait
+ *		counts towards its queueing delay (see getAvgQueueDelay()).
+ *	-	submit() may be called from an interrupt (e.g. a badge reader or button), which is
+ *		what allows a background job to be preempted on a single-threaded board.
+ *	-	While a job runs, the scheduler owns the module's cancellation token, so jobs must
+ *		not call setCancelToken() themselves.
+ *	-	Identifications requested with submitIdentify() are coalesced: while one is queued
+ *		or running, further requests simply wait on it, and a single capture and identify
+ *		has its result handed to every waiting caller. This keeps the sensor from repeating
+ *		the same slow sequence when several clients ask at once.
+ *	-	Identifications can also be answered from a short-lived cache of the last match
+ *		(see setIdentifyCacheTTL()). The driver never downloads the probe template, so
+ *		the cache can't be keyed on it; instead a fresh capture is still taken and checked
+ *		against the cached ID with a quick 1:1 verification, falling back to the full 1:N
+ *		search when it doesn't match. A cached result is therefore never handed to a
+ *		different finger.
+ *	-	Health probes (see setHealthProbe()) keep an eye on the sensor while nobody uses
+ *		it: once no job has run for the idle window, run() sends a cheap CMD_GET_ENROLL_COUNT
+ *		instead. A probe is only started when every queue is empty and runs as background
+ *		work, so a submit() makes it yield; it is simply dropped rather than retried when
+ *		that happens. Being a single 12-byte exchange, it only yields before it is sent:
+ *		once sent, it runs to its end, rather than leave its reply on the line for the job
+ *		which preempted it to wait out. Probes go through the module like any other
+ *		command, so a FingerprintWatchdog or the metrics see their latency and errors,
+ *		and a sensor gone quiet is noticed before a user needs it.
+ *	-	Once the module finds the sensor detached, probes call reattach() instead, so an
+ *		idle scheduler brings a replugged sensor back on its own. That takes much longer,
+ *		so it is abandoned as soon as a job is submitted.
+ */
+
+// Includes
+#include "FingerprintScheduler.h"
+
+// BEGIN PUBLIC
+
+/**
+ * Creates a scheduler for the given fingerprint module with empty queues.
+ *
+ * @param fpm The fingerprint module shared by every scheduled job
+ */
+FingerprintScheduler::FingerprintScheduler(FingerprintModule& fpm) : mModule(fpm) {
+	for (uint8_t i = 0; i < PRIORITY_COUNT; ++i) {
+		mHead[i] = 0;
+		mCount[i] = 0;
+		mDispatched[i] = 0;
+		mTotalDelay[i] = 0;
+		mMaxDelay[i] = 0;
+	}
+
+	mPreempt = false;
+	mBusy = false;
+	mRunning = PRIORITY_BACKGROUND;
+	mPreempted = 0;
+	mWaiterCount = 0;
+	mIdentifyQueued = false;
+	mIdentifyRuns = 0;
+	mCoalesced = 0;
+	mCacheTTL = 0;
+	mCacheValid = false;
+	mCacheHits = 0;
+	mCacheMisses = 0;
+	mProbeIdle = 0;
+	mLastActivity = 0;
+	mProbes = 0;
+	mProbeFailures = 0;
+	mProbesYielded = 0;
+}
+
+/**
+ * Queues a job to be run by run(). If the job is interactive and a background
+ * job is currently running, the background job is preempted. Safe to call from
+ * an interrupt.
+ *
+ * @param job The function to run
+ * @param ctx A pointer handed untouched to the job (optional)
+ * @param prio The priority class of the job, defaults to PRIORITY_INTERACTIVE
+ *
+ * @return True if the job was queued, false if its queue is full
+ */
+bool FingerprintScheduler::submit(fingerprintJob job, void* ctx, PRIORITY prio) {
+	bool queued = push(prio, job, ctx, false);
+
+	if (queued && mBusy && prio < mRunning) {
+		mPreempt = true;
+	}
+
+	return queued;
+}
+
+/**
+ * Requests an interactive capture and identification, whose result is handed
+ * to the given callback. If an identification is already queued or running,
+ * the request joins it instead of queueing another one, and every caller gets
+ * the result of the same capture. Safe to call from an interrupt.
+ *
+ * @param cb The function receiving the result
+ * @param ctx A pointer handed untouched to the callback (optional)
+ *
+ * @return True if the request was accepted, false if too many callers are waiting
+ */
+bool FingerprintScheduler::submitIdentify(identifyCallback cb, void* ctx) {
+	bool accepted = false;	// Indicates whether there was room for another waiter
+	bool needJob = false;	// Indicates this is the first waiter and a job must be queued
+	uint8_t slot;			// Index of this request in the waiting list
+
+	noInterrupts();
+	if (mWaiterCount < SCHED_MAX_WAITERS) {
+		slot = mWaiterCount;
+		mWaiters[mWaiterCount].fn = cb;
+		mWaiters[mWaiterCount].ctx = ctx;
+		++mWaiterCount;
+		accepted = true;
+
+		if (mIdentifyQueued) {
+			++mCoalesced;
+		} else {
+			mIdentifyQueued = true;
+			needJob = true;
+		}
+	}
+	interrupts();
+
+	// Queue the shared identification, withdrawing the request if there's no room. An interrupt may have
+	// joined it in the meantime, so remove this request's own slot; anyone who joined stays on the list
+	// and is served by the next identification queued
+	if (needJob && !submit(identifyJob, this, PRIORITY_INTERACTIVE)) {
+		noInterrupts();
+		for (uint8_t i = slot + 1; i < mWaiterCount; ++i) {
+			mWaiters[i - 1] = mWaiters[i];
+		}
+		--mWaiterCount;
+		mIdentifyQueued = false;
+		interrupts();
+		accepted = false;
+	}
+
+	return accepted;
+}
+
+/**
+ * Runs the highest priority job waiting, if any, or a health probe if the
+ * sensor has been idle long enough. Should be called regularly from the main
+ * loop. A background job which gets preempted is put back at the front of
+ * its queue; if that queue was filled up in the meantime, the job is dropped.
+ *
+ * @return True if a job or probe was run, false if there was nothing to do
+ */
+bool FingerprintScheduler::run() {
+	Job job;			// The job to run
+	PRIORITY prio;		// The priority class of the job
+	bool success;		// Whether the job succeeded
+
+	if (!pop(job, prio)) {
+		return probe();
+	}
+
+	// Only background jobs can be preempted
+	mModule.setCancelToken(prio == PRIORITY_INTERACTIVE ? 0x00 : &mPreempt);
+
+	// The job can't use the sensor before the late reply to a preempted command has come and gone, so
+	// wait for it here and count it as queueing delay rather than hide it in the job's first command
+	mModule.settle();
+
+	// Record how long the job spent waiting in its queue
+	dword waited = mModule.getClock().millis() - job.queuedAt;
+	++mDispatched[prio];
+	mTotalDelay[prio] += waited;
+	if (waited > mMaxDelay[prio]) {
+		mMaxDelay[prio] = waited;
+	}
+
+	// Any other job may change the enrolled templates, so forget the last identification
+	if (job.fn != identifyJob) {
+		mCacheValid = false;
+	}
+
+	success = job.fn(mModule, job.ctx);
+	mModule.setCancelToken(0x00);
+
+	// Put a preempted job back in line to be resumed
+	if (!success && mPreempt && mModule.getErrorCode() == NACK_CANCELLED) {
+		++mPreempted;
+		push(prio, job.fn, job.ctx, true);
+	}
+
+	mLastActivity = mModule.getClock().millis();
+	mPreempt = false;
+	mBusy = false;
+
+	return true;
+}
+
+/**
+ * Checks whether the scheduler has nothing to do.
+ *
+ * @return True if no job is running or waiting, false otherwise
+ */
+bool FingerprintScheduler::isIdle() {
+	bool idle = !mBusy;
+
+	for (uint8_t i = 0; i < PRIORITY_COUNT && idle; ++i) {
+		idle = (mCount[i] == 0);
+	}
+
+	return idle;
+}
+
+/**
+ * Enables the identification cache: for the given time after a successful
+ * identification, the next identification first checks the new capture
+ * against the same ID with a 1:1 verification before searching all templates.
+ * Intended for users retrying right after a slow response.
+ *
+ * @param ttl How long a match stays cached in milliseconds, 0 to disable the cache
+ */
+void FingerprintScheduler::setIdentifyCacheTTL(dword ttl) {
+	mCacheTTL = ttl;
+	mCacheValid = false;
+}
+
+/**
+ * Forgets the cached identification. The cache is cleared automatically when
+ * the scheduler runs any other job, but must be cleared by hand if templates
+ * are enrolled or deleted by calling the module directly.
+ */
+void FingerprintScheduler::invalidateIdentifyCache() {
+	mCacheValid = false;
+}
+
+/**
+ * Enables health probes: whenever no job has run for the given time, run()
+ * sends a CMD_GET_ENROLL_COUNT to check the sensor still answers.
+ *
+ * @param idle How long the sensor must be idle before a probe in milliseconds, 0 to disable probes
+ */
+void FingerprintScheduler::setHealthProbe(dword idle) {
+	mProbeIdle = idle;
+	mLastActivity = mModule.getClock().millis();
+}
+
+/**
+ * Retrieves the number of jobs waiting in the queue of the given priority class.
+ *
+ * @param prio The priority class
+ *
+ * @return The number of waiting jobs
+ */
+uint8_t FingerprintScheduler::getQueueLength(PRIORITY prio) {
+	return mCount[prio];
+}
+
+/**
+ * Retrieves the number of jobs of the given priority class started so far,
+ * counting each resumption of a preempted job.
+ *
+ * @param prio The priority class
+ *
+ * @return The number of jobs started
+ */
+dword FingerprintScheduler::getDispatchCount(PRIORITY prio) {
+	return mDispatched[prio];
+}
+
+/**
+ * Retrieves the average time jobs of the given priority class waited in
+ * their queue before being started, including any wait for the late reply
+ * to a preempted command to clear the line.
+ *
+ * @param prio The priority class
+ *
+ * @return The average queueing delay in milliseconds
+ */
+dword FingerprintScheduler::getAvgQueueDelay(PRIORITY prio) {
+	return mDispatched[prio] == 0 ? 0 : mTotalDelay[prio] / mDispatched[prio];
+}
+
+/**
+ * Retrieves the longest time a job of the given priority class waited in
+ * its queue before being started, including any wait for the line to clear.
+ *
+ * @param prio The priority class
+ *
+ * @return The largest queueing delay in milliseconds
+ */
+dword FingerprintScheduler::getMaxQueueDelay(PRIORITY prio) {
+	return mMaxDelay[prio];
+}
+
+/**
+ * Retrieves the number of times a background job was preempted.
+ *
+ * @return The number of preemptions
+ */
+dword FingerprintScheduler::getPreemptCount() {
+	return mPreempted;
+}
+
+/**
+ * Retrieves the number of capture and identify sequences actually run on
+ * behalf of submitIdentify() requests.
+ *
+ * @return The number of identifications run
+ */
+dword FingerprintScheduler::getIdentifyRunCount() {
+	return mIdentifyRuns;
+}
+
+/**
+ * Retrieves the number of submitIdentify() requests which were served by
+ * joining an identification already pending rather than running their own.
+ *
+ * @return The number of coalesced requests
+ */
+dword FingerprintScheduler::getCoalescedCount() {
+	return mCoalesced;
+}
+
+/**
+ * Retrieves the number of identifications answered by confirming the cached ID.
+ *
+ * @return The number of cache hits
+ */
+dword FingerprintScheduler::getCacheHitCount() {
+	return mCacheHits;
+}
+
+/**
+ * Retrieves the number of identifications which needed a full 1:N search
+ * while the cache was enabled.
+ *
+ * @return The number of cache misses
+ */
+dword FingerprintScheduler::getCacheMissCount() {
+	return mCacheMisses;
+}
+
+/**
+ * Retrieves the number of health probes which ran to completion, whether
+ * the sensor answered or not.
+ *
+ * @return The number of probes
+ */
+dword FingerprintScheduler::getProbeCount() {
+	return mProbes;
+}
+
+/**
+ * Retrieves the number of completed health probes the sensor failed.
+ *
+ * @return The number of failed probes
+ */
+dword FingerprintScheduler::getProbeFailureCount() {
+	return mProbeFailures;
+}
+
+/**
+ * Retrieves the number of health probes abandoned because a job was
+ * submitted while they ran.
+ *
+ * @return The number of abandoned probes
+ */
+dword FingerprintScheduler::getProbeYieldCount() {
+	return mProbesYielded;
+}
+
+// END PUBLIC
+
+// BEGIN PRIVATE
+
+/**
+ * Adds a job to the queue of the given priority class, either at the back
+ * or, when resuming a preempted job, at the front.
+ *
+ * @param prio The priority class of the job
+ * @param fn The function to run
+ * @param ctx The context pointer handed to the function
+ * @param front True to place the job at the front of the queue
+ *
+ * @return True if the job was queued, false if the queue is full
+ */
+bool FingerprintScheduler::push(PRIORITY prio, fingerprintJob fn, void* ctx, bool front) {
+	bool queued = false;	// Indicates whether there was room for the job
+
+	noInterrupts();
+	if (mCount[prio] < SCHED_QUEUE_SIZE) {
+		uint8_t slot;		// Index of the job in the ring buffer
+
+		if (front) {
+			mHead[prio] = (mHead[prio] + SCHED_QUEUE_SIZE - 1) % SCHED_QUEUE_SIZE;
+			slot = mHead[prio];
+		} else {
+			slot = (mHead[prio] + mCount[prio]) % SCHED_QUEUE_SIZE;
+		}
+
+		mQueue[prio][slot].fn = fn;
+		mQueue[prio][slot].ctx = ctx;
+		mQueue[prio][slot].queuedAt = mModule.getClock().millis();
+		++mCount[prio];
+		queued = true;
+	}
+	interrupts();
+
+	return queued;
+}
+
+/**
+ * Removes the oldest job of the highest priority class which has one, and
+ * marks the scheduler busy running it.
+ *
+ * @param job Filled in with the removed job
+ * @param prio Filled in with the priority class of the job
+ *
+ * @return True if a job was removed, false if every queue was empty
+ */
+bool FingerprintScheduler::pop(Job& job, PRIORITY& prio) {
+	bool found = false;		// Indicates whether a job was waiting
+
+	noInterrupts();
+	for (uint8_t i = 0; i < PRIORITY_COUNT && !found; ++i) {
+		if (mCount[i] > 0) {
+			prio = (PRIORITY) i;
+			job = mQueue[i][mHead[i]];
+			mHead[i] = (mHead[i] + 1) % SCHED_QUEUE_SIZE;
+			--mCount[i];
+			found = true;
+
+			// Mark busy while interrupts are off so a submit() can't miss a preemption
+			mBusy = true;
+			mRunning = prio;
+			mPreempt = false;
+		}
+	}
+	interrupts();
+
+	return found;
+}
+
+/**
+ * Sends a health probe if probes are enabled, every queue is empty and the
+ * idle window has passed since the last job or probe, or tries to bring the
+ * sensor back if it is detached. A job submitted before the probe is sent
+ * makes it yield; once sent, it runs to its end. Bringing the sensor back
+ * takes much longer, so it is abandoned as soon as a job is submitted.
+ *
+ * @return True if a probe was sent, false otherwise
+ */
+bool FingerprintScheduler::probe() {
+	bool due;				// Whether a probe should be sent now
+	bool success = false;	// Whether the sensor answered the probe
+	bool yielded = false;	// Whether the probe gave way to a job
+
+	noInterrupts();
+	due = mProbeIdle > 0 && mModule.getClock().millis() - mLastActivity >= mProbeIdle;
+	for (uint8_t i = 0; i < PRIORITY_COUNT && due; ++i) {
+		due = (mCount[i] == 0);
+	}
+
+	// Run it as background work, so a submit() preempts it like any background job
+	if (due) {
+		mBusy = true;
+		mRunning = PRIORITY_BACKGROUND;
+		mPreempt = false;
+	}
+	interrupts();
+
+	if (!due) {
+		return false;
+	}
+
+	if (mPreempt) {
+		yielded = true;
+	} else if (mModule.isAttached()) {
+		success = mModule.getEnrollCount();
+	} else {
+		mModule.setCancelToken(&mPreempt);
+		success = mModule.reattach();
+		mModule.setCancelToken(0x00);
+		yielded = !success && mPreempt && mModule.getErrorCode() == NACK_CANCELLED;
+	}
+
+	if (yielded) {
+		++mProbesYielded;
+	} else {
+		++mProbes;
+		if (!success) {
+			++mProbeFailures;
+		}
+	}
+
+	mLastActivity = mModule.getClock().millis();
+	mPreempt = false;
+	mBusy = false;
+
+	return true;
+}
+
+/**
+ * Hands the result of an identification to every waiting caller and clears
+ * the waiting list, so that later requests start a new identification.
+ *
+ * @param matched Whether the captured fingerprint matched an enrollment
+ * @param result The matched ID, or the error code if there was no match
+ */
+void FingerprintScheduler::fanOut(bool matched, dword result) {
+	Waiter waiters[SCHED_MAX_WAITERS];	// Copy of the waiting list, so callbacks run with interrupts on
+	uint8_t count;						// Number of waiting callers
+
+	noInterrupts();
+	count = mWaiterCount;
+	for (uint8_t i = 0; i < count; ++i) {
+		waiters[i] = mWaiters[i];
+	}
+	mWaiterCount = 0;
+	mIdentifyQueued = false;
+	interrupts();
+
+	for (uint8_t i = 0; i < count; ++i) {
+		waiters[i].fn(matched, result, waiters[i].ctx);
+	}
+}
+
+/**
+ * The job queued by submitIdentify(): captures a fingerprint, identifies it,
+ * and hands the result to every caller waiting on it. If a recent match is
+ * cached, the capture is first verified against that ID alone.
+ *
+ * @param fpm The fingerprint module to use
+ * @param ctx The scheduler which queued the job
+ *
+ * @return True if the fingerprint was identified, false otherwise
+ */
+bool FingerprintScheduler::identifyJob(FingerprintModule& fpm, void* ctx) {
+	FingerprintScheduler* sched = (FingerprintScheduler*) ctx;	// The scheduler holding the waiting list and cache
+	bool matched = fpm.captureFingerprint();					// Whether the fingerprint was captured, then identified
+	bool cacheLive;												// Whether the cached match is still within its lifetime
+	dword result;												// The matched ID or the error code
+
+	cacheLive = sched->mCacheTTL > 0 && sched->mCacheValid && fpm.getClock().millis() - sched->mCachedAt < sched->mCacheTTL;
+
+	if (matched) {
+		if (cacheLive && fpm.verify(sched->mCachedID)) {
+			++sched->mCacheHits;
+			result = sched->mCachedID;
+		} else {
+			if (sched->mCacheTTL > 0) {
+				++sched->mCacheMisses;
+			}
+
+			matched = fpm.identify();
+			result = matched ? fpm.getResponseParam() : fpm.getErrorCode();
+		}
+	} else {
+		result = fpm.getErrorCode();
+	}
+
+	// Only matches are cached, and any failure drops the cached one
+	sched->mCacheValid = matched;
+	if (matched) {
+		sched->mCachedID = result;
+		sched->mCachedAt = fpm.getClock().millis();
+	}
+
+	++sched->mIdentifyRuns;
+	sched->fanOut(matched, result);
+
+	return matched;
+}
@@ -0,0 +1,106 @@
+#ifndef FINGERPRINT_SCHEDULER_H
+#define FINGERPRINT_SCHEDULER_H
+
+/* Includes */
+#include "FingerprintModule.h"
+
+/* Symbolic constants */
+// The maximum number of jobs which can wait in the queue of each priority class
+#define SCHED_QUEUE_SIZE 8
+
+// The maximum number of callers which can wait on the same identification
+#define SCHED_MAX_WAITERS 8
+
+/* Enumerations */
+// Priority classes of scheduled jobs, lower values are served first
+enum PRIORITY {
+	PRIORITY_INTERACTIVE,	// A user is waiting on the result (e.g. identify at a door)
+	PRIORITY_BACKGROUND,	// Maintenance work (e.g. template backup, health probes)
+	PRIORITY_COUNT			// The number of priority classes
+};
+
+/* Type definitions */
+// A job run by the scheduler, returns true on success
+typedef bool (*fingerprintJob)(FingerprintModule& fpm, void* ctx);
+
+// Receives the result of an identification requested with submitIdentify()
+// On a match, result is the matched ID; otherwise it is the error code
+typedef void (*identifyCallback)(bool matched, dword result, void* ctx);
+
+/* Class definition */
+class FingerprintScheduler {
+	private:
+		// A job waiting in one of the queues
+		struct Job {
+			fingerprintJob fn;			// The function to run
+			void* ctx;					// The context pointer handed to the function
+			unsigned long queuedAt;		// Time at which the job was queued
+		};
+
+		// A caller waiting on the result of the pending identification
+		struct Waiter {
+			identifyCallback fn;		// The function receiving the result
+			void* ctx;					// The context pointer handed to the function
+		};
+
+		FingerprintModule& mModule;								// The sensor shared by every job
+		Job mQueue[PRIORITY_COUNT][SCHED_QUEUE_SIZE];			// One ring buffer of jobs per priority class
+		uint8_t mHead[PRIORITY_COUNT];							// Index of the oldest job of each queue
+		uint8_t mCount[PRIORITY_COUNT];							// Number of jobs in each queue
+		volatile bool mPreempt;									// Raised to abort the running background job
+		volatile bool mBusy;									// True while a job is running
+		volatile PRIORITY mRunning;								// The priority of the running job
+		dword mDispatched[PRIORITY_COUNT];						// Number of jobs started per priority class
+		dword mTotalDelay[PRIORITY_COUNT];						// Total queueing delay in ms per priority class
+		dword mMaxDelay[PRIORITY_COUNT];						// Largest queueing delay in ms per priority class
+		dword mPreempted;										// Number of background jobs preempted
+		Waiter mWaiters[SCHED_MAX_WAITERS];						// Callers waiting on the pending identification
+		volatile uint8_t mWaiterCount;							// Number of callers waiting on the pending identification
+		volatile bool mIdentifyQueued;							// True while an identification job is queued or running
+		dword mIdentifyRuns;									// Number of capture and identify sequences run
+		dword mCoalesced;										// Number of identify requests served by another request's capture
+		dword mCacheTTL;										// Lifetime in ms of a cached identification, 0 disables the cache
+		bool mCacheValid;										// True if mCachedID holds a usable result
+		dword mCachedID;										// The ID matched by the latest identification
+		unsigned long mCachedAt;								// Time at which mCachedID was matched
+		dword mCacheHits;										// Number of identifications answered from the cache
+		dword mCacheMisses;										// Number of identifications which had to search all templates
+		dword mProbeIdle;										// Idle time in ms after which a health probe is sent, 0 disables probing
+		unsigned long mLastActivity;							// Time at which the last job or probe ended
+		dword mProbes;											// Number of health probes completed
+		dword mProbeFailures;									// Number of completed health probes which failed
+		dword mProbesYielded;									// Number of health probes abandoned for a real job
+
+		bool push(PRIORITY, fingerprintJob, void*, bool front);
+		bool pop(Job&, PRIORITY&);
+		void fanOut(bool, dword);
+		bool probe();
+
+		static bool identifyJob(FingerprintModule&, void*);
+
+	public:
+		FingerprintScheduler(FingerprintModule&);
+
+		bool submit(fingerprintJob, void* ctx = 0x00, PRIORITY prio = PRIORITY_INTERACTIVE);
+		bool submitIdentify(identifyCallback, void* ctx = 0x00);
+		bool run();
+		bool isIdle();
+		void setIdentifyCacheTTL(dword);
+		void invalidateIdentifyCache();
+		void setHealthProbe(dword);
+
+		uint8_t getQueueLength(PRIORITY);
+		dword getDispatchCount(PRIORITY);
+		dword getAvgQueueDelay(PRIORITY);
+		dword getMaxQueueDelay(PRIORITY);
+		dword getPreemptCount();
+		dword getIdentifyRunCount();
+		dword getCoalescedCount();
+		dword getCacheHitCount();
+		dword getCacheMissCount();
+		dword getProbeCount();
+		dword getProbeFailureCount();
+		dword getProbeYieldCount();
+};
+
+#endif
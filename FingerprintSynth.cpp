@@ -0,0 +1,214 @@
+/**
+ * Synthetic fingerprint generator, for benchmarks and tests which can't use real prints.
+ *
+ * Notes:
+ *	-	Each finger gets a ridge pattern (arch, loop or whorl), a core position, a tilt, a
+ *		ridge spacing of 8 to 11 pixels and some waviness, all drawn from the seed and the
+ *		finger number. The same seed and finger always give the same print, so a gallery
+ *		can be rebuilt anywhere without shipping images.
+ *	-	Each impression of a finger lies a little differently on the sensor and has its own
+ *		contrast and noise, like repeated presses of a real finger. Two impressions of the
+ *		same finger make a genuine pair; impressions of different fingers an impostor pair.
+ *	-	Pixels are computed one at a time, so an image can be streamed without a buffer,
+ *		as the FingerprintEmulator does when it sends one.
+ *	-	Templates are not real minutiae templates: their TEMPLATE_SIZE bytes follow a simple
+ *		sequence which tells which finger they were made from, which is all the emulator
+ *		needs to match them.
+ */
+
+// Includes
+#include "FingerprintSynth.h"
+
+// BEGIN PUBLIC
+
+/**
+ * Creates a generator for the fingers drawn from the given seed, finger 0
+ * being selected.
+ *
+ * @param seed The seed, 1 by default
+ */
+FingerprintSynth::FingerprintSynth(uint32_t seed) {
+	mSeed = seed;
+	select(0);
+}
+
+/**
+ * Selects the finger and impression the following pixels are drawn from.
+ *
+ * @param finger The finger, or SYNTH_NO_FINGER for an empty sensor
+ * @param impression The impression of the finger (default 0)
+ */
+void FingerprintSynth::select(int16_t finger, uint16_t impression) {
+	uint32_t h = hash(mSeed, finger);	// Drives the finger's features
+	uint32_t g = hash(h, impression);	// Drives the impression's features
+	float tilt;							// The finger's tilt in radians
+
+	mFinger = finger;
+	mImpression = impression;
+
+	mPattern = (SYNTH_PATTERN) (h % 3);
+	mCoreX = SYNTH_WIDTH / 2 + (int) ((h >> 4) % 41) - 20;
+	mCoreY = SYNTH_HEIGHT / 2 + (int) ((h >> 10) % 41) - 20;
+	tilt = ((int) ((h >> 16) % 41) - 20) * PI / 180;
+	mCos = cos(tilt);
+	mSin = sin(tilt);
+	mFreq = 1.0 / (8 + (h >> 22) % 4);
+	mWarpPhase = (h >> 26) * 0.1;
+
+	mShiftX = (int) (g % 17) - 8;
+	mShiftY = (int) ((g >> 5) % 17) - 8;
+	mContrast = 70 + (g >> 10) % 41;
+	mNoise = 4 + (g >> 16) % 21;
+	mNoiseSeed = hash(g, 0x9E3779B9);
+}
+
+/**
+ * Retrieves the ridge pattern of the selected finger.
+ *
+ * @return The pattern
+ */
+SYNTH_PATTERN FingerprintSynth::getPattern() {
+	return mPattern;
+}
+
+/**
+ * Draws a pixel of the selected impression: dark ridges on a light
+ * background, fading out towards the edge of the finger.
+ *
+ * @param x The column, from 0 to SYNTH_WIDTH - 1
+ * @param y The row, from 0 to SYNTH_HEIGHT - 1
+ *
+ * @return The pixel
+ */
+byte FingerprintSynth::pixel(word x, word y) {
+	int noise;			// The noise added to the pixel
+	float ex, ey;		// Position relative to the finger's outline, 1 being on it
+	float edge;			// 1 inside the finger, falling to 0 at its outline
+	float u0, v0;		// Position relative to the core
+	float u, v;			// The same once the tilt is taken out
+	float r;			// Distance from the core
+	float d;			// Distance across the ridges, in pixels
+	int value;
+
+	if (mFinger == SYNTH_NO_FINGER) {
+		return 0xFF;
+	}
+
+	noise = (int) (hash(mNoiseSeed, (dword) y * SYNTH_WIDTH + x) % (2 * mNoise + 1)) - mNoise;
+
+	ex = (x - SYNTH_WIDTH / 2 - mShiftX) / 100.0;
+	ey = (y - SYNTH_HEIGHT / 2 - mShiftY) / 104.0;
+	edge = (1 - ex * ex - ey * ey) * 4;
+	if (edge <= 0) {
+		return constrain(235 + noise / 2, 0, 255);
+	}
+	edge = min(edge, (float) 1);
+
+	u0 = x - mShiftX - mCoreX;
+	v0 = y - mShiftY - mCoreY;
+	u = u0 * mCos + v0 * mSin;
+	v = v0 * mCos - u0 * mSin;
+	r = sqrt(u * u + v * v);
+
+	switch (mPattern) {
+		case SYNTH_ARCH:
+			d = v + 30 / (1 + u * u / 1600);
+			break;
+
+		case SYNTH_LOOP:
+			d = (r + v) / 2;
+			break;
+
+		default:
+			d = r;
+			break;
+	}
+	d += 3 * sin(u / 23 + mWarpPhase);
+
+	value = 235 - (int) (edge * mContrast * (1 + cos(2 * PI * d * mFreq))) + noise;
+
+	return constrain(value, 0, 255);
+}
+
+/**
+ * Draws the whole selected impression.
+ *
+ * @param buf Where to put the SYNTH_WIDTH x SYNTH_HEIGHT pixels, row by row
+ */
+void FingerprintSynth::render(byte* buf) {
+	for (word y = 0; y < SYNTH_HEIGHT; ++y) {
+		for (word x = 0; x < SYNTH_WIDTH; ++x) {
+			*buf++ = pixel(x, y);
+		}
+	}
+}
+
+/**
+ * Prints a rough picture of the selected impression in characters, dark
+ * characters for dark pixels, to check what a finger looks like over a
+ * serial console.
+ *
+ * @param out Where to print
+ * @param step The number of pixels per character across, twice as many down (default 6)
+ */
+void FingerprintSynth::preview(Print& out, uint8_t step) {
+	static const char shades[] = "@%#*+=-:. ";	// From darkest to lightest
+
+	for (word y = 0; y < SYNTH_HEIGHT; y += 2 * step) {
+		for (word x = 0; x < SYNTH_WIDTH; x += step) {
+			out.print(shades[pixel(x, y) * (sizeof(shades) - 1) / 256]);
+		}
+		out.println();
+	}
+}
+
+/**
+ * Makes a byte of the template of a finger.
+ *
+ * @param finger The finger
+ * @param i The position of the byte in the template
+ *
+ * @return The byte
+ */
+byte FingerprintSynth::templateByte(int16_t finger, uint32_t i) {
+	return (byte) ((finger + 1) * 131 + i * 17);
+}
+
+/**
+ * Finds the finger a template was made from, by its first byte. Check the
+ * rest against templateByte() to be sure it's a template at all.
+ *
+ * @param first The first byte of the template
+ *
+ * @return The finger, from SYNTH_NO_FINGER to 254
+ */
+int16_t FingerprintSynth::templateFinger(byte first) {
+	// 43 is the inverse of 131 modulo 256
+	return (int16_t) (byte) (first * 43) - 1;
+}
+
+// END PUBLIC
+
+// BEGIN PRIVATE
+
+/**
+ * Mixes two numbers into a well spread one.
+ *
+ * @param a The first number
+ * @param b The second number
+ *
+ * @return The mix
+ */
+uint32_t FingerprintSynth::hash(uint32_t a, uint32_t b) {
+	uint32_t h = a * 0x9E3779B1UL ^ (b + 0x7F4A7C15UL + (a << 6) + (a >> 2));
+
+	h ^= h >> 16;
+	h *= 0x85EBCA6BUL;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35UL;
+	h ^= h >> 16;
+
+	return h;
+}
+
+// END PRIVATE
@@ -0,0 +1,59 @@
+#ifndef FINGERPRINT_SYNTH_H
+#define FINGERPRINT_SYNTH_H
+
+/* Includes */
+#include <Arduino.h>
+#include "FingerprintModule.h"
+
+/* Symbolic constants */
+// The size of the images made, that of GET_IMAGE
+#define SYNTH_WIDTH 240
+#define SYNTH_HEIGHT 216
+
+// The value of a finger meaning none, e.g. for a template no finger makes
+#define SYNTH_NO_FINGER -1
+
+/* Enumerations */
+// The ridge patterns a synthetic finger can have
+enum SYNTH_PATTERN {
+	SYNTH_ARCH,		// Ridges run across the finger with a bump over the core
+	SYNTH_LOOP,		// Ridges curve back around the core on one side
+	SYNTH_WHORL		// Ridges circle the core
+};
+
+/* Class definition */
+// Draws synthetic fingerprint images and makes templates, the same for the same finger and seed
+class FingerprintSynth {
+	private:
+		uint32_t mSeed;			// The seed all fingers are drawn from
+		int16_t mFinger;		// The selected finger
+		uint16_t mImpression;	// The selected impression of the finger
+		SYNTH_PATTERN mPattern;	// The finger's ridge pattern
+		float mCoreX;			// Position of the core on the finger, in pixels
+		float mCoreY;
+		float mCos;				// Cosine and sine of the finger's tilt
+		float mSin;
+		float mFreq;			// Ridges per pixel
+		float mWarpPhase;		// Offset of the finger's irregular waviness
+		int8_t mShiftX;			// Where this impression lies on the sensor, in pixels
+		int8_t mShiftY;
+		uint8_t mContrast;		// How dark the ridges of this impression are
+		uint8_t mNoise;			// How much noise this impression has
+		uint32_t mNoiseSeed;	// The seed of this impression's noise
+
+		static uint32_t hash(uint32_t, uint32_t);
+
+	public:
+		FingerprintSynth(uint32_t seed = 1);
+
+		void select(int16_t, uint16_t impression = 0);
+		SYNTH_PATTERN getPattern();
+		byte pixel(word, word);
+		void render(byte*);
+		void preview(Print&, uint8_t step = 6);
+
+		static byte templateByte(int16_t, uint32_t);
+		static int16_t templateFinger(byte);
+};
+
+#endif
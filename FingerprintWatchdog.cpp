@@ -0,0 +1,321 @@
+/**
+ * Latency and error rate watchdog for the fingerprint module.
+ *
+ * Notes:
+ *	-	Once begin() is called, the watchdog sees every command the module completes through
+ *		its command observer, and keeps a rolling window of the last WD_WINDOW commands as
+ *		well as a running average latency per command.
+ *	-	Only link and device failures (no response, bad checksums, NACK_COMM_ERR, NACK_DEV_ERR,
+ *		...) count as errors. Refusals which are part of normal use, such as a finger not
+ *		being pressed or a failed verification, don't. Commands which were cancelled, ran
+ *		out of time or found the sensor detached aren't sampled at all: they say nothing
+ *		about the link, and an unplugged sensor is for reattach() to bring back, not for
+ *		the recovery ladder.
+ *	-	check() should be called regularly from the main loop. When the average latency or the
+ *		error rate over the window breaches its SLO, the recovery ladder is run: first a
+ *		resync of the receive buffer, then a close() and open(), and finally a reconnect()
+ *		which searches for the sensor's baudrate. Each step is only tried if the previous
+ *		one did not bring the sensor back, and the time taken to recover is recorded.
+ *	-	Latencies run from sending a command to reading its response, which the driver picks
+ *		up within ABORT_POLL_TIME of it arriving, so they are close to the sensor's own times.
+ *		The latency SLO must be set above the average of the commands the application runs;
+ *		the default, WD_LATENCY_SLO, is above a high quality capture, the slowest of them.
+ *	-	If reconnect() finds a sensor with another serial number, the recovery fails: a
+ *		different sensor doesn't know the enrolled fingers, so the application has to decide
+ *		what to do, and the module's error code is left at NACK_SERIAL_MISMATCH to tell it.
+ */
+
+// Includes
+#include "FingerprintWatchdog.h"
+
+// BEGIN PUBLIC
+
+/**
+ * Creates a watchdog for the given module with the given SLOs. Call begin()
+ * to start watching.
+ *
+ * @param fpm The module to watch
+ * @param latencySLO The highest acceptable average latency in milliseconds
+ * @param errorSLO The highest acceptable error rate in percent
+ */
+FingerprintWatchdog::FingerprintWatchdog(FingerprintModule& fpm, dword latencySLO, uint8_t errorSLO) : mModule(fpm) {
+	mLatencySLO = latencySLO;
+	mErrorSLO = errorSLO;
+	mRecovering = false;
+	mBreaches = 0;
+	mRecoveries = 0;
+	mFailures = 0;
+	mLastRecoveryTime = 0;
+	mMaxRecoveryTime = 0;
+	mLastStep = RECOVERY_NONE;
+	mCmdCount = 0;
+
+	clear();
+}
+
+/**
+ * Starts watching the module by registering as its command observer.
+ */
+void FingerprintWatchdog::begin() {
+	mModule.setCommandObserver(observe, this);
+}
+
+/**
+ * Checks the rolling latency and error rate against their SLOs and runs the
+ * recovery ladder if either is breached.
+ *
+ * @return True if the sensor is healthy or was recovered, false if recovery failed
+ */
+bool FingerprintWatchdog::check() {
+	if (mCount < WD_MIN_SAMPLES || (getAvgLatency() <= mLatencySLO && getErrorRate() <= mErrorSLO)) {
+		return true;
+	}
+
+	++mBreaches;
+
+	#ifdef DEBUG
+		Serial.print(F("Watchdog SLO breached, average latency "));
+		Serial.print(getAvgLatency());
+		Serial.print(F(" ms, error rate "));
+		Serial.print(getErrorRate());
+		Serial.println(F("%, recovering"));
+	#endif
+
+	unsigned long start = mModule.getClock().millis();
+	mLastStep = recover();
+	mLastRecoveryTime = mModule.getClock().millis() - start;
+
+	if (mLastStep == RECOVERY_FAILED) {
+		++mFailures;
+	} else {
+		++mRecoveries;
+		if (mLastRecoveryTime > mMaxRecoveryTime) {
+			mMaxRecoveryTime = mLastRecoveryTime;
+		}
+	}
+
+	// Judge the recovered sensor on fresh samples only
+	clear();
+
+	return mLastStep != RECOVERY_FAILED;
+}
+
+/**
+ * Empties the rolling window.
+ */
+void FingerprintWatchdog::clear() {
+	mNext = 0;
+	mCount = 0;
+}
+
+/**
+ * Retrieves the average latency over the rolling window.
+ *
+ * @return The average latency in milliseconds, 0 if the window is empty
+ */
+dword FingerprintWatchdog::getAvgLatency() {
+	dword total = 0;
+
+	for (uint8_t i = 0; i < mCount; ++i) {
+		total += mWindow[i].latency;
+	}
+
+	return mCount == 0 ? 0 : total / mCount;
+}
+
+/**
+ * Retrieves the error rate over the rolling window.
+ *
+ * @return The percentage of commands in the window which failed
+ */
+uint8_t FingerprintWatchdog::getErrorRate() {
+	uint8_t errors = 0;
+
+	for (uint8_t i = 0; i < mCount; ++i) {
+		errors += mWindow[i].error;
+	}
+
+	return mCount == 0 ? 0 : (errors * 100) / mCount;
+}
+
+/**
+ * Retrieves the running average latency of a command.
+ *
+ * @param cmd The command code
+ *
+ * @return The average latency in milliseconds, 0 if the command wasn't seen
+ */
+dword FingerprintWatchdog::getCommandLatency(word cmd) {
+	for (uint8_t i = 0; i < mCmdCount; ++i) {
+		if (mCmd[i].cmd == cmd) {
+			return mCmd[i].avg;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Retrieves the number of times an SLO was breached.
+ *
+ * @return The number of breaches
+ */
+dword FingerprintWatchdog::getBreachCount() {
+	return mBreaches;
+}
+
+/**
+ * Retrieves the number of breaches the recovery ladder recovered from.
+ *
+ * @return The number of successful recoveries
+ */
+dword FingerprintWatchdog::getRecoveryCount() {
+	return mRecoveries;
+}
+
+/**
+ * Retrieves the number of breaches the recovery ladder could not recover from.
+ *
+ * @return The number of failed recoveries
+ */
+dword FingerprintWatchdog::getFailedRecoveryCount() {
+	return mFailures;
+}
+
+/**
+ * Retrieves the time taken by the last run of the recovery ladder.
+ *
+ * @return The time in milliseconds
+ */
+dword FingerprintWatchdog::getLastRecoveryTime() {
+	return mLastRecoveryTime;
+}
+
+/**
+ * Retrieves the longest time taken by a successful recovery.
+ *
+ * @return The time in milliseconds
+ */
+dword FingerprintWatchdog::getMaxRecoveryTime() {
+	return mMaxRecoveryTime;
+}
+
+/**
+ * Retrieves the step which ended the last run of the recovery ladder.
+ *
+ * @return The step which recovered the sensor, or RECOVERY_FAILED
+ */
+RECOVERY_STEP FingerprintWatchdog::getLastRecoveryStep() {
+	return mLastStep;
+}
+
+// END PUBLIC
+
+// BEGIN PRIVATE
+
+/**
+ * The command observer registered with the module, forwarding to record().
+ *
+ * @param cmd The command code
+ * @param ok Whether the command was acknowledged
+ * @param param The response parameter or error code
+ * @param latency Time from command to outcome in milliseconds
+ * @param ctx The watchdog
+ */
+void FingerprintWatchdog::observe(word cmd, bool ok, dword param, dword latency, void* ctx) {
+	((FingerprintWatchdog*) ctx)->record(cmd, ok, param, latency);
+}
+
+/**
+ * Checks whether an error code means the link or the device failed, as
+ * opposed to a refusal which is part of normal use.
+ *
+ * @param err The error code
+ *
+ * @return True for a link or device failure, false otherwise
+ */
+bool FingerprintWatchdog::isLinkError(dword err) {
+	switch (err) {
+		case NACK_NOT_RECVD:
+		case NACK_COMM_ERR:
+		case NACK_DEV_ERR:
+		case NACK_BAD_HEADER:
+		case NACK_BAD_ID:
+		case NACK_BAD_CHKSUM:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+/**
+ * Adds a completed command to the rolling window and to its command's
+ * running average, unless it was cancelled, ran out of time, found the sensor
+ * detached or is part of a recovery.
+ *
+ * @param cmd The command code
+ * @param ok Whether the command was acknowledged
+ * @param param The response parameter or error code
+ * @param latency Time from command to outcome in milliseconds
+ */
+void FingerprintWatchdog::record(word cmd, bool ok, dword param, dword latency) {
+	uint8_t i;	// Index of the command's running average
+
+	if (mRecovering || (!ok && (param == NACK_CANCELLED || param == NACK_DEADLINE_EXCEEDED || param == NACK_DETACHED))) {
+		return;
+	}
+
+	mWindow[mNext].latency = latency;
+	mWindow[mNext].error = !ok && isLinkError(param);
+	mNext = (mNext + 1) % WD_WINDOW;
+	if (mCount < WD_WINDOW) {
+		++mCount;
+	}
+
+	// Find the command's slot, taking a new one if there's room
+	for (i = 0; i < mCmdCount && mCmd[i].cmd != cmd; ++i);
+
+	if (i == mCmdCount && mCmdCount < WD_CMD_SLOTS) {
+		mCmd[i].cmd = cmd;
+		mCmd[i].avg = latency;
+		++mCmdCount;
+	} else if (i < mCmdCount) {
+		mCmd[i].avg = mCmd[i].avg - mCmd[i].avg / 8 + latency / 8;
+	}
+}
+
+/**
+ * Runs the recovery ladder, stopping at the first step which brings the
+ * sensor back.
+ *
+ * @return The step which recovered the sensor, or RECOVERY_FAILED
+ */
+RECOVERY_STEP FingerprintWatchdog::recover() {
+	byte serial[SERIAL_NUM_SIZE];			// The serial number of the sensor before recovery
+	RECOVERY_STEP step = RECOVERY_FAILED;	// The step which recovered the sensor
+
+	memcpy(serial, mModule.getSerialNumber(), SERIAL_NUM_SIZE);
+	mRecovering = true;
+
+	if (mModule.resync()) {
+		step = RECOVERY_RESYNC;
+	} else {
+		mModule.close();
+
+		if (mModule.open(true)) {
+			step = RECOVERY_REOPEN;
+		} else if (mModule.reconnect(mModule.getBaudrate(), serial)) {
+			step = RECOVERY_RENEGOTIATE;
+		}
+	}
+
+	mRecovering = false;
+
+	#ifdef DEBUG
+		Serial.print(F("Watchdog recovery ended at step "));
+		Serial.println(step);
+	#endif
+
+	return step;
+}
@@ -0,0 +1,87 @@
+#ifndef FINGERPRINT_WATCHDOG_H
+#define FINGERPRINT_WATCHDOG_H
+
+/* Includes */
+#include "FingerprintModule.h"
+
+/* Symbolic constants */
+// The number of most recent commands the latency and error rate are computed over
+#define WD_WINDOW 16
+
+// The number of commands needed in the window before the SLOs are enforced
+#define WD_MIN_SAMPLES 8
+
+// The number of distinct commands whose average latency is tracked
+#define WD_CMD_SLOTS 8
+
+// The default highest acceptable average latency in milliseconds. A high quality capture, the slowest
+// command in normal use, takes about 750 ms and the response is picked up within ABORT_POLL_TIME of
+// arriving, which leaves a quarter of headroom
+#define WD_LATENCY_SLO 1000
+
+/* Enumerations */
+// The steps of the recovery ladder, in the order they are tried
+enum RECOVERY_STEP {
+	RECOVERY_NONE,			// No recovery was needed
+	RECOVERY_RESYNC,		// Flushing the receive buffer was enough
+	RECOVERY_REOPEN,		// The sensor had to be closed and opened again
+	RECOVERY_RENEGOTIATE,	// The baudrate had to be found again with reconnect()
+	RECOVERY_FAILED			// Nothing brought the sensor back
+};
+
+/* Class definition */
+// Watches the latency and error rate of a fingerprint module and recovers it when they degrade
+class FingerprintWatchdog {
+	private:
+		// One command in the rolling window
+		struct Sample {
+			dword latency;					// Time from command to outcome in milliseconds
+			bool error;						// True if the command failed on a link or device error
+		};
+
+		// The running average latency of one command
+		struct CmdLatency {
+			word cmd;						// The command code
+			dword avg;						// Exponentially weighted average latency in milliseconds
+		};
+
+		FingerprintModule& mModule;			// The module being watched
+		Sample mWindow[WD_WINDOW];			// Ring of the most recent commands
+		uint8_t mNext;						// Index of the next sample to write
+		uint8_t mCount;						// Number of samples in the window
+		CmdLatency mCmd[WD_CMD_SLOTS];		// Average latency per command
+		uint8_t mCmdCount;					// Number of slots of mCmd in use
+		dword mLatencySLO;					// Highest acceptable average latency in milliseconds
+		uint8_t mErrorSLO;					// Highest acceptable error rate in percent
+		bool mRecovering;					// True while the recovery ladder runs, so its own commands aren't sampled
+		dword mBreaches;					// Number of times an SLO was breached
+		dword mRecoveries;					// Number of successful recoveries
+		dword mFailures;					// Number of recoveries which failed
+		dword mLastRecoveryTime;			// Time taken by the last recovery in milliseconds
+		dword mMaxRecoveryTime;				// Longest recovery in milliseconds
+		RECOVERY_STEP mLastStep;			// The step which ended the last recovery
+
+		static void observe(word, bool, dword, dword, void*);
+		static bool isLinkError(dword);
+		void record(word, bool, dword, dword);
+		RECOVERY_STEP recover();
+
+	public:
+		FingerprintWatchdog(FingerprintModule&, dword latencySLO = WD_LATENCY_SLO, uint8_t errorSLO = 25);
+
+		void begin();
+		bool check();
+		void clear();
+
+		dword getAvgLatency();
+		uint8_t getErrorRate();
+		dword getCommandLatency(word);
+		dword getBreachCount();
+		dword getRecoveryCount();
+		dword getFailedRecoveryCount();
+		dword getLastRecoveryTime();
+		dword getMaxRecoveryTime();
+		RECOVERY_STEP getLastRecoveryStep();
+};
+
+#endif
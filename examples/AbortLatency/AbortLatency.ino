@@ -0,0 +1,244 @@
+/**
+ * Abort latency check: cancels and times out commands on an emulated sensor at
+ * each point where that can happen, directly and through a FingerprintScheduler
+ * preempting a background job, and checks that the command which follows gets
+ * the right reply without waiting longer than it has to.
+ *
+ * Notes:
+ *	-	No sensor is needed: the module talks to a FingerprintEmulator on a
+ *		FingerprintVirtualClock, so the latencies printed are those of the sensor.
+ *	-	A command cancelled before it is sent leaves nothing on the line, so the next
+ *		command must run at once. A command cancelled while its reply is on the way
+ *		leaves that reply to come and go first, so the next command may wait for it,
+ *		but no longer, and must not take it for its own.
+ *	-	Commands which never reached the sensor must not be reported to the command
+ *		observer, which is what a FingerprintWatchdog and the metrics are fed from.
+ *	-	An interactive job preempting a background one must start as soon as the line is
+ *		clear, and the scheduler's queueing delay must include any wait for it to clear.
+ *	-	Comment out DEBUG in FingerprintModule.h first, or the debug messages will
+ *		swamp the report.
+ */
+
+// Includes
+#include <FingerprintModule.h>
+#include <FingerprintEmulator.h>
+#include <FingerprintScheduler.h>
+
+// The longest a command may take when nothing was left on the line, in milliseconds
+#define ABORT_MAX_CLEAN 100
+
+// The longest a command may take after one whose reply was still on the way, in milliseconds
+#define ABORT_MAX_SETTLED 1500
+
+// When the token is raised once a capture has been sent, in milliseconds
+#define ABORT_CANCEL_AFTER 100
+
+// A clock which calls a function once a set time is reached, as an interrupt would
+class EventClock : public FingerprintVirtualClock {
+	public:
+		void (*event)();			// The function to call
+		unsigned long eventAt;		// Time at which to call it, 0 for never
+
+		EventClock() : event(0x00), eventAt(0) {}
+
+		void delay(dword ms) {
+			FingerprintVirtualClock::delay(ms);
+			if (eventAt != 0 && millis() >= eventAt) {
+				eventAt = 0;
+				event();
+			}
+		}
+};
+
+EventClock simClock;
+FingerprintEmulator emu(simClock);
+FingerprintModule fpm;
+FingerprintScheduler sched(fpm);
+
+volatile bool token;		// The cancellation token handed to the module outside the scheduler
+dword reported;				// Number of commands handed to the command observer
+bool passed;				// False once any check failed
+bool userBetween;			// True to have the background job preempted between two of its commands
+unsigned long submittedAt;	// Time at which the interactive job was submitted
+unsigned long answeredAt;	// Time at which the interactive job got its reply
+
+/**
+ * Counts the commands the module reports.
+ *
+ * @param cmd The command code
+ * @param ok Whether the command was acknowledged
+ * @param param The response parameter or error code
+ * @param latency Time from command to outcome in milliseconds
+ * @param ctx Unused
+ */
+void countReported(word, bool, dword, dword, void*) {
+	++reported;
+}
+
+/**
+ * Raises the cancellation token.
+ */
+void cancel() {
+	token = true;
+}
+
+/**
+ * The interactive job, noting when it gets its reply.
+ *
+ * @param m The module
+ * @param ctx Unused
+ *
+ * @return True if the sensor answered
+ */
+bool interactiveJob(FingerprintModule& m, void*) {
+	bool ok = m.getEnrollCount();
+
+	answeredAt = simClock.millis();
+
+	return ok;
+}
+
+/**
+ * Submits the interactive job, as a user turning up would.
+ */
+void userArrives() {
+	submittedAt = simClock.millis();
+	sched.submit(interactiveJob);
+}
+
+/**
+ * A background job of several commands, preempted between two of them if
+ * asked to.
+ *
+ * @param m The module
+ * @param ctx Unused
+ *
+ * @return True if every command succeeded
+ */
+bool backgroundJob(FingerprintModule& m, void*) {
+	if (!m.getEnrollCount()) {
+		return false;
+	}
+
+	if (userBetween) {
+		userBetween = false;
+		userArrives();
+	}
+
+	return m.captureFingerprint() && m.getEnrollCount();
+}
+
+/**
+ * Runs a background job which gets preempted, then the interactive job, then
+ * the background job again, and checks how long the user waited for the
+ * interactive job's reply. Besides its own command, which takes well under
+ * ABORT_MAX_CLEAN, all of that wait must show in the scheduler's delay.
+ *
+ * @param limit The longest the user may wait in milliseconds
+ *
+ * @return True if the reply came in time and the wait was reported, false otherwise
+ */
+bool interactiveWithin(dword limit) {
+	dword waited;
+
+	sched.submit(backgroundJob, 0x00, PRIORITY_BACKGROUND);
+	for (uint8_t i = 0; i < 3 && !sched.isIdle(); ++i) {
+		sched.run();
+	}
+	waited = answeredAt - submittedAt;
+
+	Serial.print(F("\tuser waited "));
+	Serial.print(waited);
+	Serial.print(F(" ms, the scheduler reports "));
+	Serial.print(sched.getMaxQueueDelay(PRIORITY_INTERACTIVE));
+	Serial.println(F(" ms"));
+
+	return sched.isIdle() && waited <= limit && sched.getMaxQueueDelay(PRIORITY_INTERACTIVE) + ABORT_MAX_CLEAN >= waited;
+}
+
+/**
+ * Prints the outcome of a check and notes a failure.
+ *
+ * @param what What was checked
+ * @param ok Whether the check passed
+ */
+void check(const __FlashStringHelper* what, bool ok) {
+	Serial.print(ok ? F("ok\t") : F("FAIL\t"));
+	Serial.println(what);
+	passed = passed && ok;
+}
+
+/**
+ * Runs a command which has to get the right reply, timing it.
+ *
+ * @param limit The longest it may take in milliseconds
+ *
+ * @return True if it got the right reply in time, false otherwise
+ */
+bool nextCommandWithin(dword limit) {
+	unsigned long start = simClock.millis();
+	bool ok = fpm.getEnrollCount() && fpm.getResponseParam() == 1;
+	dword took = simClock.millis() - start;
+
+	Serial.print(F("\tnext command took "));
+	Serial.print(took);
+	Serial.println(F(" ms"));
+
+	return ok && took <= limit;
+}
+
+void setup() {
+	dword before;
+
+	Serial.begin(115200);
+	while (!Serial);
+
+	emu.setUart(115200);
+	emu.enroll(0, 1);
+	fpm.setStream(&emu);
+	fpm.setClock(&simClock);
+	fpm.setCommandObserver(countReported);
+	fpm.setCancelToken(&token);
+	simClock.event = cancel;
+	passed = fpm.open(true);
+
+	// Cancelled before anything is sent
+	token = true;
+	before = reported;
+	check(F("a command cancelled before it is sent fails with NACK_CANCELLED"), !fpm.getEnrollCount() && fpm.getErrorCode() == NACK_CANCELLED);
+	check(F("a command cancelled before it is sent isn't reported"), reported == before);
+	token = false;
+	check(F("the next command runs at once"), nextCommandWithin(ABORT_MAX_CLEAN));
+
+	// Out of time before anything is sent
+	fpm.setDeadline(0);
+	before = reported;
+	check(F("a command past its deadline before it is sent fails with NACK_DEADLINE_EXCEEDED"), !fpm.getEnrollCount() && fpm.getErrorCode() == NACK_DEADLINE_EXCEEDED);
+	check(F("a command past its deadline before it is sent isn't reported"), reported == before);
+	fpm.clearDeadline();
+	check(F("the next command runs at once"), nextCommandWithin(ABORT_MAX_CLEAN));
+
+	// Cancelled while the reply is on the way
+	emu.setFinger(1);
+	simClock.eventAt = simClock.millis() + ABORT_CANCEL_AFTER;
+	check(F("a capture cancelled while it runs fails with NACK_CANCELLED"), !fpm.captureFingerprint() && fpm.getErrorCode() == NACK_CANCELLED);
+	token = false;
+	check(F("the next command waits out the capture's reply and gets its own"), nextCommandWithin(ABORT_MAX_SETTLED));
+
+	// The scheduler owns the cancellation token from here on
+	fpm.setCancelToken(0x00);
+
+	// A user turns up between two commands of a background job
+	userBetween = true;
+	check(F("an interactive job preempting between commands is answered at once"), interactiveWithin(ABORT_MAX_CLEAN));
+
+	// A user turns up while a background job's capture runs
+	simClock.event = userArrives;
+	simClock.eventAt = simClock.millis() + ABORT_CANCEL_AFTER * 2;
+	check(F("an interactive job preempting a capture is answered once its reply clears, and the wait is reported"), interactiveWithin(ABORT_MAX_SETTLED));
+
+	Serial.println(passed ? F("Abort latency check PASSED") : F("Abort latency check FAILED"));
+}
+
+void loop() {
+}
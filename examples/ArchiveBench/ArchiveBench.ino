@@ -0,0 +1,212 @@
+/**
+ * Archive benchmark: fills an image archive on an SD card with captures from an emulated
+ * sensor, then measures how fast images are written, how fast the index is scanned, and
+ * how fast archived images are read back at random and streamed in full.
+ *
+ * Notes:
+ *	-	Needs an SD card on the SPI bus with its chip select on ARCHIVE_CS. The files
+ *		FPDATA.BIN and FPINDEX.BIN are deleted and re-created on every run.
+ *	-	Images come from a FingerprintEmulator on a virtual clock, so they arrive as fast
+ *		as the board can copy them. Only the time spent in the archive is measured.
+ *	-	The archive is reopened before reading, which checks the headers and shows how an
+ *		existing archive is picked up after a reset.
+ *	-	Each FingerprintModule holds a 51,846-byte data buffer, so this needs a board with
+ *		plenty of RAM. Comment out DEBUG in FingerprintModule.h first.
+ */
+
+// Includes
+#include <SPI.h>
+#include <SD.h>
+#include <FingerprintModule.h>
+#include <FingerprintEmulator.h>
+#include <FingerprintArchive.h>
+
+// The chip select pin of the SD card
+#define ARCHIVE_CS 10
+
+// The number of images archived, and of random reads made
+#define BENCH_IMAGES 50
+#define BENCH_READS 200
+
+// The width of a row of an image, the unit of the random reads
+#define BENCH_ROW 240
+
+// A file on the SD card used as archive storage
+class FileStorage : public FingerprintStorage {
+	private:
+		File mFile;		// The open file
+
+	public:
+		void attach(File file) {
+			mFile = file;
+		}
+
+		dword size() {
+			return mFile.size();
+		}
+
+		bool read(dword pos, byte* buf, dword len) {
+			return mFile.seek(pos) && mFile.read(buf, len) == (int) len;
+		}
+
+		bool append(const byte* buf, dword len) {
+			return mFile.seek(mFile.size()) && mFile.write(buf, len) == len;
+		}
+
+		void flush() {
+			mFile.flush();
+		}
+
+		void close() {
+			mFile.close();
+		}
+};
+
+// An output which only counts what is written to it
+class CountingSink : public Print {
+	public:
+		dword count;	// Number of bytes written
+
+		size_t write(uint8_t) {
+			++count;
+			return 1;
+		}
+
+		size_t write(const uint8_t*, size_t size) {
+			count += size;
+			return size;
+		}
+};
+
+FingerprintVirtualClock simClock;
+FingerprintEmulator emu(simClock);
+FingerprintModule fpm;
+FileStorage dataFile;
+FileStorage indexFile;
+
+/**
+ * Opens the archive files, optionally deleting them first.
+ *
+ * @param fresh True to start from empty files
+ */
+void openFiles(bool fresh) {
+	if (fresh) {
+		SD.remove("FPDATA.BIN");
+		SD.remove("FPINDEX.BIN");
+	}
+
+	dataFile.attach(SD.open("FPDATA.BIN", FILE_WRITE));
+	indexFile.attach(SD.open("FPINDEX.BIN", FILE_WRITE));
+}
+
+/**
+ * Prints a throughput.
+ *
+ * @param label What was measured
+ * @param count The number of items
+ * @param bytes The number of bytes moved
+ * @param us The time taken in microseconds
+ */
+void printRate(const __FlashStringHelper* label, dword count, dword bytes, unsigned long us) {
+	Serial.print(label);
+	Serial.print(count);
+	Serial.print(F(" in "));
+	Serial.print(us / 1000.0, 1);
+	Serial.print(F(" ms, "));
+	Serial.print(us > 0 ? count * 1000000.0 / us : 0.0, 1);
+	Serial.print(F("/s, "));
+	Serial.print(us > 0 ? bytes / (float) us : 0.0, 3);
+	Serial.println(F(" MB/s"));
+}
+
+void setup() {
+	ArchiveEntry entry;
+	CountingSink sink;
+	unsigned long spent = 0;	// Time spent in the archive in microseconds
+	unsigned long t;
+	dword matches = 0;
+	dword bytes = 0;
+	byte row[BENCH_ROW];
+
+	Serial.begin(115200);
+	while (!Serial);
+
+	if (!SD.begin(ARCHIVE_CS)) {
+		Serial.println(F("No SD card"));
+		return;
+	}
+
+	emu.setUart(115200);
+	emu.setFifoSize(EMU_FIFO_MAX);
+	fpm.setStream(&emu);
+	fpm.setClock(&simClock);
+	fpm.open(true);
+
+	// Archive images captured from a few fingers
+	openFiles(true);
+	{
+		FingerprintArchive archive(dataFile, indexFile);
+
+		if (!archive.begin()) {
+			Serial.println(F("Could not start the archive"));
+			return;
+		}
+
+		for (uint16_t i = 0; i < BENCH_IMAGES; ++i) {
+			emu.setFinger(i % 10);
+
+			if (fpm.captureFingerprint() && fpm.getImage()) {
+				t = micros();
+				if (!archive.append(0, i % 10, simClock.millis() / 1000, 100, fpm.getData(), IMAGE_SIZE)) {
+					Serial.println(F("Archive full"));
+					break;
+				}
+				spent += micros() - t;
+			}
+		}
+
+		printRate(F("Written:   "), archive.getCount(), archive.getCount() * (IMAGE_SIZE + ARC_RECORD_HEADER_SIZE + ARC_INDEX_ENTRY_SIZE), spent);
+	}
+	dataFile.close();
+	indexFile.close();
+
+	openFiles(false);
+	FingerprintArchive archive(dataFile, indexFile);
+
+	if (!archive.begin()) {
+		Serial.println(F("Could not reopen the archive"));
+		return;
+	}
+
+	// Scan the whole index for the images of one finger
+	t = micros();
+	archive.rewind();
+	while (archive.next(entry)) {
+		matches += (entry.id == 3);
+	}
+	printRate(F("Scanned:   "), archive.getCount(), archive.getCount() * ARC_INDEX_ENTRY_SIZE, micros() - t);
+	Serial.print(F("           "));
+	Serial.print(matches);
+	Serial.println(F(" images of ID 3"));
+
+	// Read single rows of random images
+	t = micros();
+	for (uint16_t i = 0; i < BENCH_READS; ++i) {
+		if (archive.getEntry(random(archive.getCount()), entry) && archive.readImage(entry, random(IMAGE_SIZE / BENCH_ROW) * BENCH_ROW, row, BENCH_ROW)) {
+			bytes += BENCH_ROW;
+		}
+	}
+	printRate(F("Row reads: "), BENCH_READS, bytes, micros() - t);
+
+	// Stream every image in full
+	sink.count = 0;
+	t = micros();
+	archive.rewind();
+	while (archive.next(entry)) {
+		archive.streamImage(entry, sink);
+	}
+	printRate(F("Streamed:  "), archive.getCount(), sink.count, micros() - t);
+}
+
+void loop() {
+}
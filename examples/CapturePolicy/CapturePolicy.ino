@@ -0,0 +1,209 @@
+/**
+ * Capture policy benchmark: identifies the fingers of a small gallery with high quality
+ * captures only, with low quality captures escalating to high quality when they fail,
+ * and with the adaptive FingerprintCapturePolicy, to compare how often each finds the
+ * right finger and how long a person waits for it, on a clean and on a dirty sensor.
+ *
+ * Notes:
+ *	-	The trials run against a FingerprintEmulator on a virtual clock. setLowQualityErrors()
+ *		sets how much worse its low quality captures are: on the clean sensor few of them
+ *		fail, on the dirty one most do, which is when starting at high quality pays.
+ *	-	The last run keeps one adaptive policy across a clean, a dirty and a clean sensor
+ *		again, to show it changing its starting quality as conditions change.
+ *	-	Enrollment is done by enrollSequence(), at high quality, whatever the policy.
+ *	-	Comment out DEBUG in FingerprintModule.h first, or the debug messages will swamp
+ *		the report.
+ */
+
+// Includes
+#include <FingerprintModule.h>
+#include <FingerprintEmulator.h>
+#include <FingerprintCapturePolicy.h>
+
+// The number of enrolled fingers
+#define GALLERY_SIZE 10
+
+// The number of identifications per run
+#define POLICY_TRIALS 200
+
+// The matching errors the emulated sensor makes on any capture, per thousand
+#define SENSOR_FALSE_REJECT 20
+#define SENSOR_FALSE_ACCEPT 2
+
+// How much worse low quality captures are on each sensor, per thousand
+struct SensorCondition {
+	const char* name;		// What the sensor is like
+	uint16_t badFinger;		// Low quality captures refused as a bad finger
+	uint16_t falseReject;	// Extra genuine matches refused on low quality captures
+};
+
+const SensorCondition conditions[] = {
+	{ "clean", 50, 60 },
+	{ "dirty", 450, 250 }
+};
+
+// The ways of capturing compared
+enum Strategy {
+	ALWAYS_HIGH,
+	LOW_ESCALATING,
+	ADAPTIVE
+};
+
+FingerprintVirtualClock simClock;
+FingerprintEmulator emu(simClock);
+FingerprintModule fpm;
+FingerprintCapturePolicy policy(fpm);
+int16_t enrolling;		// The finger being enrolled
+
+/**
+ * Lifts the emulated finger when an enrollment asks for it to be removed and
+ * puts it back for the next capture, as a person would.
+ *
+ * @param evt What happened
+ * @param ctx Unused
+ */
+void onEnroll(const EnrollEvent& evt, void*) {
+	if (evt.type == ENROLL_STATE_CHANGE) {
+		if (evt.state == REMOVE_FINGER) {
+			emu.setFinger(EMU_NO_FINGER);
+		} else if (evt.state == CAPTURE) {
+			emu.setFinger(enrolling);
+		}
+	}
+}
+
+/**
+ * Places a finger and identifies it the given way.
+ *
+ * @param finger The finger to present
+ * @param strategy How to capture it
+ *
+ * @return True if the finger was identified as itself
+ */
+bool trial(int16_t finger, Strategy strategy) {
+	bool ok;
+
+	emu.setFinger(finger);
+	if (strategy == ALWAYS_HIGH) {
+		ok = fpm.captureFingerprint(true) && fpm.identify();
+	} else {
+		ok = policy.identify();
+	}
+	emu.setFinger(EMU_NO_FINGER);
+
+	return ok && fpm.getResponseParam() == (dword) finger;
+}
+
+/**
+ * Runs a series of identifications and prints how they went.
+ *
+ * @param label What the run is
+ * @param strategy How to capture
+ */
+void run(const __FlashStringHelper* label, Strategy strategy) {
+	unsigned long t = simClock.millis();
+	dword escalations = policy.getEscalationCount();
+	dword hits = 0;
+
+	for (uint16_t i = 0; i < POLICY_TRIALS; ++i) {
+		hits += trial(i % GALLERY_SIZE, strategy);
+	}
+	t = simClock.millis() - t;
+
+	Serial.print(F("  "));
+	Serial.print(label);
+	Serial.print(F("hit "));
+	Serial.print(hits * 100.0 / POLICY_TRIALS, 1);
+	Serial.print(F("%  "));
+	Serial.print(t / POLICY_TRIALS);
+	Serial.print(F(" ms/identify  escalated "));
+	Serial.print(policy.getEscalationCount() - escalations);
+	Serial.print(F("  next starts "));
+	Serial.println(strategy == ALWAYS_HIGH || policy.getStartMode() == CAPTURE_HIGH ? F("high") : F("low"));
+}
+
+/**
+ * Prints what the policy saw of one capture quality.
+ *
+ * @param label The quality
+ * @param mode The quality
+ */
+void printMode(const __FlashStringHelper* label, CAPTURE_MODE mode) {
+	Serial.print(F("    "));
+	Serial.print(label);
+	Serial.print(policy.getCaptureCount(mode));
+	Serial.print(F(" captures, "));
+	Serial.print(policy.getCaptureSuccessRate(mode));
+	Serial.print(F("% captured, "));
+	Serial.print(policy.getMatchRate(mode));
+	Serial.print(F("% matched, capture "));
+	Serial.print(policy.getAvgCaptureLatency(mode));
+	Serial.print(F(" ms, attempt "));
+	Serial.print(policy.getAvgAttemptTime(mode));
+	Serial.println(F(" ms"));
+}
+
+/**
+ * Sets how much worse the emulated sensor's low quality captures are.
+ *
+ * @param condition The sensor condition
+ */
+void setCondition(const SensorCondition& condition) {
+	emu.setLowQualityErrors(condition.badFinger, condition.falseReject);
+}
+
+void setup() {
+	Serial.begin(115200);
+	while (!Serial);
+
+	emu.setUart(115200);
+	emu.setFifoSize(EMU_FIFO_MAX);
+	emu.setMatchErrors(SENSOR_FALSE_REJECT, SENSOR_FALSE_ACCEPT);
+	fpm.setStream(&emu);
+	fpm.setClock(&simClock);
+	if (!fpm.open(true)) {
+		Serial.println(F("Open failed"));
+		return;
+	}
+
+	fpm.deleteAll();
+	for (enrolling = 0; enrolling < GALLERY_SIZE; ++enrolling) {
+		emu.setFinger(enrolling);
+		if (!fpm.enrollSequence(enrolling, onEnroll)) {
+			Serial.println(F("Enrollment failed"));
+			return;
+		}
+	}
+	emu.setFinger(EMU_NO_FINGER);
+
+	for (uint8_t c = 0; c < sizeof(conditions) / sizeof(conditions[0]); ++c) {
+		Serial.print(F("Sensor "));
+		Serial.println(conditions[c].name);
+		setCondition(conditions[c]);
+
+		run(F("always high     "), ALWAYS_HIGH);
+
+		policy.clear();
+		policy.setAdaptive(false);
+		run(F("low, escalating "), LOW_ESCALATING);
+
+		policy.clear();
+		policy.setAdaptive(true);
+		run(F("adaptive        "), ADAPTIVE);
+		printMode(F("low  "), CAPTURE_LOW);
+		printMode(F("high "), CAPTURE_HIGH);
+	}
+
+	// One policy through changing conditions
+	Serial.println(F("Sensor clean, dirty, clean"));
+	policy.clear();
+	setCondition(conditions[0]);
+	run(F("adaptive clean  "), ADAPTIVE);
+	setCondition(conditions[1]);
+	run(F("adaptive dirty  "), ADAPTIVE);
+	setCondition(conditions[0]);
+	run(F("adaptive clean  "), ADAPTIVE);
+}
+
+void loop() {
+}
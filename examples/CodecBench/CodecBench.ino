@@ -0,0 +1,150 @@
+/**
+ * Codec benchmark: compresses fingerprint images with FingerprintEncoder, checks that
+ * FingerprintDecoder gives back every pixel, and reports the compression ratio and the
+ * encode and decode speed, as well as what the compression saves on a slow link.
+ *
+ * Notes:
+ *	-	Images come from a FingerprintEmulator on a virtual clock. To measure real
+ *		captures, remove setStream() and setClock() and wire a sensor to COMMS.
+ *	-	The first image of each finger is also compressed straight off the serial line
+ *		with getImage(encoder), which needs no image-sized buffer at all.
+ *	-	Each FingerprintModule holds a 51,846-byte data buffer, and this sketch keeps a
+ *		compressed and a decompressed copy of an image, so it needs a board with plenty
+ *		of RAM. Comment out DEBUG in FingerprintModule.h first.
+ */
+
+// Includes
+#include <FingerprintModule.h>
+#include <FingerprintEmulator.h>
+#include <FingerprintCodec.h>
+
+// The number of fingers whose images are compressed
+#define BENCH_FINGERS 5
+
+// The speed of the link images are sent over, in bits per second
+#define BENCH_LINK_BPS 115200
+
+// An output writing to a buffer, failing once the buffer is full
+class BufferSink : public Print {
+	public:
+		byte* buf;		// The buffer
+		dword capacity;	// The size of the buffer
+		dword count;	// Number of bytes written
+
+		BufferSink(byte* b, dword c) : buf(b), capacity(c), count(0) {
+		}
+
+		size_t write(uint8_t b) {
+			if (count == capacity) {
+				return 0;
+			}
+
+			buf[count++] = b;
+			return 1;
+		}
+
+		using Print::write;
+};
+
+FingerprintVirtualClock simClock;
+FingerprintEmulator emu(simClock);
+FingerprintModule fpm;
+byte packed[IMAGE_SIZE];	// A compressed image, which must come out smaller than the original
+byte unpacked[IMAGE_SIZE];	// The same image decompressed
+
+void setup() {
+	dword rawTotal = 0;				// Bytes before compression
+	dword packedTotal = 0;			// Bytes after compression
+	uint8_t images = 0;				// Number of images compressed
+	unsigned long encodeTime = 0;	// Time spent compressing in microseconds
+	unsigned long decodeTime = 0;	// Time spent decompressing in microseconds
+	unsigned long t;
+
+	Serial.begin(115200);
+	while (!Serial);
+
+	emu.setUart(115200);
+	emu.setFifoSize(EMU_FIFO_MAX);
+	fpm.setStream(&emu);
+	fpm.setClock(&simClock);
+	fpm.open(true);
+
+	for (uint8_t finger = 0; finger < BENCH_FINGERS; ++finger) {
+		BufferSink packedSink(packed, sizeof(packed));
+		BufferSink unpackedSink(unpacked, sizeof(unpacked));
+		FingerprintEncoder encoder(packedSink);
+		FingerprintDecoder decoder(unpackedSink);
+
+		emu.setFinger(finger);
+		if (!fpm.captureFingerprint()) {
+			continue;
+		}
+
+		// Compress the image as it arrives
+		encoder.begin(240, 216);
+		if (fpm.getImage(encoder) && encoder.finish()) {
+			Serial.print(F("Finger "));
+			Serial.print(finger);
+			Serial.print(F(": compressed on download to "));
+			Serial.print(encoder.getEncodedSize());
+			Serial.println(F(" bytes"));
+		}
+
+		// Then time both directions on a buffered copy
+		if (!fpm.getImage()) {
+			continue;
+		}
+
+		packedSink.count = 0;
+		t = micros();
+		encoder.begin(240, 216);
+		encoder.write(fpm.getData(), IMAGE_SIZE);
+		if (!encoder.finish() || encoder.getEncodedSize() > sizeof(packed)) {
+			Serial.println(F("  does not compress, skipped"));
+			continue;
+		}
+		encodeTime += micros() - t;
+
+		t = micros();
+		decoder.begin();
+		decoder.write(packed, packedSink.count);
+		decodeTime += micros() - t;
+
+		if (!decoder.isDone() || memcmp(unpacked, fpm.getData(), IMAGE_SIZE) != 0) {
+			Serial.println(F("  MISMATCH after decompression"));
+			return;
+		}
+
+		rawTotal += IMAGE_SIZE;
+		packedTotal += packedSink.count;
+		++images;
+	}
+
+	if (packedTotal == 0) {
+		Serial.println(F("No image compressed"));
+		return;
+	}
+
+	Serial.print(F("Ratio "));
+	Serial.print(rawTotal / (float) packedTotal, 2);
+	Serial.print(F(" ("));
+	Serial.print(packedTotal * 8.0 / rawTotal, 2);
+	Serial.println(F(" bits per pixel)"));
+
+	Serial.print(F("Encode "));
+	Serial.print(encodeTime > 0 ? rawTotal / (float) encodeTime : 0.0, 3);
+	Serial.print(F(" MB/s, decode "));
+	Serial.print(decodeTime > 0 ? rawTotal / (float) decodeTime : 0.0, 3);
+	Serial.println(F(" MB/s"));
+
+	Serial.print(F("At "));
+	Serial.print(BENCH_LINK_BPS);
+	Serial.print(F(" bps an image takes "));
+	Serial.print(IMAGE_SIZE * 10.0 / BENCH_LINK_BPS, 2);
+	Serial.print(F(" s raw, "));
+	Serial.print(packedTotal * 10.0 / images / BENCH_LINK_BPS, 2);
+	Serial.println(F(" s compressed"));
+}
+
+void loop() {
+}
@@ -0,0 +1,192 @@
+/**
+ * Footprint report: prints how much RAM each part of the driver takes in the configuration
+ * it was built with, how much flash and RAM the whole sketch uses, and a one-line summary
+ * to keep per configuration and per commit, so growth shows up as soon as it happens.
+ *
+ * Notes:
+ *	-	The configuration is set by the macros at the top of FingerprintModule.h, each of
+ *		which can also be given on the command line. To report every configuration, build
+ *		this sketch once per set of flags and keep the summary lines, e.g. with arduino-cli:
+ *
+ *			arduino-cli compile -b arduino:avr:mega --build-property \
+ *				"compiler.cpp.extra_flags=-DDATA_BUFFER_SIZE=504 -DFLIGHT_RECORDER_SIZE=0 -DFINGERPRINT_NO_DEBUG" \
+ *				examples/Footprint
+ *
+ *		Add -DFOOTPRINT_TAG=\"<commit>\" to label the summary line with the commit built.
+ *	-	Budgets are checked twice: FINGERPRINT_RAM_BUDGET in FingerprintModule.h and
+ *		FOOTPRINT_DRIVER_BUDGET below fail the build when the driver grows past them, and
+ *		FOOTPRINT_FLASH_BUDGET and FOOTPRINT_FREE_RAM are checked when the sketch runs,
+ *		since only the linker knows the final sizes.
+ *	-	Flash and static RAM are read from linker symbols on AVR boards; elsewhere take
+ *		them from the sizes the compiler prints.
+ *	-	Nothing here talks to the sensor, so no sensor is needed.
+ */
+
+// Includes
+#include <FingerprintModule.h>
+#include <FingerprintScheduler.h>
+#include <FingerprintWatchdog.h>
+#include <FingerprintCodec.h>
+#include <FingerprintArchive.h>
+#include <FingerprintEmulator.h>
+
+// The label of the summary line, normally the commit being measured
+#ifndef FOOTPRINT_TAG
+#define FOOTPRINT_TAG "local"
+#endif
+
+// The most RAM a module with a scheduler and a watchdog may take in bytes, 0 for no limit
+#ifndef FOOTPRINT_DRIVER_BUDGET
+#define FOOTPRINT_DRIVER_BUDGET 0
+#endif
+
+// The most flash the sketch may use in bytes, 0 for no limit
+#ifndef FOOTPRINT_FLASH_BUDGET
+#define FOOTPRINT_FLASH_BUDGET 0
+#endif
+
+// The least RAM which must stay free with one module allocated, in bytes
+#ifndef FOOTPRINT_FREE_RAM
+#define FOOTPRINT_FREE_RAM 0
+#endif
+
+static_assert(FOOTPRINT_DRIVER_BUDGET == 0 || sizeof(FingerprintModule) + sizeof(FingerprintScheduler) + sizeof(FingerprintWatchdog) <= FOOTPRINT_DRIVER_BUDGET,
+	"The module, scheduler and watchdog are over FOOTPRINT_DRIVER_BUDGET");
+
+#ifdef __arm__
+extern "C" char* sbrk(int incr);
+#else
+extern char* __brkval;
+extern char* __malloc_heap_start;
+#endif
+
+#ifdef __AVR__
+extern char __data_load_end;	// End of the program and its initial data in flash
+extern char __heap_start;		// End of the static variables in RAM
+#endif
+
+// Set once the budgets are checked, false if one was exceeded
+bool withinBudget = true;
+
+/**
+ * Measures the RAM left between the heap and the stack.
+ *
+ * @return The number of free bytes
+ */
+int freeRam() {
+	char top;	// A variable at the top of the stack
+
+	#ifdef __arm__
+		return &top - reinterpret_cast<char*>(sbrk(0));
+	#else
+		return &top - (__brkval != 0x00 ? __brkval : __malloc_heap_start);
+	#endif
+}
+
+/**
+ * Prints one row of the report.
+ *
+ * @param name What takes the memory
+ * @param bytes How much it takes
+ */
+void printRow(const __FlashStringHelper* name, dword bytes) {
+	Serial.print(F("  "));
+	Serial.print(name);
+	Serial.print(F("\t"));
+	Serial.println(bytes);
+}
+
+void setup() {
+	dword flight = FLIGHT_RECORDER_SIZE * sizeof(FlightEntry);	// RAM taken by the flight recorder
+	dword metrics;													// RAM taken by the metrics counters
+	dword flash = 0;												// Flash used by the sketch, 0 if unknown
+	dword staticRam = 0;											// RAM used by static variables, 0 if unknown
+	int before, after;												// Free RAM before and after allocating a module
+	bool debug = false;												// Whether debug messages are compiled in
+	void* module;													// Room for a module
+
+	#ifdef DEBUG
+		debug = true;
+	#endif
+
+	#ifdef __AVR__
+		flash = (dword) &__data_load_end;
+		staticRam = (dword) &__heap_start - RAMSTART;
+	#endif
+
+	Serial.begin(115200);
+	while (!Serial);
+
+	metrics = METRIC_CMD_SLOTS * sizeof(CommandCount) + METRIC_ERR_SLOTS * sizeof(ErrorCount) + METRIC_BUCKETS * sizeof(dword);
+
+	Serial.println(F("Configuration"));
+	printRow(F("DATA_BUFFER_SIZE"), DATA_BUFFER_SIZE);
+	printRow(F("FLIGHT_RECORDER_SIZE"), FLIGHT_RECORDER_SIZE);
+	printRow(F("METRIC_CMD_SLOTS"), METRIC_CMD_SLOTS);
+	printRow(F("METRIC_ERR_SLOTS"), METRIC_ERR_SLOTS);
+	printRow(F("DEBUG"), debug);
+
+	Serial.println(F("FingerprintModule"));
+	printRow(F("data buffer"), DATA_BUFFER_SIZE);
+	printRow(F("flight recorder"), flight);
+	printRow(F("metrics"), metrics);
+	printRow(F("other state"), sizeof(FingerprintModule) - DATA_BUFFER_SIZE - flight - metrics);
+	printRow(F("total"), sizeof(FingerprintModule));
+
+	Serial.println(F("Other classes"));
+	printRow(F("FingerprintScheduler"), sizeof(FingerprintScheduler));
+	printRow(F("FingerprintWatchdog"), sizeof(FingerprintWatchdog));
+	printRow(F("FingerprintEncoder"), sizeof(FingerprintEncoder));
+	printRow(F("FingerprintDecoder"), sizeof(FingerprintDecoder));
+	printRow(F("FingerprintArchive"), sizeof(FingerprintArchive));
+	printRow(F("FingerprintEmulator"), sizeof(FingerprintEmulator));
+
+	// Take the room of one module for real, which is where small boards run out
+	before = freeRam();
+	module = malloc(sizeof(FingerprintModule));
+	after = freeRam();
+
+	Serial.println(F("Sketch"));
+	printRow(F("flash"), flash);
+	printRow(F("static RAM"), staticRam);
+	printRow(F("free RAM"), before);
+	Serial.print(F("  free RAM with a module\t"));
+	Serial.println(module != 0x00 ? after : -1);
+
+	if (FOOTPRINT_FLASH_BUDGET > 0 && flash > FOOTPRINT_FLASH_BUDGET) {
+		Serial.println(F("Over FOOTPRINT_FLASH_BUDGET"));
+		withinBudget = false;
+	}
+
+	if (FOOTPRINT_FREE_RAM > 0 && (module == 0x00 || after < FOOTPRINT_FREE_RAM)) {
+		Serial.println(F("Under FOOTPRINT_FREE_RAM"));
+		withinBudget = false;
+	}
+
+	free(module);
+
+	// One line per build, to diff across configurations and commits
+	Serial.print(F("footprint," FOOTPRINT_TAG ","));
+	Serial.print(DATA_BUFFER_SIZE);
+	Serial.print(F(","));
+	Serial.print(FLIGHT_RECORDER_SIZE);
+	Serial.print(F(","));
+	Serial.print(METRIC_CMD_SLOTS);
+	Serial.print(F(","));
+	Serial.print(METRIC_ERR_SLOTS);
+	Serial.print(F(","));
+	Serial.print(debug);
+	Serial.print(F(","));
+	Serial.print(sizeof(FingerprintModule));
+	Serial.print(F(","));
+	Serial.print(flash);
+	Serial.print(F(","));
+	Serial.print(staticRam);
+	Serial.print(F(","));
+	Serial.print(after);
+	Serial.print(F(","));
+	Serial.println(withinBudget ? F("ok") : F("over"));
+}
+
+void loop() {
+}
@@ -0,0 +1,241 @@
+/**
+ * Matching benchmark: enrolls galleries of synthetic fingers, then runs genuine and
+ * impostor trials to report the false reject and false accept rates of verification
+ * (1:1) and identification (1:N), and how many of each the sensor completes per second.
+ *
+ * Notes:
+ *	-	Matching happens on the sensor, so the trials run against a FingerprintEmulator on
+ *		a virtual clock, whose fingers are drawn by FingerprintSynth. Against the emulator
+ *		the figures are self-checks of the benchmark and the driver, not measurements: the
+ *		synthetic images play no part in matching, so the rates only come back as set with
+ *		setMatchErrors(), and the times as the emulator's fixed latencies, its 1:N search
+ *		taking 150 ms plus 20 ms per enrolled finger. The report is labelled accordingly.
+ *	-	To measure a real sensor, remove setStream() and setClock(), wire the sensor to
+ *		COMMS, present the fingers by hand when asked and set BENCH_EMULATED to 0; the
+ *		trials stay the same.
+ *	-	A genuine trial captures a new impression of an enrolled finger; an impostor trial
+ *		captures a finger which is not enrolled.
+ *	-	Comment out DEBUG in FingerprintModule.h first, or the debug messages will swamp
+ *		the report.
+ */
+
+// Includes
+#include <FingerprintModule.h>
+#include <FingerprintEmulator.h>
+#include <FingerprintSynth.h>
+
+// The gallery sizes benchmarked, at most EMU_DB_SIZE
+const uint8_t gallerySizes[] = { 5, 10, 20 };
+
+// The number of genuine and of impostor trials per gallery size
+#define BENCH_TRIALS 200
+
+// The matching errors the emulated sensor makes, per thousand
+#define BENCH_FALSE_REJECT 20
+#define BENCH_FALSE_ACCEPT 2
+
+// Impostor fingers are numbered from here, past any enrolled finger
+#define BENCH_IMPOSTORS 100
+
+// 1 while the trials run against the emulator, whose figures only check the benchmark, 0 on a real sensor
+#define BENCH_EMULATED 1
+
+// Counts the outcomes of a series of trials
+struct TrialStats {
+	dword genuine;			// Genuine trials
+	dword genuineOk;		// Genuine trials matched, to the right ID for 1:N
+	dword impostor;			// Impostor trials
+	dword impostorOk;		// Impostor trials matched, which they should not be
+	unsigned long time;		// Sensor time spent on the trials in milliseconds
+};
+
+FingerprintVirtualClock simClock;
+FingerprintEmulator emu(simClock);
+FingerprintModule fpm;
+FingerprintSynth synth;
+int16_t enrolling;		// The finger being enrolled
+
+/**
+ * Lifts the emulated finger when an enrollment asks for it to be removed and
+ * puts it back for the next capture, as a person would.
+ *
+ * @param evt What happened
+ * @param ctx Unused
+ */
+void onEnroll(const EnrollEvent& evt, void*) {
+	if (evt.type == ENROLL_STATE_CHANGE) {
+		if (evt.state == REMOVE_FINGER) {
+			emu.setFinger(EMU_NO_FINGER);
+		} else if (evt.state == CAPTURE) {
+			emu.setFinger(enrolling);
+		}
+	}
+}
+
+/**
+ * Prints a rate as a percentage.
+ *
+ * @param label What the rate is
+ * @param hits The number of trials counted in the rate
+ * @param total The number of trials
+ */
+void printRate(const __FlashStringHelper* label, dword hits, dword total) {
+	Serial.print(label);
+	Serial.print(total > 0 ? hits * 100.0 / total : 0.0, 2);
+	Serial.print(F("% ("));
+	Serial.print(hits);
+	Serial.print(F("/"));
+	Serial.print(total);
+	Serial.print(F(")  "));
+}
+
+/**
+ * Prints a throughput.
+ *
+ * @param count The number of operations
+ * @param time The time they took in milliseconds
+ * @param unit What the operations are
+ */
+void printSpeed(dword count, unsigned long time, const __FlashStringHelper* unit) {
+	Serial.print(time > 0 ? count * 1000.0 / time : 0.0, 2);
+	Serial.println(unit);
+}
+
+/**
+ * Enrolls fingers 0 to size - 1 at the IDs of the same numbers, after
+ * clearing the database.
+ *
+ * @param size The number of fingers
+ *
+ * @return True if every finger was enrolled, false otherwise
+ */
+bool enrollGallery(uint8_t size) {
+	unsigned long t = simClock.millis();
+
+	fpm.deleteAll();
+
+	for (enrolling = 0; enrolling < size; ++enrolling) {
+		emu.setFinger(enrolling);
+		if (!fpm.enrollSequence(enrolling, onEnroll)) {
+			Serial.print(F("  enrollment of finger "));
+			Serial.print(enrolling);
+			Serial.println(F(" failed"));
+			return false;
+		}
+	}
+	emu.setFinger(EMU_NO_FINGER);
+
+	Serial.print(F("  enrolled in "));
+	Serial.print((simClock.millis() - t) / 1000.0, 1);
+	Serial.print(F(" s, "));
+	printSpeed(size * 60UL, simClock.millis() - t, F(" fingers/min"));
+
+	return true;
+}
+
+/**
+ * Places a finger, captures it and runs a 1:1 or 1:N match against the
+ * gallery.
+ *
+ * @param finger The finger to present
+ * @param id The ID to verify against, or -1 to identify
+ *
+ * @return True if the match succeeded, and for 1:N found the finger's own ID
+ */
+bool trial(int16_t finger, int16_t id) {
+	bool ok;
+
+	emu.setFinger(finger);
+	if (!fpm.captureFingerprint()) {
+		return false;
+	}
+
+	if (id >= 0) {
+		ok = fpm.verify(id);
+	} else {
+		ok = fpm.identify() && (finger >= BENCH_IMPOSTORS || fpm.getResponseParam() == (dword) finger);
+	}
+	emu.setFinger(EMU_NO_FINGER);
+
+	return ok;
+}
+
+/**
+ * Runs the genuine and impostor trials of one mode against a gallery.
+ *
+ * @param size The size of the gallery
+ * @param oneToOne True for verification, false for identification
+ * @param stats Where to count the outcomes
+ */
+void runTrials(uint8_t size, bool oneToOne, TrialStats& stats) {
+	unsigned long t = simClock.millis();
+	int16_t finger;
+
+	memset(&stats, 0, sizeof(stats));
+
+	for (uint16_t i = 0; i < BENCH_TRIALS; ++i) {
+		finger = i % size;
+		++stats.genuine;
+		stats.genuineOk += trial(finger, oneToOne ? finger : -1);
+
+		finger = BENCH_IMPOSTORS + i;
+		++stats.impostor;
+		stats.impostorOk += trial(finger, oneToOne ? i % size : -1);
+	}
+
+	stats.time = simClock.millis() - t;
+}
+
+void setup() {
+	TrialStats stats;
+
+	Serial.begin(115200);
+	while (!Serial);
+
+	emu.setUart(115200);
+	emu.setFifoSize(EMU_FIFO_MAX);
+	emu.setMatchErrors(BENCH_FALSE_REJECT, BENCH_FALSE_ACCEPT);
+	fpm.setStream(&emu);
+	fpm.setClock(&simClock);
+	if (!fpm.open(true)) {
+		Serial.println(F("Open failed"));
+		return;
+	}
+
+	if (BENCH_EMULATED) {
+		Serial.print(F("Emulated sensor, self-check: expect FRR near "));
+		Serial.print(BENCH_FALSE_REJECT / 10.0, 1);
+		Serial.print(F("% and FAR near "));
+		Serial.print(BENCH_FALSE_ACCEPT / 10.0, 1);
+		Serial.println(F("% as set, and the emulator's fixed latencies"));
+	}
+
+	synth.select(0);
+	Serial.print(F("Synthetic finger 0, pattern "));
+	Serial.println(synth.getPattern());
+	synth.preview(Serial);
+
+	for (uint8_t g = 0; g < sizeof(gallerySizes); ++g) {
+		Serial.print(F("Gallery of "));
+		Serial.println(gallerySizes[g]);
+
+		if (!enrollGallery(gallerySizes[g])) {
+			continue;
+		}
+
+		runTrials(gallerySizes[g], true, stats);
+		Serial.print(F("  1:1  "));
+		printRate(F("FRR "), stats.genuine - stats.genuineOk, stats.genuine);
+		printRate(F("FAR "), stats.impostorOk, stats.impostor);
+		printSpeed(stats.genuine + stats.impostor, stats.time, F(" verifies/s"));
+
+		runTrials(gallerySizes[g], false, stats);
+		Serial.print(F("  1:N  "));
+		printRate(F("hit "), stats.genuineOk, stats.genuine);
+		printRate(F("FAR "), stats.impostorOk, stats.impostor);
+		printSpeed(stats.genuine + stats.impostor, stats.time, F(" identifies/s"));
+	}
+}
+
+void loop() {
+}
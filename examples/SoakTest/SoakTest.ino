@@ -0,0 +1,304 @@
+/**
+ * Soak test: runs several fingerprint modules against emulated sensors for hours of
+ * simulated time with a random mix of commands and an unreliable serial line, and fails
+ * as soon as latency drifts, errors pile up, a sensor stops recovering, or memory leaks.
+ *
+ * Notes:
+ *	-	No sensor is needed: every module talks to a FingerprintEmulator, and all of them
+ *		share one FingerprintVirtualClock, so hours of sensor time pass in minutes.
+ *	-	Each FingerprintModule holds a 51,846-byte data buffer. Four fit on boards with
+ *		256 KB of RAM; raise SOAK_SENSORS to a few dozen on boards with several MB.
+ *	-	Comment out DEBUG in FingerprintModule.h first, or the debug messages will
+ *		swamp the report.
+ *	-	Every SOAK_EPOCH milliseconds of sensor time a line is printed with the number of
+ *		commands, their average and worst latency, the link error rate, the latency drift
+ *		from the first epoch, the lowest free RAM seen and the fullest receive FIFO.
+ */
+
+// Includes
+#include <FingerprintModule.h>
+#include <FingerprintEmulator.h>
+
+// The number of sensors run side by side
+#define SOAK_SENSORS 4
+
+// The length of the run and of each reporting epoch, in milliseconds of sensor time
+#define SOAK_DURATION (4UL * 60 * 60 * 1000)
+#define SOAK_EPOCH (10UL * 60 * 1000)
+
+// Fault rates injected on every line, per thousand commands
+#define SOAK_DROP_RATE 5
+#define SOAK_CORRUPT_RATE 5
+#define SOAK_NOISE_RATE 10
+
+// Thresholds beyond which the run fails
+#define SOAK_MAX_DRIFT 25			// Largest change in average latency from the first epoch, in percent
+#define SOAK_MAX_ERROR_RATE 5		// Largest share of commands failing on link errors, in percent
+#define SOAK_MAX_STREAK 5			// Most link errors in a row on one sensor before it counts as stuck
+#define SOAK_MAX_LEAK 256			// Largest drop in free RAM from the first epoch, in bytes
+
+// The number of distinct fingers placed on the sensors
+#define SOAK_FINGERS 30
+
+// What is recorded for each sensor during an epoch
+struct SoakStats {
+	dword commands;			// Commands completed
+	dword linkErrors;		// Commands which failed on a link or device error
+	dword totalLatency;		// Sum of the latencies in milliseconds
+	dword maxLatency;		// Worst latency in milliseconds
+	uint8_t streak;			// Link errors in a row, across epochs
+};
+
+FingerprintVirtualClock simClock;
+FingerprintEmulator* emu[SOAK_SENSORS];
+FingerprintModule* fpm[SOAK_SENSORS];
+SoakStats stats[SOAK_SENSORS];
+
+unsigned long epochEnd;		// Sensor time at which the current epoch ends
+uint16_t epoch;				// Number of the current epoch
+dword baseLatency;			// Average latency over the first epoch
+int baseFreeRam;			// Free RAM at the end of the first epoch
+int minFreeRam;				// Lowest free RAM seen so far
+bool finished;				// True once the run has passed or failed
+
+#ifdef __arm__
+extern "C" char* sbrk(int incr);
+#else
+extern char* __brkval;
+extern char* __malloc_heap_start;
+#endif
+
+/**
+ * Measures the RAM left between the heap and the stack.
+ *
+ * @return The number of free bytes
+ */
+int freeRam() {
+	char top;	// A variable at the top of the stack
+
+	#ifdef __arm__
+		return &top - reinterpret_cast<char*>(sbrk(0));
+	#else
+		return &top - (__brkval != 0x00 ? __brkval : __malloc_heap_start);
+	#endif
+}
+
+/**
+ * Checks whether an error code means the link or the device failed rather
+ * than the sensor refusing a command as part of normal use.
+ *
+ * @param err The error code
+ *
+ * @return True for a link or device failure, false otherwise
+ */
+bool isLinkError(dword err) {
+	return err == NACK_NOT_RECVD || err == NACK_COMM_ERR || err == NACK_DEV_ERR || err == NACK_BAD_HEADER || err == NACK_BAD_ID || err == NACK_BAD_CHKSUM;
+}
+
+/**
+ * Records every completed command of a sensor.
+ *
+ * @param cmd Unused
+ * @param ok Whether the command was acknowledged
+ * @param param The response parameter or error code
+ * @param latency Time from command to outcome in milliseconds
+ * @param ctx The sensor's statistics
+ */
+void recordCommand(word, bool ok, dword param, dword latency, void* ctx) {
+	SoakStats* s = (SoakStats*) ctx;
+
+	++s->commands;
+	s->totalLatency += latency;
+	if (latency > s->maxLatency) {
+		s->maxLatency = latency;
+	}
+
+	if (!ok && isLinkError(param)) {
+		++s->linkErrors;
+		++s->streak;
+	} else {
+		s->streak = 0;
+	}
+}
+
+/**
+ * Runs one operation, picked at random, on the given sensor.
+ *
+ * @param i The index of the sensor
+ */
+void runOperation(uint8_t i) {
+	FingerprintModule& m = *fpm[i];
+	long pick = random(100);
+
+	// Someone touches the sensor, or walks away
+	emu[i]->setFinger(random(4) == 0 ? EMU_NO_FINGER : random(SOAK_FINGERS));
+
+	if (pick < 30) {
+		m.getEnrollCount();
+	} else if (pick < 50) {
+		m.isFingerPressed();
+	} else if (pick < 80) {
+		if (m.captureFingerprint()) {
+			m.identify();
+		}
+	} else if (pick < 90) {
+		if (m.captureFingerprint()) {
+			m.verify(random(EMU_DB_SIZE));
+		}
+	} else if (pick < 95) {
+		uint32_t id = random(EMU_DB_SIZE);
+
+		// Keep some room in the database by deleting as often as enrolling
+		if (!m.deleteID(id) && m.startEnrollment(id)) {
+			for (uint8_t stage = 0; stage < 3 && m.captureFingerprint(true) && m.createEnrollmentTemplate(); ++stage);
+		}
+	} else {
+		m.getTemplate(random(EMU_DB_SIZE));
+	}
+
+	// Time spent by the application between operations
+	simClock.advance(random(50, 500));
+}
+
+/**
+ * Prints the statistics of the epoch just ended, checks them against the
+ * thresholds and starts the next epoch.
+ *
+ * @return True if every threshold was met, false otherwise
+ */
+bool endEpoch() {
+	dword commands = 0;
+	dword linkErrors = 0;
+	dword totalLatency = 0;
+	dword maxLatency = 0;
+	uint16_t fifoHighWater = 0;
+	dword avgLatency;
+	long drift;
+	bool ok = true;
+
+	for (uint8_t i = 0; i < SOAK_SENSORS; ++i) {
+		commands += stats[i].commands;
+		linkErrors += stats[i].linkErrors;
+		totalLatency += stats[i].totalLatency;
+		if (stats[i].maxLatency > maxLatency) {
+			maxLatency = stats[i].maxLatency;
+		}
+		if (emu[i]->getFifoHighWater() > fifoHighWater) {
+			fifoHighWater = emu[i]->getFifoHighWater();
+		}
+
+		if (stats[i].streak >= SOAK_MAX_STREAK) {
+			Serial.print(F("FAIL: sensor "));
+			Serial.print(i);
+			Serial.println(F(" is no longer recovering from link errors"));
+			ok = false;
+		}
+
+		stats[i].commands = 0;
+		stats[i].linkErrors = 0;
+		stats[i].totalLatency = 0;
+		stats[i].maxLatency = 0;
+	}
+
+	avgLatency = commands > 0 ? totalLatency / commands : 0;
+	if (epoch == 0) {
+		baseLatency = avgLatency;
+		baseFreeRam = minFreeRam;
+	}
+	drift = baseLatency > 0 ? ((long) avgLatency - (long) baseLatency) * 100 / (long) baseLatency : 0;
+
+	Serial.print(epoch);
+	Serial.print(F("\t"));
+	Serial.print(simClock.millis() / 60000);
+	Serial.print(F(" min\t"));
+	Serial.print(commands);
+	Serial.print(F(" cmds\tavg "));
+	Serial.print(avgLatency);
+	Serial.print(F(" ms\tmax "));
+	Serial.print(maxLatency);
+	Serial.print(F(" ms\terrors "));
+	Serial.print(commands > 0 ? linkErrors * 100.0 / commands : 0.0);
+	Serial.print(F("%\tdrift "));
+	Serial.print(drift);
+	Serial.print(F("%\tfree RAM "));
+	Serial.print(minFreeRam);
+	Serial.print(F("\tFIFO "));
+	Serial.println(fifoHighWater);
+
+	if (drift > SOAK_MAX_DRIFT || drift < -SOAK_MAX_DRIFT) {
+		Serial.println(F("FAIL: average latency drifted beyond the threshold"));
+		ok = false;
+	}
+
+	if (commands > 0 && linkErrors * 100 > (dword) SOAK_MAX_ERROR_RATE * commands) {
+		Serial.println(F("FAIL: link error rate beyond the threshold"));
+		ok = false;
+	}
+
+	if (baseFreeRam - minFreeRam > SOAK_MAX_LEAK) {
+		Serial.println(F("FAIL: free RAM keeps shrinking"));
+		ok = false;
+	}
+
+	++epoch;
+	epochEnd += SOAK_EPOCH;
+
+	return ok;
+}
+
+void setup() {
+	Serial.begin(115200);
+	while (!Serial);
+
+	randomSeed(1);
+
+	for (uint8_t i = 0; i < SOAK_SENSORS; ++i) {
+		emu[i] = new FingerprintEmulator(simClock);
+		emu[i]->setUart(57600, 10, 20, i + 1);
+		emu[i]->setFaults(SOAK_DROP_RATE, SOAK_CORRUPT_RATE, SOAK_NOISE_RATE);
+
+		fpm[i] = new FingerprintModule();
+		fpm[i]->setStream(emu[i]);
+		fpm[i]->setClock(&simClock);
+		fpm[i]->setCommandObserver(recordCommand, &stats[i]);
+		fpm[i]->open(true);
+	}
+
+	minFreeRam = freeRam();
+	epochEnd = simClock.millis() + SOAK_EPOCH;
+	epoch = 0;
+	finished = false;
+
+	Serial.print(F("Soaking "));
+	Serial.print(SOAK_SENSORS);
+	Serial.print(F(" sensors for "));
+	Serial.print(SOAK_DURATION / 60000);
+	Serial.println(F(" minutes of sensor time"));
+}
+
+void loop() {
+	int ram;
+
+	if (finished) {
+		return;
+	}
+
+	for (uint8_t i = 0; i < SOAK_SENSORS; ++i) {
+		runOperation(i);
+	}
+
+	ram = freeRam();
+	if (ram < minFreeRam) {
+		minFreeRam = ram;
+	}
+
+	if ((long) (simClock.millis() - epochEnd) >= 0) {
+		if (!endEpoch()) {
+			Serial.println(F("Soak test FAILED"));
+			finished = true;
+		} else if (simClock.millis() >= SOAK_DURATION) {
+			Serial.println(F("Soak test PASSED"));
+			finished = true;
+		}
+	}
+}
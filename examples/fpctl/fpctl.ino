@@ -0,0 +1,503 @@
+/**
+ * fpctl: a command console for the fingerprint module. Type commands into the Serial
+ * Monitor to run any operation on the sensor wired to COMMS, or on an emulated one,
+ * and use "bench" to measure how fast a sensor answers a mix of commands.
+ *
+ * Notes:
+ *	-	Set the Serial Monitor to 115200 baud with a newline line ending, then type "help".
+ *	-	"use sensor" (the default) talks to the sensor on COMMS; "use emu" switches to a
+ *		FingerprintEmulator running on a virtual clock, with fingers 0 to FPCTL_FINGERS - 1
+ *		enrolled at the same IDs. "finger" places a finger on the emulated sensor.
+ *	-	"gettpl" prints a template in hex and keeps a copy, which "settpl" uploads to
+ *		another ID or, after "use", to another sensor.
+ *	-	"bench [runs] [op=weight ...]" runs a random mix of operations, e.g.
+ *		"bench 200 identify=3 count=1", then prints the latency percentiles and the
+ *		throughput. Operations: count, press, identify, verify, template, image.
+ *		Against the sensor, keep a finger on it for identify and verify. Against the
+ *		emulator, latencies are in sensor time, so a bench of hours runs in seconds.
+ *	-	Each FingerprintModule holds a 51,846-byte data buffer, so this needs a board
+ *		with plenty of RAM. Comment out DEBUG in FingerprintModule.h for readable output.
+ */
+
+// Includes
+#include <FingerprintModule.h>
+#include <FingerprintEmulator.h>
+
+// The longest command line accepted
+#define FPCTL_LINE_SIZE 96
+
+// The most runs a bench keeps latencies for
+#define FPCTL_BENCH_MAX 500
+
+// The longest an enrollment may take, in milliseconds
+#define FPCTL_ENROLL_TIME 60000
+
+// The number of fingers enrolled on the emulated sensor
+#define FPCTL_FINGERS 5
+
+// The operations a bench can mix
+enum BENCH_OP {
+	OP_COUNT,		// Get the enrollment count
+	OP_PRESS,		// Check whether a finger is pressed
+	OP_IDENTIFY,	// Capture then identify
+	OP_VERIFY,		// Capture then verify against ID 0
+	OP_TEMPLATE,	// Retrieve the template at ID 0
+	OP_IMAGE,		// Capture then retrieve the image
+	OP_TOTAL
+};
+
+const char* const opNames[OP_TOTAL] = { "count", "press", "identify", "verify", "template", "image" };
+
+FingerprintModule fpm;
+FingerprintVirtualClock simClock;
+FingerprintEmulator emu(simClock);
+bool usingEmu;					// True while talking to the emulator
+
+char line[FPCTL_LINE_SIZE];		// The command line being typed
+uint8_t lineLen;				// Number of characters typed so far
+
+byte templ[TEMPLATE_SIZE];		// The last template retrieved with gettpl
+bool haveTempl;					// True once templ holds a template
+
+dword latencies[FPCTL_BENCH_MAX];	// Latency of each bench run in milliseconds
+
+/**
+ * Prints the outcome of the last command: OK with the response parameter,
+ * or the error code and its meaning.
+ *
+ * @param ok Whether the command succeeded
+ *
+ * @return The given outcome
+ */
+bool report(bool ok) {
+	if (ok) {
+		Serial.print(F("OK "));
+		Serial.println(fpm.getResponseParam());
+	} else {
+		Serial.print(F("ERROR 0x"));
+		Serial.print(fpm.getErrorCode(), HEX);
+		Serial.print(F(" "));
+		Serial.println(fpm.strFromError(fpm.getErrorCode()));
+	}
+
+	return ok;
+}
+
+/**
+ * Reads the next argument of the command line as a number.
+ *
+ * @param def The value to use if there is no argument
+ *
+ * @return The number
+ */
+long nextNumber(long def) {
+	char* tok = strtok(0x00, " ");
+
+	return (tok != 0x00) ? atol(tok) : def;
+}
+
+/**
+ * Switches between the sensor on COMMS and the emulator.
+ *
+ * @param emulated True for the emulator, false for the sensor
+ */
+void useEmulator(bool emulated) {
+	usingEmu = emulated;
+
+	if (emulated) {
+		fpm.setStream(&emu);
+		fpm.setClock(&simClock);
+	} else {
+		fpm.setStream(0x00);
+		fpm.setClock(0x00);
+	}
+}
+
+/**
+ * Lifts the emulated finger when an enrollment asks for it to be removed and
+ * puts it back for the next capture, as a person would.
+ *
+ * @param evt What happened
+ * @param ctx The finger being enrolled
+ */
+void onEnroll(const EnrollEvent& evt, void* ctx) {
+	if (evt.type == ENROLL_STATE_CHANGE) {
+		Serial.print(F("  stage "));
+		Serial.print(evt.stage);
+		Serial.print(F(", state "));
+		Serial.println(evt.state);
+
+		if (usingEmu) {
+			if (evt.state == REMOVE_FINGER) {
+				emu.setFinger(EMU_NO_FINGER);
+			} else if (evt.state == CAPTURE) {
+				emu.setFinger(*(int16_t*) ctx);
+			}
+		}
+	}
+}
+
+/**
+ * Prints the template held in templ in hex, 32 bytes per line.
+ */
+void printTemplate() {
+	for (uint16_t i = 0; i < TEMPLATE_SIZE; ++i) {
+		if (templ[i] < 0x10) {
+			Serial.print(F("0"));
+		}
+		Serial.print(templ[i], HEX);
+
+		if (i % 32 == 31 || i == TEMPLATE_SIZE - 1) {
+			Serial.println();
+		}
+	}
+}
+
+/**
+ * Prints a summary of the image just retrieved, or the whole image as a
+ * plain PGM file which can be pasted into an image viewer.
+ *
+ * @param pgm True to print every pixel, false for a summary
+ */
+void printImage(bool pgm) {
+	const byte* img = fpm.getData();
+	dword sum = 0;		// Sum of the pixels
+	byte lo = 0xFF;		// Darkest pixel
+	byte hi = 0x00;		// Brightest pixel
+
+	if (pgm) {
+		Serial.println(F("P2 240 216 255"));
+	}
+
+	for (uint32_t i = 0; i < IMAGE_SIZE; ++i) {
+		sum += img[i];
+		lo = min(lo, img[i]);
+		hi = max(hi, img[i]);
+
+		if (pgm) {
+			Serial.print(img[i]);
+			Serial.print(i % 240 == 239 ? F("\n") : F(" "));
+		}
+	}
+
+	Serial.print(F("240x216 image, pixels "));
+	Serial.print(lo);
+	Serial.print(F("-"));
+	Serial.print(hi);
+	Serial.print(F(", mean "));
+	Serial.println(sum / IMAGE_SIZE);
+}
+
+/**
+ * Runs one bench operation.
+ *
+ * @param op The operation
+ *
+ * @return True if it succeeded, false otherwise
+ */
+bool runOperation(BENCH_OP op) {
+	switch (op) {
+		case OP_COUNT:
+			return fpm.getEnrollCount();
+
+		case OP_PRESS:
+			return fpm.isFingerPressed();
+
+		case OP_IDENTIFY:
+			return fpm.captureFingerprint() && fpm.identify();
+
+		case OP_VERIFY:
+			return fpm.captureFingerprint() && fpm.verify(0);
+
+		case OP_TEMPLATE:
+			return fpm.getTemplate(0);
+
+		default:
+			return fpm.captureFingerprint() && fpm.getImage();
+	}
+}
+
+/**
+ * Prints a latency percentile of the sorted bench results.
+ *
+ * @param label The name of the percentile
+ * @param pct The percentile
+ * @param runs The number of results
+ */
+void printPercentile(const __FlashStringHelper* label, uint8_t pct, uint16_t runs) {
+	uint16_t rank = ((uint32_t) pct * runs + 99) / 100;	// Nearest rank, counting from 1
+
+	Serial.print(label);
+	Serial.print(latencies[rank > 0 ? rank - 1 : 0]);
+	Serial.println(F(" ms"));
+}
+
+/**
+ * Runs the bench command: the number of runs, then any number of
+ * operation=weight pairs picking the mix. Without pairs the mix is mostly
+ * identifications with some of everything else but images.
+ */
+void bench() {
+	uint16_t weights[OP_TOTAL] = { 2, 2, 4, 1, 1, 0 };	// Relative frequency of each operation
+	dword opRuns[OP_TOTAL] = { 0 };						// Runs of each operation
+	dword opTime[OP_TOTAL] = { 0 };						// Time spent in each operation
+	uint16_t runs = nextNumber(100);
+	uint16_t total = 0;									// Sum of the weights
+	uint16_t failed = 0;
+	bool custom = false;
+	unsigned long started;
+	dword elapsed;
+	char* tok;
+
+	runs = constrain(runs, 1, FPCTL_BENCH_MAX);
+
+	while ((tok = strtok(0x00, " ")) != 0x00) {
+		char* eq = strchr(tok, '=');
+		uint8_t op;
+
+		if (eq == 0x00) {
+			continue;
+		}
+		*eq = '\0';
+
+		for (op = 0; op < OP_TOTAL && strcmp(tok, opNames[op]) != 0; ++op);
+		if (op == OP_TOTAL) {
+			Serial.print(F("Unknown operation "));
+			Serial.println(tok);
+			return;
+		}
+
+		// The first pair replaces the default mix
+		if (!custom) {
+			memset(weights, 0, sizeof(weights));
+			custom = true;
+		}
+		weights[op] = atoi(eq + 1);
+	}
+
+	for (uint8_t op = 0; op < OP_TOTAL; ++op) {
+		total += weights[op];
+	}
+	if (total == 0) {
+		Serial.println(F("Every weight is zero"));
+		return;
+	}
+
+	started = fpm.getClock().millis();
+
+	for (uint16_t i = 0; i < runs; ++i) {
+		long pick = random(total);
+		uint8_t op;
+		unsigned long t;
+
+		for (op = 0; pick >= weights[op]; pick -= weights[op++]);
+
+		if (usingEmu) {
+			emu.setFinger(random(FPCTL_FINGERS));
+		}
+
+		t = fpm.getClock().millis();
+		failed += !runOperation((BENCH_OP) op);
+		latencies[i] = fpm.getClock().millis() - t;
+
+		++opRuns[op];
+		opTime[op] += latencies[i];
+	}
+
+	elapsed = fpm.getClock().millis() - started;
+
+	// Sort the latencies for the percentiles, insertion sort being plenty for a few hundred
+	for (uint16_t i = 1; i < runs; ++i) {
+		dword v = latencies[i];
+		uint16_t j;
+
+		for (j = i; j > 0 && latencies[j - 1] > v; --j) {
+			latencies[j] = latencies[j - 1];
+		}
+		latencies[j] = v;
+	}
+
+	Serial.print(runs);
+	Serial.print(F(" runs, "));
+	Serial.print(failed);
+	Serial.print(F(" failed, "));
+	Serial.print(elapsed);
+	Serial.print(F(" ms, "));
+	Serial.print(elapsed > 0 ? runs * 1000.0 / elapsed : 0.0);
+	Serial.println(F(" ops/s"));
+
+	printPercentile(F("  p50 "), 50, runs);
+	printPercentile(F("  p90 "), 90, runs);
+	printPercentile(F("  p99 "), 99, runs);
+	Serial.print(F("  max "));
+	Serial.print(latencies[runs - 1]);
+	Serial.println(F(" ms"));
+
+	for (uint8_t op = 0; op < OP_TOTAL; ++op) {
+		if (opRuns[op] > 0) {
+			Serial.print(F("  "));
+			Serial.print(opNames[op]);
+			Serial.print(F(": "));
+			Serial.print(opRuns[op]);
+			Serial.print(F(" runs, mean "));
+			Serial.print(opTime[op] / opRuns[op]);
+			Serial.println(F(" ms"));
+		}
+	}
+}
+
+/**
+ * Prints the list of commands.
+ */
+void help() {
+	Serial.println(F("use sensor|emu          switch between the sensor on COMMS and the emulator"));
+	Serial.println(F("open | close            open or close the sensor"));
+	Serial.println(F("led on|off              switch the CMOS LED"));
+	Serial.println(F("baud <rate>             change the baudrate"));
+	Serial.println(F("count                   number of enrolled fingerprints"));
+	Serial.println(F("enrolled <id>           check whether an ID is enrolled"));
+	Serial.println(F("press                   check whether a finger is pressed"));
+	Serial.println(F("capture [hq]            capture a fingerprint, hq for high quality"));
+	Serial.println(F("enroll <id>             run a full enrollment"));
+	Serial.println(F("delete <id>|all         delete one or every fingerprint"));
+	Serial.println(F("verify <id> | identify  match the captured fingerprint"));
+	Serial.println(F("gettpl <id>             print and keep the template of an ID"));
+	Serial.println(F("settpl <id>             upload the kept template to an ID"));
+	Serial.println(F("image [pgm]             fetch the captured image, pgm to print it"));
+	Serial.println(F("finger <n>|none         place a finger on the emulated sensor"));
+	Serial.println(F("metrics | flight        print the counters or the flight recorder"));
+	Serial.println(F("bench [runs] [op=w ...] measure a mix of operations"));
+}
+
+/**
+ * Runs the command line just typed.
+ */
+void runLine() {
+	char* cmd = strtok(line, " ");
+	char* arg;
+
+	if (cmd == 0x00) {
+		return;
+	}
+
+	if (strcmp(cmd, "help") == 0) {
+		help();
+	} else if (strcmp(cmd, "use") == 0) {
+		arg = strtok(0x00, " ");
+		useEmulator(arg != 0x00 && strcmp(arg, "emu") == 0);
+		Serial.println(usingEmu ? F("Using the emulator") : F("Using the sensor on COMMS"));
+	} else if (strcmp(cmd, "open") == 0) {
+		if (report(fpm.open(true))) {
+			Serial.print(F("Firmware "));
+			Serial.print(fpm.getDeviceInfo().firmwareVersion, HEX);
+			Serial.print(F(", "));
+			Serial.print(fpm.getBaudrate());
+			Serial.println(F(" bps"));
+		}
+	} else if (strcmp(cmd, "close") == 0) {
+		report(fpm.close());
+	} else if (strcmp(cmd, "led") == 0) {
+		arg = strtok(0x00, " ");
+		report(fpm.powerCMOS(arg != 0x00 && strcmp(arg, "on") == 0));
+	} else if (strcmp(cmd, "baud") == 0) {
+		report(fpm.changeBaudrate(nextNumber(9600)));
+	} else if (strcmp(cmd, "count") == 0) {
+		report(fpm.getEnrollCount());
+	} else if (strcmp(cmd, "enrolled") == 0) {
+		report(fpm.isIDEnrolled(nextNumber(0)));
+	} else if (strcmp(cmd, "press") == 0) {
+		report(fpm.isFingerPressed());
+	} else if (strcmp(cmd, "capture") == 0) {
+		arg = strtok(0x00, " ");
+		report(fpm.captureFingerprint(arg != 0x00 && strcmp(arg, "hq") == 0));
+	} else if (strcmp(cmd, "enroll") == 0) {
+		int16_t finger = emu.getFinger();	// The finger to put back between captures on the emulator
+
+		// Give up if nobody puts a finger on the sensor
+		fpm.setDeadline(FPCTL_ENROLL_TIME);
+		report(fpm.enrollSequence(nextNumber(0), onEnroll, &finger));
+		fpm.clearDeadline();
+	} else if (strcmp(cmd, "delete") == 0) {
+		arg = strtok(0x00, " ");
+		if (arg != 0x00 && strcmp(arg, "all") == 0) {
+			report(fpm.deleteAll());
+		} else {
+			report(fpm.deleteID(arg != 0x00 ? atol(arg) : 0));
+		}
+	} else if (strcmp(cmd, "verify") == 0) {
+		report(fpm.verify(nextNumber(0)));
+	} else if (strcmp(cmd, "identify") == 0) {
+		report(fpm.identify());
+	} else if (strcmp(cmd, "gettpl") == 0) {
+		if (report(fpm.getTemplate(nextNumber(0)))) {
+			memcpy(templ, fpm.getData(), TEMPLATE_SIZE);
+			haveTempl = true;
+			printTemplate();
+		}
+	} else if (strcmp(cmd, "settpl") == 0) {
+		if (!haveTempl) {
+			Serial.println(F("No template kept, use gettpl first"));
+		} else {
+			report(fpm.setTemplate(nextNumber(0), templ));
+		}
+	} else if (strcmp(cmd, "image") == 0) {
+		arg = strtok(0x00, " ");
+		if (report(fpm.getImage())) {
+			printImage(arg != 0x00 && strcmp(arg, "pgm") == 0);
+		}
+	} else if (strcmp(cmd, "finger") == 0) {
+		arg = strtok(0x00, " ");
+		emu.setFinger(arg == 0x00 || strcmp(arg, "none") == 0 ? EMU_NO_FINGER : atoi(arg));
+		Serial.println(F("OK"));
+	} else if (strcmp(cmd, "metrics") == 0) {
+		fpm.writeMetrics(Serial, usingEmu ? "emu" : "sensor");
+	} else if (strcmp(cmd, "flight") == 0) {
+		fpm.dumpFlightRecorder(Serial);
+	} else if (strcmp(cmd, "bench") == 0) {
+		bench();
+	} else {
+		Serial.print(F("Unknown command "));
+		Serial.print(cmd);
+		Serial.println(F(", try help"));
+	}
+}
+
+void setup() {
+	Serial.begin(115200);
+	while (!Serial);
+
+	randomSeed(analogRead(0));
+
+	// Give the emulated sensor something to identify
+	for (uint8_t i = 0; i < FPCTL_FINGERS; ++i) {
+		emu.enroll(i, i);
+	}
+	emu.setUart(115200);
+	emu.setFifoSize(EMU_FIFO_MAX);
+
+	useEmulator(false);
+	lineLen = 0;
+	haveTempl = false;
+
+	Serial.println(F("fpctl ready, type help"));
+	Serial.print(F("> "));
+}
+
+void loop() {
+	while (Serial.available()) {
+		char c = Serial.read();
+
+		if (c == '\n' || c == '\r') {
+			if (lineLen > 0) {
+				Serial.println(line);
+				runLine();
+				lineLen = 0;
+				Serial.print(F("> "));
+			}
+		} else if (lineLen < FPCTL_LINE_SIZE - 1) {
+			line[lineLen++] = c;
+		}
+
+		line[lineLen] = '\0';
+	}
+}